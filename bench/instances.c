@@ -0,0 +1,169 @@
+/**
+ * This benchmark measures the scheduler with many live script instances. It
+ * starts the same script many times, each instance delaying itself by 1 to 8
+ * tics in a loop, and reports the time and, where the hardware counters can be
+ * read, the number of cache misses per tic.
+ *
+ * Usage: instances [instances] [tics]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined( __linux__ )
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "acsvm.h"
+
+/**
+ * Object file with one closed script that takes the delay as its argument:
+ *
+ *    script 1 ( int delay_amount ) {
+ *       while ( true ) {
+ *          Delay( delay_amount );
+ *          ++count; // Map variable 0.
+ *       }
+ *    }
+ */
+static const unsigned char g_object[] = {
+   // Header: the chunks are found through the header at offset 42.
+   'A', 'C', 'S', '\0', 42, 0, 0, 0,
+   // Code, at offset 8.
+   28, 0, // PCD_PUSHSCRIPTVAR 0
+   55, // PCD_DELAY
+   47, 0, // PCD_INCMAPVAR 0
+   52, 8, 0, 0, 0, // PCD_GOTO 8
+   // SPTR chunk: script 1, closed, one argument, at offset 8.
+   'S', 'P', 'T', 'R', 8, 0, 0, 0,
+   1, 0, 0, 1, 8, 0, 0, 0,
+   // Offset of the chunks, and the format.
+   18, 0, 0, 0,
+   'A', 'C', 'S', 'e',
+   0, 0, 0, 0, 0, 0, 0, 0
+};
+
+struct counter {
+   int fd;
+};
+
+static void write_output( const char* text, ptrdiff_t length, void* data );
+static void start_counter( struct counter* counter );
+static long long stop_counter( struct counter* counter );
+static double get_time( void );
+
+int main( int argc, char* argv[] ) {
+   int32_t num_instances = 50000;
+   int32_t tics = 100;
+   if ( argc > 1 ) {
+      num_instances = atoi( argv[ 1 ] );
+   }
+   if ( argc > 2 ) {
+      tics = atoi( argv[ 2 ] );
+   }
+   if ( num_instances <= 0 || tics <= 0 ) {
+      fprintf( stderr, "usage: %s [instances] [tics]\n", argv[ 0 ] );
+      return EXIT_FAILURE;
+   }
+   struct acsvm* vm = acsvm_create();
+   if ( vm == NULL ) {
+      fprintf( stderr, "error: failed to create virtual machine\n" );
+      return EXIT_FAILURE;
+   }
+   acsvm_set_output( vm, write_output, NULL );
+   bool ok = acsvm_add_module( vm, "", g_object, sizeof( g_object ) ) &&
+      acsvm_start( vm );
+   for ( int32_t i = 0; i < num_instances && ok; ++i ) {
+      int32_t delay_amount = 1 + i % 8;
+      ok = acsvm_execute( vm, 1, &delay_amount, 1 );
+   }
+   // Run the first tic outside the measurement, so every instance has been
+   // queued by its delay.
+   ok = ok && acsvm_run( vm, 1 );
+   if ( ! ok ) {
+      fprintf( stderr, "error: failed to start the scripts\n" );
+      acsvm_destroy( vm );
+      return EXIT_FAILURE;
+   }
+   struct counter counter;
+   start_counter( &counter );
+   double start_time = get_time();
+   ok = acsvm_run( vm, tics );
+   double elapsed_time = get_time() - start_time;
+   long long misses = stop_counter( &counter );
+   int32_t count = 0;
+   acsvm_get_map_var( vm, "", 0, &count );
+   acsvm_destroy( vm );
+   if ( ! ok ) {
+      fprintf( stderr, "error: failed to run the scripts\n" );
+      return EXIT_FAILURE;
+   }
+   printf( "instances: %d\n", num_instances );
+   printf( "tics: %d\n", tics );
+   printf( "time per tic: %.1f us\n", elapsed_time * 1e6 / tics );
+   if ( misses >= 0 ) {
+      printf( "cache misses per tic: %lld\n", misses / tics );
+   }
+   else {
+      printf( "cache misses per tic: not available\n" );
+   }
+   // The number of times the loop ran, to compare builds with.
+   printf( "count: %d\n", count );
+   return EXIT_SUCCESS;
+}
+
+static void write_output( const char* text, ptrdiff_t length, void* data ) {
+   fwrite( text, 1, length, stderr );
+}
+
+/**
+ * Counts the cache misses of this process, in user space only. The counter
+ * is not available outside Linux, or when the kernel does not allow it.
+ */
+static void start_counter( struct counter* counter ) {
+   counter->fd = -1;
+#if defined( __linux__ )
+   struct perf_event_attr attr;
+   memset( &attr, 0, sizeof( attr ) );
+   attr.type = PERF_TYPE_HARDWARE;
+   attr.size = sizeof( attr );
+   attr.config = PERF_COUNT_HW_CACHE_MISSES;
+   attr.disabled = 1;
+   attr.exclude_kernel = 1;
+   attr.exclude_hv = 1;
+   counter->fd = syscall( __NR_perf_event_open, &attr, 0, -1, -1, 0 );
+   if ( counter->fd >= 0 ) {
+      ioctl( counter->fd, PERF_EVENT_IOC_RESET, 0 );
+      ioctl( counter->fd, PERF_EVENT_IOC_ENABLE, 0 );
+   }
+#endif
+}
+
+/**
+ * Returns the number of cache misses counted, or -1 if there is no counter.
+ */
+static long long stop_counter( struct counter* counter ) {
+   long long misses = -1;
+#if defined( __linux__ )
+   if ( counter->fd >= 0 ) {
+      ioctl( counter->fd, PERF_EVENT_IOC_DISABLE, 0 );
+      if ( read( counter->fd, &misses, sizeof( misses ) ) !=
+         sizeof( misses ) ) {
+         misses = -1;
+      }
+      close( counter->fd );
+   }
+#endif
+   return misses;
+}
+
+static double get_time( void ) {
+   struct timespec time;
+   clock_gettime( CLOCK_MONOTONIC, &time );
+   return time.tv_sec + time.tv_nsec / 1e9;
+}
@@ -0,0 +1,432 @@
+/**
+ * This file implements the library interface. Every function switches the
+ * thread to the memory arena of the virtual machine, and sets a bail point,
+ * so an error, or a failed allocation, returns to the function instead of
+ * ending the program.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include "common/misc.h"
+#include "common/mem.h"
+#include "common/str.h"
+#include "common/list.h"
+#include "vm.h"
+#include "acsvm.h"
+
+struct acsvm {
+   struct vm vm;
+   struct options options;
+   struct mem_arena* arena;
+   void ( *write )( const char* text, ptrdiff_t length, void* data );
+   void* write_data;
+   bool started;
+   bool failed;
+};
+
+// What a library function replaces on entry, and puts back when it returns.
+// A host function can call the library while the virtual machine runs, so
+// calls can be nested.
+struct lib_call {
+   struct mem_arena* prev_arena;
+   jmp_buf* prev_bail;
+};
+
+static void fail_alloc( void* data );
+static void enter( struct acsvm* acsvm, struct lib_call* call, jmp_buf* bail );
+static bool leave( struct acsvm* acsvm, struct lib_call* call );
+static bool fail( struct acsvm* acsvm, struct lib_call* call );
+static bool in_call( struct acsvm* acsvm );
+static void write_output( const char* text, isize length, void* data );
+static bool save_checkpoint( struct acsvm* acsvm, bool increment,
+   void** data, size_t* size );
+static bool bind( struct acsvm* acsvm, int32_t kind, int32_t id,
+   acsvm_host_func func, void* data );
+
+enum {
+   BIND_LSPEC,
+   BIND_BUILTIN,
+   BIND_CALLFUNC
+};
+
+/**
+ * Returns NULL if there is not enough memory.
+ */
+struct acsvm* acsvm_create( void ) {
+   // Allocated outside the arena, so it is available to report a failed
+   // allocation from the arena.
+   struct acsvm* acsvm = malloc( sizeof( *acsvm ) );
+   if ( acsvm == NULL ) {
+      return NULL;
+   }
+   acsvm->arena = mem_create_arena();
+   if ( acsvm->arena == NULL ) {
+      free( acsvm );
+      return NULL;
+   }
+   acsvm->write = NULL;
+   acsvm->write_data = NULL;
+   acsvm->started = false;
+   acsvm->failed = false;
+   acsvm->vm.bail = NULL;
+   struct lib_call call;
+   jmp_buf bail;
+   enter( acsvm, &call, &bail );
+   mem_set_fail_handler( fail_alloc, acsvm );
+   if ( setjmp( bail ) != 0 ) {
+      mem_use_arena( call.prev_arena );
+      mem_destroy_arena( acsvm->arena );
+      free( acsvm );
+      return NULL;
+   }
+   vm_init_options( &acsvm->options );
+   vm_init( &acsvm->vm, &acsvm->options );
+   leave( acsvm, &call );
+   return acsvm;
+}
+
+static void fail_alloc( void* data ) {
+   struct acsvm* acsvm = data;
+   v_bail( &acsvm->vm );
+}
+
+static void enter( struct acsvm* acsvm, struct lib_call* call,
+   jmp_buf* bail ) {
+   call->prev_bail = acsvm->vm.bail;
+   call->prev_arena = mem_use_arena( acsvm->arena );
+   acsvm->vm.bail = bail;
+}
+
+/**
+ * Returns false if a nested call, made by a host function during this call,
+ * failed.
+ */
+static bool leave( struct acsvm* acsvm, struct lib_call* call ) {
+   acsvm->vm.bail = call->prev_bail;
+   mem_use_arena( call->prev_arena );
+   return ( ! acsvm->failed );
+}
+
+/**
+ * Called after returning to a bail point. The state of the virtual machine
+ * cannot be trusted anymore, so it is no longer run.
+ */
+static bool fail( struct acsvm* acsvm, struct lib_call* call ) {
+   acsvm->failed = true;
+   // Show the error message.
+   output_flush( &acsvm->vm.output );
+   acsvm->vm.bail = call->prev_bail;
+   mem_use_arena( call->prev_arena );
+   return false;
+}
+
+/**
+ * Returns whether a library function is running, which means the caller is a
+ * host function.
+ */
+static bool in_call( struct acsvm* acsvm ) {
+   return ( acsvm->vm.bail != NULL );
+}
+
+/**
+ * Frees all memory used by the virtual machine.
+ */
+void acsvm_destroy( struct acsvm* acsvm ) {
+   if ( ! acsvm->failed ) {
+      output_flush( &acsvm->vm.output );
+   }
+   mem_destroy_arena( acsvm->arena );
+   free( acsvm );
+}
+
+void acsvm_set_seed( struct acsvm* acsvm, uint64_t seed ) {
+   rng_seed( &acsvm->vm.rng, seed );
+}
+
+/**
+ * Sends the output of the virtual machine, which includes printed text and
+ * error messages, to the specified function instead of to standard output.
+ * The text is given in blocks, at least once per tic.
+ */
+void acsvm_set_output( struct acsvm* acsvm,
+   void ( *write )( const char* text, ptrdiff_t length, void* data ),
+   void* data ) {
+   if ( acsvm->failed ) {
+      return;
+   }
+   struct mem_arena* prev_arena = mem_use_arena( acsvm->arena );
+   output_deinit( &acsvm->vm.output );
+   acsvm->write = write;
+   acsvm->write_data = data;
+   output_init( &acsvm->vm.output, write_output, acsvm );
+   mem_use_arena( prev_arena );
+}
+
+static void write_output( const char* text, isize length, void* data ) {
+   struct acsvm* acsvm = data;
+   acsvm->write( text, length, acsvm->write_data );
+}
+
+/**
+ * Adds a module read from memory. The data is copied. The main module has an
+ * empty name. Modules can only be added before the virtual machine is
+ * started.
+ */
+bool acsvm_add_module( struct acsvm* acsvm, const char* name,
+   const void* data, size_t size ) {
+   if ( acsvm->failed || acsvm->started ) {
+      return false;
+   }
+   struct lib_call call;
+   jmp_buf bail;
+   enter( acsvm, &call, &bail );
+   if ( setjmp( bail ) != 0 ) {
+      return fail( acsvm, &call );
+   }
+   struct module_arg* arg = mem_alloc( sizeof( *arg ) );
+   char* name_copy = mem_alloc( strlen( name ) + 1 );
+   strcpy( name_copy, name );
+   u8* data_copy = mem_alloc( size );
+   memcpy( data_copy, data, size );
+   arg->name = name_copy;
+   arg->path = NULL;
+   arg->data = data_copy;
+   arg->size = size;
+   list_append( &acsvm->options.modules, arg );
+   return leave( acsvm, &call );
+}
+
+bool acsvm_bind_lspec( struct acsvm* acsvm, int32_t id, acsvm_host_func func,
+   void* data ) {
+   return bind( acsvm, BIND_LSPEC, id, func, data );
+}
+
+/**
+ * Returns false if the opcode does not run a builtin.
+ */
+bool acsvm_bind_builtin( struct acsvm* acsvm, int32_t opcode,
+   acsvm_host_func func, void* data ) {
+   return bind( acsvm, BIND_BUILTIN, opcode, func, data );
+}
+
+bool acsvm_bind_callfunc( struct acsvm* acsvm, int32_t id,
+   acsvm_host_func func, void* data ) {
+   return bind( acsvm, BIND_CALLFUNC, id, func, data );
+}
+
+static bool bind( struct acsvm* acsvm, int32_t kind, int32_t id,
+   acsvm_host_func func, void* data ) {
+   if ( acsvm->failed ) {
+      return false;
+   }
+   struct lib_call call;
+   jmp_buf bail;
+   enter( acsvm, &call, &bail );
+   if ( setjmp( bail ) != 0 ) {
+      return fail( acsvm, &call );
+   }
+   struct host_func host_func = { func, data };
+   bool bound = true;
+   switch ( kind ) {
+   case BIND_LSPEC:
+      vm_bind_lspec( &acsvm->vm, id, host_func );
+      break;
+   case BIND_BUILTIN:
+      bound = vm_bind_builtin( &acsvm->vm, id, host_func );
+      break;
+   default:
+      vm_bind_callfunc( &acsvm->vm, id, host_func );
+      break;
+   }
+   return ( leave( acsvm, &call ) && bound );
+}
+
+/**
+ * Loads the modules and starts the OPEN scripts. The scripts first run in the
+ * next call to acsvm_run().
+ */
+bool acsvm_start( struct acsvm* acsvm ) {
+   if ( acsvm->failed || acsvm->started ) {
+      return false;
+   }
+   struct lib_call call;
+   jmp_buf bail;
+   enter( acsvm, &call, &bail );
+   if ( setjmp( bail ) != 0 ) {
+      return fail( acsvm, &call );
+   }
+   vm_start( &acsvm->vm );
+   acsvm->started = true;
+   return leave( acsvm, &call );
+}
+
+/**
+ * Runs the specified number of tics, without waiting between them.
+ */
+bool acsvm_run( struct acsvm* acsvm, int32_t tics ) {
+   if ( acsvm->failed || ! acsvm->started || in_call( acsvm ) ) {
+      return false;
+   }
+   struct lib_call call;
+   jmp_buf bail;
+   enter( acsvm, &call, &bail );
+   if ( setjmp( bail ) != 0 ) {
+      return fail( acsvm, &call );
+   }
+   vm_run_tics( &acsvm->vm, tics );
+   return leave( acsvm, &call );
+}
+
+/**
+ * Starts a script, which runs in the next tic. Returns false if there is no
+ * script with the number.
+ */
+bool acsvm_execute( struct acsvm* acsvm, int32_t script, const int32_t* args,
+   int32_t num_args ) {
+   if ( acsvm->failed || ! acsvm->started ) {
+      return false;
+   }
+   struct lib_call call;
+   jmp_buf bail;
+   enter( acsvm, &call, &bail );
+   if ( setjmp( bail ) != 0 ) {
+      return fail( acsvm, &call );
+   }
+   bool started = vm_start_script( &acsvm->vm, script, args, num_args );
+   return ( leave( acsvm, &call ) && started );
+}
+
+/**
+ * Saves the state of the scripts and variables, for acsvm_restore(). The
+ * checkpoint is allocated with malloc(), and the program frees it with
+ * free(). Returns false if the state cannot be saved right now, because a
+ * script is delayed inside a function or waits for another script, or if
+ * there is not enough memory.
+ */
+bool acsvm_checkpoint( struct acsvm* acsvm, void** data, size_t* size ) {
+   return save_checkpoint( acsvm, false, data, size );
+}
+
+/**
+ * Saves the changes since the last checkpoint saved or restored, which is
+ * much smaller than a whole checkpoint when the scripts wrote little. To
+ * restore the state, restore the last whole checkpoint and then each
+ * increment, in order. Returns false if there is no earlier checkpoint.
+ */
+bool acsvm_checkpoint_increment( struct acsvm* acsvm, void** data,
+   size_t* size ) {
+   return save_checkpoint( acsvm, true, data, size );
+}
+
+static bool save_checkpoint( struct acsvm* acsvm, bool increment,
+   void** data, size_t* size ) {
+   if ( acsvm->failed || ! acsvm->started || in_call( acsvm ) ) {
+      return false;
+   }
+   struct lib_call call;
+   jmp_buf bail;
+   enter( acsvm, &call, &bail );
+   if ( setjmp( bail ) != 0 ) {
+      return fail( acsvm, &call );
+   }
+   struct checkpoint checkpoint;
+   vm_init_checkpoint( &checkpoint );
+   bool saved = increment ?
+      vm_checkpoint_increment( &acsvm->vm, &checkpoint ) :
+      vm_checkpoint( &acsvm->vm, &checkpoint );
+   if ( saved ) {
+      *data = malloc( checkpoint.size );
+      *size = checkpoint.size;
+      if ( *data != NULL ) {
+         memcpy( *data, checkpoint.data, checkpoint.size );
+      }
+      saved = ( *data != NULL );
+   }
+   // Show why the checkpoint was not saved.
+   output_flush( &acsvm->vm.output );
+   vm_deinit_checkpoint( &checkpoint );
+   return ( leave( acsvm, &call ) && saved );
+}
+
+/**
+ * Replaces the state of the scripts and variables with a checkpoint saved by
+ * acsvm_checkpoint(), possibly in another process. The virtual machine must
+ * be started, with the same modules as the one the checkpoint was saved from.
+ * The data is only read, so it can be a mapped file. Returns false, and
+ * leaves the virtual machine unchanged, if the checkpoint cannot be restored.
+ */
+bool acsvm_restore( struct acsvm* acsvm, const void* data, size_t size ) {
+   if ( acsvm->failed || ! acsvm->started || in_call( acsvm ) ) {
+      return false;
+   }
+   struct lib_call call;
+   jmp_buf bail;
+   enter( acsvm, &call, &bail );
+   if ( setjmp( bail ) != 0 ) {
+      return fail( acsvm, &call );
+   }
+   bool restored = vm_restore( &acsvm->vm, data, size );
+   // Show why the checkpoint was rejected.
+   output_flush( &acsvm->vm.output );
+   return ( leave( acsvm, &call ) && restored );
+}
+
+/**
+ * Returns false if the module or the variable does not exist.
+ */
+bool acsvm_get_map_var( struct acsvm* acsvm, const char* module_name,
+   int32_t index, int32_t* value ) {
+   if ( acsvm->failed || ! acsvm->started ||
+      index < 0 ) {
+      return false;
+   }
+   struct lib_call call;
+   jmp_buf bail;
+   enter( acsvm, &call, &bail );
+   if ( setjmp( bail ) != 0 ) {
+      return fail( acsvm, &call );
+   }
+   // A library is read when it is first needed, which can be now.
+   struct module* module = vm_get_module( &acsvm->vm, module_name );
+   // The number of variables is known once the module is read.
+   bool found = ( module != NULL && index < module->num_vars );
+   if ( found ) {
+      *value = module->vars[ index ].array ? 0 : *module->map_vars[ index ];
+   }
+   return ( leave( acsvm, &call ) && found );
+}
+
+bool acsvm_get_world_var( struct acsvm* acsvm, int32_t index,
+   int32_t* value ) {
+   if ( index < 0 || index >= MAX_WORLD_VARS ) {
+      return false;
+   }
+   *value = acsvm->vm.world_vars[ index ];
+   return true;
+}
+
+bool acsvm_get_global_var( struct acsvm* acsvm, int32_t index,
+   int32_t* value ) {
+   if ( index < 0 || index >= MAX_GLOBAL_VARS ) {
+      return false;
+   }
+   *value = acsvm->vm.global_vars[ index ];
+   return true;
+}
+
+int64_t acsvm_get_tic( struct acsvm* acsvm ) {
+   return ( int64_t ) acsvm->vm.tics;
+}
+
+/**
+ * Returns the number of scripts that have started and not finished.
+ */
+int32_t acsvm_get_num_active_scripts( struct acsvm* acsvm ) {
+   return ( int32_t ) acsvm->vm.num_active_scripts;
+}
+
+bool acsvm_failed( struct acsvm* acsvm ) {
+   return acsvm->failed;
+}
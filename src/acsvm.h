@@ -0,0 +1,77 @@
+#ifndef SRC_ACSVM_H
+#define SRC_ACSVM_H
+
+/**
+ * Library interface
+ *
+ * A program links with libacsvm and drives each virtual machine one tic at a
+ * time, from its own loop:
+ *
+ *    struct acsvm* vm = acsvm_create();
+ *    acsvm_add_module( vm, "", data, size );
+ *    acsvm_start( vm );
+ *    while ( running ) {
+ *       acsvm_run( vm, 1 );
+ *    }
+ *    acsvm_destroy( vm );
+ *
+ * Each virtual machine allocates from its own memory arena, which is freed as
+ * a whole when the virtual machine is destroyed, and the library keeps no
+ * global state, so a thread can run any number of virtual machines. A virtual
+ * machine must only be used by one thread at a time.
+ *
+ * An error, including running out of memory, stops the virtual machine: the
+ * function returns false, and from then on the only function that does
+ * anything is acsvm_destroy(). The program is never exited.
+ *
+ * A host function can call acsvm_execute() and the acsvm_get_*() functions of
+ * the virtual machine that runs it. If such a call fails, the call that ran
+ * the host function also returns false. acsvm_run(), acsvm_checkpoint(),
+ * acsvm_checkpoint_increment(), and acsvm_restore() return false when called
+ * from a host function, and acsvm_destroy() must not be called from one.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct acsvm;
+struct vm;
+
+// A function of the host program, bound to a line special, a builtin, or a
+// CALLFUNC function. The arguments are those of the call, and the returned
+// value is used when the call produces a value.
+typedef int32_t ( *acsvm_host_func )( struct vm* vm, const int32_t* args,
+   int32_t num_args, void* data );
+
+struct acsvm* acsvm_create( void );
+void acsvm_destroy( struct acsvm* vm );
+void acsvm_set_seed( struct acsvm* vm, uint64_t seed );
+void acsvm_set_output( struct acsvm* vm,
+   void ( *write )( const char* text, ptrdiff_t length, void* data ),
+   void* data );
+bool acsvm_add_module( struct acsvm* vm, const char* name, const void* data,
+   size_t size );
+bool acsvm_bind_lspec( struct acsvm* vm, int32_t id, acsvm_host_func func,
+   void* data );
+bool acsvm_bind_builtin( struct acsvm* vm, int32_t opcode,
+   acsvm_host_func func, void* data );
+bool acsvm_bind_callfunc( struct acsvm* vm, int32_t id, acsvm_host_func func,
+   void* data );
+bool acsvm_start( struct acsvm* vm );
+bool acsvm_run( struct acsvm* vm, int32_t tics );
+bool acsvm_execute( struct acsvm* vm, int32_t script, const int32_t* args,
+   int32_t num_args );
+bool acsvm_checkpoint( struct acsvm* vm, void** data, size_t* size );
+bool acsvm_checkpoint_increment( struct acsvm* vm, void** data,
+   size_t* size );
+bool acsvm_restore( struct acsvm* vm, const void* data, size_t size );
+bool acsvm_get_map_var( struct acsvm* vm, const char* module, int32_t index,
+   int32_t* value );
+bool acsvm_get_world_var( struct acsvm* vm, int32_t index, int32_t* value );
+bool acsvm_get_global_var( struct acsvm* vm, int32_t index, int32_t* value );
+int64_t acsvm_get_tic( struct acsvm* vm );
+int32_t acsvm_get_num_active_scripts( struct acsvm* vm );
+bool acsvm_failed( struct acsvm* vm );
+
+#endif
@@ -11,7 +11,8 @@
 
 static i32 read_lspec_id( struct turn* turn );
 static bool execute_line_special( struct vm* vm, i32 special,
-   bool push_return_value, i32 arg1, i32 arg2, i32 arg3, i32 arg4, i32 arg5 );
+   const i32* args, i32 total_args );
+static i32 get_arg( const i32* args, i32 total_args, i32 index );
 static void execute_acs_execute( struct vm* vm, i32 script_number, i32 map,
    i32 arg1 );
 static void show_line_special( struct vm* vm, i32 id, i32* args,
@@ -86,30 +87,38 @@ void vm_run_lspec( struct vm* vm, struct turn* turn ) {
       break;
    }
 
-   i32 args[ 5 ];
-   for ( i32 i = 0; i < ARRAY_SIZE( args ); ++i ) {
-      if ( i < total_args ) {
-         if ( direct_opcode ) {
-            if ( byte_args ) {
-               args[ i ] = turn->ip[ 0 ];
-               ++turn->ip;
-            }
-            else {
-               memcpy( &args[ i ], turn->ip, sizeof( args[ i ] ) );
-               turn->ip += sizeof( args[ i ] );
-            }
+   // Arguments on the stack are used in place. Arguments that follow the
+   // opcode are decoded first.
+   i32 direct_args[ 5 ];
+   i32* args = direct_args;
+   if ( direct_opcode ) {
+      for ( i32 i = 0; i < total_args; ++i ) {
+         if ( byte_args ) {
+            direct_args[ i ] = turn->ip[ 0 ];
+            ++turn->ip;
          }
          else {
-            args[ total_args - i - 1 ] = vm_pop( vm, turn );
+            memcpy( &direct_args[ i ], turn->ip, sizeof( direct_args[ i ] ) );
+            turn->ip += sizeof( direct_args[ i ] );
          }
       }
-      else {
-         args[ i ] = 0;
+   }
+   else {
+      args = vm_pop_args( vm, turn, total_args );
+   }
+
+   struct host_func* host_func = vm_find_lspec_binding( vm, id );
+   if ( host_func != NULL ) {
+      i32 result = host_func->run( vm, args, total_args, host_func->data );
+      if ( push_return_value ) {
+         vm_push( turn, result );
       }
+      return;
    }
 
-   bool executed = execute_line_special( vm, id, push_return_value, args[ 0 ],
-      args[ 1 ], args[ 2 ], args[ 3 ], args[ 4 ] );
+   bool executed = execute_line_special( vm, id, args, total_args ) || (
+      ! push_return_value &&
+      vm_batch_host_call( vm, HOSTCALL_LSPEC, id, args, total_args ) );
    if ( ! executed ) {
       show_line_special( vm, id, args, total_args );
       if ( push_return_value ) {
@@ -144,10 +153,11 @@ static i32 read_lspec_id( struct turn* turn ) {
 }
 
 static bool execute_line_special( struct vm* vm, i32 special,
-   bool push_return_value, i32 arg1, i32 arg2, i32 arg3, i32 arg4, i32 arg5 ) {
+   const i32* args, i32 total_args ) {
    switch ( special ) {
    case LSPEC_ACSEXECUTE:
-      execute_acs_execute( vm, arg1, arg2, arg3 );
+      execute_acs_execute( vm, get_arg( args, total_args, 0 ),
+         get_arg( args, total_args, 1 ), get_arg( args, total_args, 2 ) );
       break;
    default:
       return false;
@@ -155,6 +165,13 @@ static bool execute_line_special( struct vm* vm, i32 special,
    return true;
 }
 
+/**
+ * Arguments that were not given are 0.
+ */
+static i32 get_arg( const i32* args, i32 total_args, i32 index ) {
+   return ( index < total_args ) ? args[ index ] : 0;
+}
+
 static void execute_acs_execute( struct vm* vm, i32 script_number, i32 map,
    i32 arg1 ) {
    // Resume a suspended script.
@@ -0,0 +1,538 @@
+/**
+ * This file implements batch mode, where many object files are run by one
+ * process. Each job runs in its own virtual machine, with its own memory
+ * arena, on a pool of worker threads. The output of a job is kept in memory
+ * and compared with the expected output, and a summary of the jobs is shown
+ * in JSON format.
+ *
+ * The jobs are split evenly between the workers up front. A worker takes jobs
+ * from the front of its own range, and when the range is empty, it steals
+ * the back half of the range of another worker, so workers stay busy when
+ * jobs take different amounts of time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#include "common/misc.h"
+#include "common/mem.h"
+#include "common/str.h"
+#include "common/list.h"
+#include "common/fs.h"
+#include "vm.h"
+#include "wad.h"
+
+struct batch_job {
+   const char* path;
+   const char* expected_path; // NULL when there is no expected output.
+   // Output of a job that did not pass, or NULL.
+   char* output;
+   isize output_length;
+   i64 time;        // In microseconds.
+   isize tics;
+   enum {
+      JOBSTATUS_PASSED,
+      JOBSTATUS_RAN,   // Ran without errors, but has no expected output.
+      JOBSTATUS_FAILED,
+      JOBSTATUS_TIMEOUT,
+      JOBSTATUS_ERROR,
+   } status;
+};
+
+struct batch {
+   struct options* options;
+   struct batch_job* jobs;
+   isize num_jobs;
+   struct batch_worker* workers;
+   isize num_workers;
+};
+
+struct batch_worker {
+   struct batch* batch;
+   // Range of jobs the worker has not taken yet. Other workers steal from
+   // the end of the range.
+   pthread_mutex_t mutex;
+   isize next;
+   isize end;
+   pthread_t thread;
+   struct mem_arena* arena;
+   bool started;
+};
+
+static bool read_jobs( struct batch* batch, const char* path );
+static bool read_manifest( struct batch* batch, const char* path );
+static bool read_dir( struct batch* batch, const char* path );
+static int compare_jobs( const void* a, const void* b );
+static char* join_path( const char* dir, const char* path, isize length );
+static const char* get_expected_path( const char* path );
+static void add_job( struct batch* batch, isize* capacity, const char* path,
+   const char* expected_path );
+static void run_workers( struct batch* batch );
+static void* run_worker( void* data );
+static struct batch_job* take_job( struct batch_worker* worker );
+static bool steal_jobs( struct batch_worker* worker,
+   struct batch_worker* victim );
+static void run_job( struct batch* batch, struct batch_job* job );
+static void fail_alloc( void* data );
+static void check_output( struct vm* vm, struct batch_job* job );
+static i64 get_time( void );
+static bool show_summary( struct batch* batch, i64 time );
+static void write_json_str( struct output* output, const char* value,
+   isize length );
+
+/**
+ * Runs every object file listed in a manifest or found in a directory.
+ * Returns false if a job did not pass.
+ */
+bool vm_run_batch( struct options* options ) {
+   struct batch batch;
+   batch.options = options;
+   batch.jobs = NULL;
+   batch.num_jobs = 0;
+   if ( ! read_jobs( &batch, options->batch_path ) ) {
+      return false;
+   }
+   i64 start = get_time();
+   run_workers( &batch );
+   return show_summary( &batch, get_time() - start );
+}
+
+static bool read_jobs( struct batch* batch, const char* path ) {
+   struct fs_query query;
+   fs_init_query( &query, path );
+   if ( ! fs_exists( &query ) ) {
+      printf( "fatal error: batch manifest or directory not found: %s\n",
+         path );
+      return false;
+   }
+   if ( fs_is_dir( &query ) ) {
+      return read_dir( batch, path );
+   }
+   return read_manifest( batch, path );
+}
+
+/**
+ * Each line of a manifest has the path of an object file, optionally
+ * followed by the path of the file with the expected output. Paths are
+ * relative to the directory of the manifest. Empty lines and lines that
+ * start with # are skipped.
+ */
+static bool read_manifest( struct batch* batch, const char* path ) {
+   struct file_request request;
+   vm_init_file_request( &request );
+   vm_load_file( &request, path );
+   if ( request.err != FILEREQUESTERR_NONE ) {
+      printf( "fatal error: failed to read batch manifest: %s\n", path );
+      return false;
+   }
+   struct str dir;
+   str_init( &dir );
+   str_append( &dir, path );
+   c_extract_dirname( &dir );
+   isize capacity = 0;
+   const char* text = ( const char* ) request.data;
+   const char* end = text + request.size;
+   while ( text < end ) {
+      const char* line_end = memchr( text, '\n', end - text );
+      if ( line_end == NULL ) {
+         line_end = end;
+      }
+      const char* fields[ 2 ] = { NULL, NULL };
+      isize lengths[ 2 ] = { 0, 0 };
+      isize num_fields = 0;
+      const char* ch = text;
+      while ( ch < line_end && num_fields < ARRAY_SIZE( fields ) ) {
+         while ( ch < line_end && ( *ch == ' ' || *ch == '\t' ||
+            *ch == '\r' ) ) {
+            ++ch;
+         }
+         if ( ch == line_end || ( num_fields == 0 && *ch == '#' ) ) {
+            break;
+         }
+         fields[ num_fields ] = ch;
+         while ( ch < line_end && ! ( *ch == ' ' || *ch == '\t' ||
+            *ch == '\r' ) ) {
+            ++ch;
+         }
+         lengths[ num_fields ] = ch - fields[ num_fields ];
+         ++num_fields;
+      }
+      if ( num_fields > 0 ) {
+         const char* object_path = join_path( dir.value, fields[ 0 ],
+            lengths[ 0 ] );
+         add_job( batch, &capacity, object_path, ( num_fields > 1 ) ?
+            join_path( dir.value, fields[ 1 ], lengths[ 1 ] ) :
+            get_expected_path( object_path ) );
+      }
+      text = line_end + 1;
+   }
+   str_deinit( &dir );
+   mem_free( request.data );
+   return true;
+}
+
+/**
+ * Runs every file in the directory with the .o extension, in the order of
+ * their names.
+ */
+static bool read_dir( struct batch* batch, const char* path ) {
+   DIR* dir = opendir( path );
+   if ( dir == NULL ) {
+      printf( "fatal error: failed to open batch directory: %s\n", path );
+      return false;
+   }
+   isize capacity = 0;
+   struct dirent* entry;
+   while ( ( entry = readdir( dir ) ) != NULL ) {
+      isize length = strlen( entry->d_name );
+      if ( length > 2 &&
+         strcmp( entry->d_name + length - 2, ".o" ) == 0 ) {
+         add_job( batch, &capacity, join_path( path, entry->d_name,
+            length ), NULL );
+      }
+   }
+   closedir( dir );
+   qsort( batch->jobs, batch->num_jobs, sizeof( batch->jobs[ 0 ] ),
+      compare_jobs );
+   for ( isize i = 0; i < batch->num_jobs; ++i ) {
+      batch->jobs[ i ].expected_path =
+         get_expected_path( batch->jobs[ i ].path );
+   }
+   return true;
+}
+
+static int compare_jobs( const void* a, const void* b ) {
+   const struct batch_job* job_a = a;
+   const struct batch_job* job_b = b;
+   return strcmp( job_a->path, job_b->path );
+}
+
+static char* join_path( const char* dir, const char* path, isize length ) {
+   struct str joined;
+   str_init( &joined );
+   if ( path[ 0 ] != '/' && dir[ 0 ] != '\0' ) {
+      str_append( &joined, dir );
+      str_append( &joined, OS_PATHSEP );
+   }
+   str_append_sub( &joined, path, length );
+   return joined.value;
+}
+
+/**
+ * The expected output of `name.o` is in `name.expected`, next to the object
+ * file. Returns NULL if there is no such file.
+ */
+static const char* get_expected_path( const char* path ) {
+   struct str expected_path;
+   str_init( &expected_path );
+   const char* extension = strrchr( path, '.' );
+   const char* sep = strrchr( path, '/' );
+   if ( extension != NULL && ( sep == NULL || extension > sep ) ) {
+      str_append_sub( &expected_path, path, extension - path );
+   }
+   else {
+      str_append( &expected_path, path );
+   }
+   str_append( &expected_path, ".expected" );
+   struct fs_query query;
+   fs_init_query( &query, expected_path.value );
+   if ( ! fs_exists( &query ) ) {
+      str_deinit( &expected_path );
+      return NULL;
+   }
+   return expected_path.value;
+}
+
+static void add_job( struct batch* batch, isize* capacity, const char* path,
+   const char* expected_path ) {
+   if ( batch->num_jobs == *capacity ) {
+      *capacity = ( *capacity == 0 ) ? 64 : *capacity * 2;
+      batch->jobs = mem_realloc( batch->jobs,
+         sizeof( batch->jobs[ 0 ] ) * *capacity );
+   }
+   struct batch_job* job = &batch->jobs[ batch->num_jobs ];
+   job->path = path;
+   job->expected_path = expected_path;
+   job->output = NULL;
+   job->output_length = 0;
+   job->time = 0;
+   job->tics = 0;
+   job->status = JOBSTATUS_ERROR;
+   ++batch->num_jobs;
+}
+
+static void run_workers( struct batch* batch ) {
+   isize num_workers = batch->options->jobs;
+   if ( num_workers > batch->num_jobs ) {
+      num_workers = batch->num_jobs;
+   }
+   batch->workers = mem_alloc( sizeof( batch->workers[ 0 ] ) *
+      ( num_workers > 0 ? num_workers : 1 ) );
+   batch->num_workers = num_workers;
+   for ( isize k = 0; k < num_workers; ++k ) {
+      struct batch_worker* worker = &batch->workers[ k ];
+      worker->batch = batch;
+      pthread_mutex_init( &worker->mutex, NULL );
+      worker->next = batch->num_jobs * k / num_workers;
+      worker->end = batch->num_jobs * ( k + 1 ) / num_workers;
+      worker->arena = NULL;
+   }
+   for ( isize k = 0; k < num_workers; ++k ) {
+      struct batch_worker* worker = &batch->workers[ k ];
+      worker->started = ( pthread_create( &worker->thread, NULL, run_worker,
+         worker ) == 0 );
+   }
+   for ( isize k = 0; k < num_workers; ++k ) {
+      struct batch_worker* worker = &batch->workers[ k ];
+      if ( worker->started ) {
+         pthread_join( worker->thread, NULL );
+         mem_attach( worker->arena );
+      }
+   }
+   // If a worker could not be started, the other workers have stolen its
+   // jobs. If none could be started, run the jobs here.
+   for ( isize k = 0; k < num_workers; ++k ) {
+      struct batch_job* job;
+      while ( ( job = take_job( &batch->workers[ k ] ) ) ) {
+         run_job( batch, job );
+      }
+      pthread_mutex_destroy( &batch->workers[ k ].mutex );
+   }
+}
+
+static void* run_worker( void* data ) {
+   struct batch_worker* worker = data;
+   mem_init();
+   struct batch_job* job;
+   while ( ( job = take_job( worker ) ) ) {
+      run_job( worker->batch, job );
+   }
+   worker->arena = mem_detach();
+   return NULL;
+}
+
+/**
+ * Returns the next job of the worker, stealing from the other workers when
+ * the worker has no jobs left. Returns NULL when every job is taken.
+ */
+static struct batch_job* take_job( struct batch_worker* worker ) {
+   struct batch* batch = worker->batch;
+   isize index = worker - batch->workers;
+   while ( true ) {
+      struct batch_job* job = NULL;
+      pthread_mutex_lock( &worker->mutex );
+      if ( worker->next < worker->end ) {
+         job = &batch->jobs[ worker->next ];
+         ++worker->next;
+      }
+      pthread_mutex_unlock( &worker->mutex );
+      if ( job != NULL ) {
+         return job;
+      }
+      bool stolen = false;
+      for ( isize k = 1; k < batch->num_workers && ! stolen; ++k ) {
+         stolen = steal_jobs( worker,
+            &batch->workers[ ( index + k ) % batch->num_workers ] );
+      }
+      if ( ! stolen ) {
+         return NULL;
+      }
+   }
+}
+
+/**
+ * Moves the back half of the jobs of the victim to the worker. Only one lock
+ * is held at a time, so workers stealing from each other cannot deadlock.
+ */
+static bool steal_jobs( struct batch_worker* worker,
+   struct batch_worker* victim ) {
+   pthread_mutex_lock( &victim->mutex );
+   isize left = victim->end - victim->next;
+   isize end = victim->end;
+   isize start = end - ( left + 1 ) / 2;
+   victim->end = start;
+   pthread_mutex_unlock( &victim->mutex );
+   if ( left == 0 ) {
+      return false;
+   }
+   pthread_mutex_lock( &worker->mutex );
+   worker->next = start;
+   worker->end = end;
+   pthread_mutex_unlock( &worker->mutex );
+   return true;
+}
+
+/**
+ * Runs a job in a new virtual machine. Everything the virtual machine
+ * allocates is in an arena of its own, freed when the job is done, so
+ * a job cannot affect the jobs that follow it.
+ */
+static void run_job( struct batch* batch, struct batch_job* job ) {
+   i64 start = get_time();
+   struct mem_arena* arena = mem_create_arena();
+   if ( arena == NULL ) {
+      job->status = JOBSTATUS_ERROR;
+      return;
+   }
+   struct mem_arena* worker_arena = mem_use_arena( arena );
+   struct options options = *batch->options;
+   options.jobs = 1;
+   options.capture_output = true;
+   options.object_file = job->path;
+   // Modules read through the cache are mapped for the rest of the run, so
+   // they would pile up over the jobs.
+   options.cache_dir = NULL;
+   // The libraries are shared by every job; the main module is the object
+   // file of the job.
+   list_init( &options.modules );
+   struct list_iter i;
+   list_iterate( &batch->options->modules, &i );
+   while ( ! list_end( &i ) ) {
+      struct module_arg* arg = list_data( &i );
+      if ( arg->name[ 0 ] != '\0' ) {
+         list_append( &options.modules, arg );
+      }
+      list_next( &i );
+   }
+   struct module_arg main_arg = { "", job->path, NULL, 0 };
+   list_append( &options.modules, &main_arg );
+   struct vm* vm = mem_alloc( sizeof( *vm ) );
+   jmp_buf bail;
+   vm->bail = &bail;
+   vm->options = &options;
+   vm->wad = NULL;
+   vm->tics = 0;
+   mem_set_fail_handler( fail_alloc, vm );
+   if ( setjmp( bail ) == 0 ) {
+      vm_init( vm, &options );
+      vm_start( vm );
+      while ( vm_scripts_waiting( vm ) && vm->tics < options.tic_limit ) {
+         vm_run_tics( vm, 1 );
+      }
+      check_output( vm, job );
+   }
+   else {
+      job->status = JOBSTATUS_ERROR;
+   }
+   job->tics = vm->tics;
+   if ( vm->wad != NULL ) {
+      wad_close( vm->wad );
+   }
+   // Keep the output of a job that did not pass, to show it in the summary.
+   mem_use_arena( worker_arena );
+   if ( ! ( job->status == JOBSTATUS_PASSED ||
+      job->status == JOBSTATUS_RAN ) ) {
+      isize length;
+      const char* output = output_captured( &vm->output, &length );
+      job->output = mem_alloc( length + 1 );
+      memcpy( job->output, output, length );
+      job->output_length = length;
+   }
+   mem_destroy_arena( arena );
+   job->time = get_time() - start;
+}
+
+static void fail_alloc( void* data ) {
+   v_bail( data );
+}
+
+static void check_output( struct vm* vm, struct batch_job* job ) {
+   if ( vm->num_errs > 0 ) {
+      job->status = JOBSTATUS_ERROR;
+      return;
+   }
+   if ( vm_scripts_waiting( vm ) ) {
+      job->status = JOBSTATUS_TIMEOUT;
+      return;
+   }
+   if ( job->expected_path == NULL ) {
+      job->status = JOBSTATUS_RAN;
+      return;
+   }
+   struct file_request request;
+   vm_init_file_request( &request );
+   vm_load_file( &request, job->expected_path );
+   if ( request.err != FILEREQUESTERR_NONE ) {
+      job->status = JOBSTATUS_ERROR;
+      return;
+   }
+   isize length;
+   const char* output = output_captured( &vm->output, &length );
+   job->status = ( length == ( isize ) request.size &&
+      ( length == 0 || memcmp( output, request.data, length ) == 0 ) ) ?
+      JOBSTATUS_PASSED : JOBSTATUS_FAILED;
+}
+
+static i64 get_time( void ) {
+   struct timespec time;
+   clock_gettime( CLOCK_MONOTONIC, &time );
+   return ( i64 ) time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
+
+/**
+ * Shows the result and timing of each job, and totals, in JSON format. The
+ * output of a job that did not pass is included. Returns false if a job did
+ * not pass.
+ */
+static bool show_summary( struct batch* batch, i64 time ) {
+   static const char* const statuses[] = {
+      "passed", "ran", "failed", "timeout", "error"
+   };
+   isize counts[ ARRAY_SIZE( statuses ) ] = { 0 };
+   struct output output;
+   output_init_stream( &output, stdout );
+   output_printf( &output, "{\n  \"jobs\": [" );
+   for ( isize i = 0; i < batch->num_jobs; ++i ) {
+      struct batch_job* job = &batch->jobs[ i ];
+      ++counts[ job->status ];
+      output_printf( &output, "%s\n    { \"object\": ", i > 0 ? "," : "" );
+      write_json_str( &output, job->path, strlen( job->path ) );
+      output_printf( &output, ", \"status\": \"%s\", \"time_us\": %lld, "
+         "\"tics\": %lld", statuses[ job->status ], ( long long ) job->time,
+         ( long long ) job->tics );
+      if ( job->output != NULL ) {
+         output_printf( &output, ", \"output\": " );
+         write_json_str( &output, job->output, job->output_length );
+      }
+      output_printf( &output, " }" );
+   }
+   output_printf( &output, "\n  ],\n  \"total\": %lld",
+      ( long long ) batch->num_jobs );
+   for ( isize i = 0; i < ARRAY_SIZE( statuses ); ++i ) {
+      output_printf( &output, ",\n  \"%s\": %lld", statuses[ i ],
+         ( long long ) counts[ i ] );
+   }
+   output_printf( &output, ",\n  \"threads\": %lld,\n  \"time_us\": %lld\n}\n",
+      ( long long ) batch->num_workers, ( long long ) time );
+   output_deinit( &output );
+   return ( counts[ JOBSTATUS_PASSED ] + counts[ JOBSTATUS_RAN ] ==
+      batch->num_jobs );
+}
+
+static void write_json_str( struct output* output, const char* value,
+   isize length ) {
+   output_write( output, "\"", 1 );
+   for ( isize i = 0; i < length; ++i ) {
+      unsigned char ch = value[ i ];
+      switch ( ch ) {
+      case '"': output_write( output, "\\\"", 2 ); break;
+      case '\\': output_write( output, "\\\\", 2 ); break;
+      case '\n': output_write( output, "\\n", 2 ); break;
+      case '\t': output_write( output, "\\t", 2 ); break;
+      case '\r': output_write( output, "\\r", 2 ); break;
+      default:
+         if ( ch < 0x20 ) {
+            output_printf( output, "\\u%04x", ch );
+         }
+         else {
+            output_write( output, ( const char* ) &value[ i ], 1 );
+         }
+      }
+   }
+   output_write( output, "\"", 1 );
+}
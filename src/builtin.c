@@ -0,0 +1,296 @@
+/**
+ * This file implements the builtin functions: the functions that have their
+ * own opcode. Builtins are described by a table indexed by opcode, so finding
+ * the description of a builtin takes constant time. The table is also meant
+ * to be used by tools that need to know how an instruction uses its
+ * arguments.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include "common/misc.h"
+#include "common/mem.h"
+#include "common/str.h"
+#include "common/list.h"
+#include "vm.h"
+#include "pcode.h"
+#include "fixed.h"
+
+static i32 ignore_builtin( struct vm* vm, struct turn* turn,
+   const struct builtin* builtin, const i32* args );
+static i32 run_fixed_mul( struct vm* vm, struct turn* turn,
+   const struct builtin* builtin, const i32* args );
+static i32 run_fixed_div( struct vm* vm, struct turn* turn,
+   const struct builtin* builtin, const i32* args );
+static i32 run_sin( struct vm* vm, struct turn* turn,
+   const struct builtin* builtin, const i32* args );
+static i32 run_cos( struct vm* vm, struct turn* turn,
+   const struct builtin* builtin, const i32* args );
+static i32 run_vector_angle( struct vm* vm, struct turn* turn,
+   const struct builtin* builtin, const i32* args );
+
+#define BUILTIN( opcode, name, num_args, returns_value ) \
+   [ opcode ] = { name, ignore_builtin, num_args, false, returns_value }
+#define BUILTIN_DIRECT( opcode, name, num_args, returns_value ) \
+   [ opcode ] = { name, ignore_builtin, num_args, true, returns_value }
+// A builtin that the virtual machine implements itself.
+#define BUILTIN_RUN( opcode, name, num_args, returns_value, run ) \
+   [ opcode ] = { name, run, num_args, false, returns_value }
+
+// Opcodes that are not builtins have no name.
+static const struct builtin g_builtins[ PCD_TOTAL ] = {
+   BUILTIN( PCD_THINGCOUNT, "ThingCount", 2, true ),
+   BUILTIN_DIRECT( PCD_THINGCOUNTDIRECT, "ThingCount", 2, true ),
+   BUILTIN( PCD_TAGWAIT, "TagWait", 1, false ),
+   BUILTIN_DIRECT( PCD_TAGWAITDIRECT, "TagWait", 1, false ),
+   BUILTIN( PCD_POLYWAIT, "PolyWait", 1, false ),
+   BUILTIN_DIRECT( PCD_POLYWAITDIRECT, "PolyWait", 1, false ),
+   BUILTIN( PCD_CHANGEFLOOR, "ChangeFloor", 2, false ),
+   BUILTIN_DIRECT( PCD_CHANGEFLOORDIRECT, "ChangeFloor", 2, false ),
+   BUILTIN( PCD_CHANGECEILING, "ChangeCeiling", 2, false ),
+   BUILTIN_DIRECT( PCD_CHANGECEILINGDIRECT, "ChangeCeiling", 2, false ),
+   BUILTIN( PCD_LINESIDE, "LineSide", 0, true ),
+   BUILTIN( PCD_CLEARLINESPECIAL, "ClearLineSpecial", 0, false ),
+   BUILTIN( PCD_PLAYERCOUNT, "PlayerCount", 0, true ),
+   BUILTIN( PCD_GAMETYPE, "GameType", 0, true ),
+   BUILTIN( PCD_GAMESKILL, "GameSkill", 0, true ),
+   BUILTIN( PCD_TIMER, "Timer", 0, true ),
+   BUILTIN( PCD_SECTORSOUND, "SectorSound", 2, false ),
+   BUILTIN( PCD_AMBIENTSOUND, "AmbientSound", 2, false ),
+   BUILTIN( PCD_SOUNDSEQUENCE, "SoundSequence", 1, false ),
+   BUILTIN( PCD_SETLINETEXTURE, "SetLineTexture", 4, false ),
+   BUILTIN( PCD_SETLINEBLOCKING, "SetLineBlocking", 2, false ),
+   BUILTIN( PCD_SETLINESPECIAL, "SetLineSpecial", 6, false ),
+   BUILTIN( PCD_THINGSOUND, "ThingSound", 3, false ),
+   BUILTIN( PCD_ACTIVATORSOUND, "ActivatorSound", 2, false ),
+   BUILTIN( PCD_LOCALAMBIENTSOUND, "LocalAmbientSound", 2, false ),
+   BUILTIN( PCD_SETLINEMONSTERBLOCKING, "SetLineMonsterBlocking", 2, false ),
+   BUILTIN( PCD_ISMULTIPLAYER, "IsNetworkGame", 0, true ),
+   BUILTIN( PCD_PLAYERTEAM, "PlayerTeam", 0, true ),
+   BUILTIN( PCD_PLAYERHEALTH, "PlayerHealth", 0, true ),
+   BUILTIN( PCD_PLAYERARMORPOINTS, "PlayerArmorPoints", 0, true ),
+   BUILTIN( PCD_PLAYERFRAGS, "PlayerFrags", 0, true ),
+   BUILTIN( PCD_BLUETEAMCOUNT, "BlueTeamCount", 0, true ),
+   BUILTIN( PCD_REDTEAMCOUNT, "RedTeamCount", 0, true ),
+   BUILTIN( PCD_BLUETEAMSCORE, "BlueTeamScore", 0, true ),
+   BUILTIN( PCD_REDTEAMSCORE, "RedTeamScore", 0, true ),
+   BUILTIN( PCD_ISONEFLAGCTF, "IsOneFlagCTF", 0, true ),
+   BUILTIN( PCD_GETINVASIONWAVE, "GetInvasionWave", 0, true ),
+   BUILTIN( PCD_GETINVASIONSTATE, "GetInvasionState", 0, true ),
+   BUILTIN( PCD_MUSICCHANGE, "Music_Change", 2, false ),
+   BUILTIN( PCD_CONSOLECOMMAND, "ConsoleCommand", 3, false ),
+   BUILTIN_DIRECT( PCD_CONSOLECOMMANDDIRECT, "ConsoleCommand", 3, false ),
+   BUILTIN( PCD_SINGLEPLAYER, "SinglePlayer", 0, true ),
+   BUILTIN_RUN( PCD_FIXEDMUL, "FixedMul", 2, true, run_fixed_mul ),
+   BUILTIN_RUN( PCD_FIXEDDIV, "FixedDiv", 2, true, run_fixed_div ),
+   BUILTIN( PCD_SETGRAVITY, "SetGravity", 1, false ),
+   BUILTIN_DIRECT( PCD_SETGRAVITYDIRECT, "SetGravity", 1, false ),
+   BUILTIN( PCD_SETAIRCONTROL, "SetAirControl", 1, false ),
+   BUILTIN_DIRECT( PCD_SETAIRCONTROLDIRECT, "SetAirControl", 1, false ),
+   BUILTIN( PCD_CLEARINVENTORY, "ClearInventory", 0, false ),
+   BUILTIN( PCD_GIVEINVENTORY, "GiveInventory", 2, false ),
+   BUILTIN_DIRECT( PCD_GIVEINVENTORYDIRECT, "GiveInventory", 2, false ),
+   BUILTIN( PCD_TAKEINVENTORY, "TakeInventory", 2, false ),
+   BUILTIN_DIRECT( PCD_TAKEINVENTORYDIRECT, "TakeInventory", 2, false ),
+   BUILTIN( PCD_CHECKINVENTORY, "CheckInventory", 1, true ),
+   BUILTIN_DIRECT( PCD_CHECKINVENTORYDIRECT, "CheckInventory", 1, true ),
+   BUILTIN( PCD_SPAWN, "Spawn", 6, true ),
+   BUILTIN_DIRECT( PCD_SPAWNDIRECT, "Spawn", 6, true ),
+   BUILTIN( PCD_SPAWNSPOT, "SpawnSpot", 4, true ),
+   BUILTIN_DIRECT( PCD_SPAWNSPOTDIRECT, "SpawnSpot", 4, true ),
+   BUILTIN( PCD_SETMUSIC, "SetMusic", 3, false ),
+   BUILTIN_DIRECT( PCD_SETMUSICDIRECT, "SetMusic", 3, false ),
+   BUILTIN( PCD_LOCALSETMUSIC, "LocalSetMusic", 3, false ),
+   BUILTIN_DIRECT( PCD_LOCALSETMUSICDIRECT, "LocalSetMusic", 3, false ),
+   BUILTIN( PCD_SETFONT, "SetFont", 1, false ),
+   BUILTIN_DIRECT( PCD_SETFONTDIRECT, "SetFont", 1, false ),
+   BUILTIN( PCD_SETTHINGSPECIAL, "SetThingSpecial", 7, false ),
+   BUILTIN( PCD_FADETO, "FadeTo", 5, false ),
+   BUILTIN( PCD_FADERANGE, "FadeRange", 9, false ),
+   BUILTIN( PCD_CANCELFADE, "CancelFade", 0, false ),
+   BUILTIN( PCD_PLAYMOVIE, "PlayMovie", 1, true ),
+   BUILTIN( PCD_SETFLOORTRIGGER, "SetFloorTrigger", 8, false ),
+   BUILTIN( PCD_SETCEILINGTRIGGER, "SetCeilingTrigger", 8, false ),
+   BUILTIN( PCD_GETACTORX, "GetActorX", 1, true ),
+   BUILTIN( PCD_GETACTORY, "GetActorY", 1, true ),
+   BUILTIN( PCD_GETACTORZ, "GetActorZ", 1, true ),
+   BUILTIN_RUN( PCD_SIN, "Sin", 1, true, run_sin ),
+   BUILTIN_RUN( PCD_COS, "Cos", 1, true, run_cos ),
+   BUILTIN_RUN( PCD_VECTORANGLE, "VectorAngle", 2, true,
+      run_vector_angle ),
+   BUILTIN( PCD_CHECKWEAPON, "CheckWeapon", 1, true ),
+   BUILTIN( PCD_SETWEAPON, "SetWeapon", 1, true ),
+   BUILTIN( PCD_SETMARINEWEAPON, "SetMarineWeapon", 2, false ),
+   BUILTIN( PCD_SETACTORPROPERTY, "SetActorProperty", 3, false ),
+   BUILTIN( PCD_GETACTORPROPERTY, "GetActorProperty", 2, true ),
+   BUILTIN( PCD_PLAYERNUMBER, "PlayerNumber", 0, true ),
+   BUILTIN( PCD_ACTIVATORTID, "ActivatorTID", 0, true ),
+   BUILTIN( PCD_SETMARINESPRITE, "SetMarineSprite", 2, false ),
+   BUILTIN( PCD_GETSCREENWIDTH, "GetScreenWidth", 0, true ),
+   BUILTIN( PCD_GETSCREENHEIGHT, "GetScreenHeight", 0, true ),
+   BUILTIN( PCD_THINGPROJECTILE2, "Thing_Projectile2", 7, false ),
+   BUILTIN( PCD_STRLEN, "StrLen", 1, true ),
+   BUILTIN( PCD_SETHUDSIZE, "SetHudSize", 3, false ),
+   BUILTIN( PCD_GETCVAR, "GetCVar", 1, true ),
+   BUILTIN( PCD_SETRESULTVALUE, "SetResultValue", 1, false ),
+   BUILTIN( PCD_GETLINEROWOFFSET, "GetLineRowOffset", 0, true ),
+   BUILTIN( PCD_GETACTORFLOORZ, "GetActorFloorZ", 1, true ),
+   BUILTIN( PCD_GETACTORANGLE, "GetActorAngle", 1, true ),
+   BUILTIN( PCD_GETSECTORFLOORZ, "GetSectorFloorZ", 3, true ),
+   BUILTIN( PCD_GETSECTORCEILINGZ, "GetSectorCeilingZ", 3, true ),
+   BUILTIN( PCD_GETSIGILPIECES, "GetSigilPieces", 0, true ),
+   BUILTIN( PCD_GETLEVELINFO, "GetLevelInfo", 1, true ),
+   BUILTIN( PCD_CHANGESKY, "ChangeSky", 2, false ),
+   BUILTIN( PCD_PLAYERINGAME, "PlayerInGame", 1, true ),
+   BUILTIN( PCD_PLAYERISBOT, "PlayerIsBot", 1, true ),
+   BUILTIN( PCD_SETCAMERATOTEXTURE, "SetCameraToTexture", 3, false ),
+   BUILTIN( PCD_GETAMMOCAPACITY, "GetAmmoCapacity", 1, true ),
+   BUILTIN( PCD_SETAMMOCAPACITY, "SetAmmoCapacity", 2, false ),
+   BUILTIN( PCD_SETACTORANGLE, "SetActorAngle", 2, false ),
+   BUILTIN( PCD_SPAWNPROJECTILE, "SpawnProjectile", 7, false ),
+   BUILTIN( PCD_GETSECTORLIGHTLEVEL, "GetSectorLightLevel", 1, true ),
+   BUILTIN( PCD_GETACTORCEILINGZ, "GetActorCeilingZ", 1, true ),
+   BUILTIN( PCD_SETACTORPOSITION, "SetActorPosition", 5, true ),
+   BUILTIN( PCD_CLEARACTORINVENTORY, "ClearActorInventory", 1, false ),
+   BUILTIN( PCD_GIVEACTORINVENTORY, "GiveActorInventory", 3, false ),
+   BUILTIN( PCD_TAKEACTORINVENTORY, "TakeActorInventory", 3, false ),
+   BUILTIN( PCD_CHECKACTORINVENTORY, "CheckActorInventory", 2, true ),
+   BUILTIN( PCD_THINGCOUNTNAME, "ThingCountName", 2, true ),
+   BUILTIN( PCD_SPAWNSPOTFACING, "SpawnSpotFacing", 3, true ),
+   BUILTIN( PCD_PLAYERCLASS, "PlayerClass", 1, true ),
+   BUILTIN( PCD_GETPLAYERINFO, "GetPlayerInfo", 2, true ),
+   BUILTIN( PCD_CHANGELEVEL, "ChangeLevel", 4, false ),
+   BUILTIN( PCD_SECTORDAMAGE, "SectorDamage", 5, false ),
+   BUILTIN( PCD_REPLACETEXTURES, "ReplaceTextures", 3, false ),
+   BUILTIN( PCD_GETACTORPITCH, "GetActorPitch", 1, true ),
+   BUILTIN( PCD_SETACTORPITCH, "SetActorPitch", 2, false ),
+   BUILTIN( PCD_SETACTORSTATE, "SetActorState", 3, true ),
+   BUILTIN( PCD_THINGDAMAGE2, "Thing_Damage2", 3, true ),
+   BUILTIN( PCD_USEINVENTORY, "UseInventory", 1, true ),
+   BUILTIN( PCD_USEACTORINVENTORY, "UseActorInventory", 2, true ),
+   BUILTIN( PCD_CHECKACTORCEILINGTEXTURE, "CheckActorCeilingTexture", 2, true ),
+   BUILTIN( PCD_CHECKACTORFLOORTEXTURE, "CheckActorFloorTexture", 2, true ),
+   BUILTIN( PCD_GETACTORLIGHTLEVEL, "GetActorLightLevel", 1, true ),
+   BUILTIN( PCD_SETMUGSHOTSTATE, "SetMugShotState", 1, false ),
+   BUILTIN( PCD_THINGCOUNTSECTOR, "ThingCountSector", 3, true ),
+   BUILTIN( PCD_THINGCOUNTNAMESECTOR, "ThingCountNameSector", 3, true ),
+   BUILTIN( PCD_CHECKPLAYERCAMERA, "CheckPlayerCamera", 1, true ),
+   BUILTIN( PCD_MORPHACTOR, "MorphActor", 7, true ),
+   BUILTIN( PCD_UNMORPHACTOR, "UnMorphActor", 2, true ),
+   BUILTIN( PCD_GETPLAYERINPUT, "GetPlayerInput", 2, true ),
+   BUILTIN( PCD_CLASSIFYACTOR, "ClassifyActor", 1, true ),
+};
+
+#undef BUILTIN
+#undef BUILTIN_DIRECT
+#undef BUILTIN_RUN
+
+/**
+ * Returns the description of the builtin run by the specified opcode, or NULL
+ * if the opcode does not run a builtin.
+ */
+const struct builtin* vm_find_builtin( i32 opcode ) {
+   if ( opcode >= 0 && opcode < PCD_TOTAL &&
+      g_builtins[ opcode ].name != NULL ) {
+      return &g_builtins[ opcode ];
+   }
+   return NULL;
+}
+
+/**
+ * Runs the builtin of the current opcode. The arguments are taken from the
+ * instruction for direct opcodes, and from the stack otherwise.
+ */
+void vm_run_builtin( struct vm* vm, struct turn* turn ) {
+   const struct builtin* builtin = vm_find_builtin( turn->opcode );
+   if ( builtin == NULL ) {
+      v_diag( vm, DIAG_INTERNAL | DIAG_ERR,
+         "opcode %d missing a builtin function entry", turn->opcode );
+      v_bail( vm );
+   }
+   i32 direct_args[ BUILTIN_MAX_ARGS ];
+   const i32* args;
+   if ( builtin->direct ) {
+      memcpy( direct_args, turn->ip, sizeof( i32 ) * builtin->num_args );
+      turn->ip += sizeof( i32 ) * builtin->num_args;
+      args = direct_args;
+   }
+   else {
+      if ( vm_get_stack_size( turn ) < builtin->num_args ) {
+         v_diag( vm, DIAG_FATALERR,
+            "not enough arguments on the stack for `%s()` (need %d "
+            "arguments, but only %d given)", builtin->name,
+            builtin->num_args, vm_get_stack_size( turn ) );
+         v_bail( vm );
+      }
+      args = vm_pop_args( vm, turn, builtin->num_args );
+   }
+   i32 result;
+   struct host_func* host_func = &vm->builtin_funcs[ turn->opcode ];
+   if ( host_func->run != NULL ) {
+      result = host_func->run( vm, args, builtin->num_args, host_func->data );
+   }
+   else if ( ! builtin->returns_value && vm_batch_host_call( vm,
+      HOSTCALL_BUILTIN, turn->opcode, args, builtin->num_args ) ) {
+      result = 0;
+   }
+   else {
+      result = builtin->run( vm, turn, builtin, args );
+   }
+   if ( builtin->returns_value ) {
+      vm_push( turn, result );
+   }
+}
+
+/**
+ * Used for builtins that are not implemented. Shows the call and returns 0.
+ */
+static i32 ignore_builtin( struct vm* vm, struct turn* turn,
+   const struct builtin* builtin, const i32* args ) {
+   if ( ! v_diag_shown( vm, DIAG_DBG ) ) {
+      return 0;
+   }
+   v_diag( vm, DIAG_DBG | DIAG_WARN | DIAG_MULTI_PART,
+      "ignoring %s", builtin->name );
+   if ( builtin->num_args > 0 ) {
+      v_diag_more( vm, "( " );
+      for ( i32 i = 0; i < builtin->num_args; ++i ) {
+         v_diag_more( vm, "%d", args[ i ] );
+         if ( i + 1 < builtin->num_args ) {
+            v_diag_more( vm, ", " );
+         }
+      }
+      v_diag_more( vm, " )\n" );
+   }
+   else {
+      v_diag_more( vm, "()\n" );
+   }
+   return 0;
+}
+
+static i32 run_fixed_mul( struct vm* vm, struct turn* turn,
+   const struct builtin* builtin, const i32* args ) {
+   return fixed_mul( args[ 0 ], args[ 1 ] );
+}
+
+static i32 run_fixed_div( struct vm* vm, struct turn* turn,
+   const struct builtin* builtin, const i32* args ) {
+   return fixed_div( args[ 0 ], args[ 1 ] );
+}
+
+static i32 run_sin( struct vm* vm, struct turn* turn,
+   const struct builtin* builtin, const i32* args ) {
+   return fixed_sin( args[ 0 ] );
+}
+
+static i32 run_cos( struct vm* vm, struct turn* turn,
+   const struct builtin* builtin, const i32* args ) {
+   return fixed_cos( args[ 0 ] );
+}
+
+static i32 run_vector_angle( struct vm* vm, struct turn* turn,
+   const struct builtin* builtin, const i32* args ) {
+   return fixed_vector_angle( args[ 0 ], args[ 1 ] );
+}
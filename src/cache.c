@@ -0,0 +1,575 @@
+/**
+ * This file implements the module image cache. After the chunks of a module
+ * are read, the resulting state is saved to a file in the cache directory. On
+ * a later run, if the object file has not changed, the module is restored from
+ * the memory-mapped cache file and its chunks are not read again.
+ *
+ * A cache file is keyed on the identity of the object file, its modification
+ * time, its size, and a hash of its contents. Names are stored as offsets into
+ * the object file, so the object file itself is still needed; it is mapped
+ * into memory and not copied.
+ */
+
+#include <stdio.h>
+#include <setjmp.h>
+#include <string.h>
+
+#include "common/misc.h"
+
+#if OS_WINDOWS
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+#include "common/mem.h"
+#include "common/str.h"
+#include "common/list.h"
+#include "common/fs.h"
+#include "vm.h"
+
+enum { CACHE_VERSION = 2 };
+enum { CACHE_BYTE_ORDER = 0x01020304 };
+enum { NO_NAME = -1 };
+
+struct cache_key {
+   struct fileid fileid;
+   i64 mtime;
+   u64 size;
+   u64 content_hash;
+};
+
+struct cache_header {
+   char magic[ 8 ];
+   u32 version;
+   u32 byte_order;
+   struct cache_key key;
+};
+
+struct cache_reader {
+   const u8* data;
+   usize size;
+   usize pos;
+   bool err;
+};
+
+static bool read_key( struct module* module, const char* path,
+   struct cache_key* key );
+static void get_cache_path( struct vm* vm, struct module* module,
+   const char* path, struct str* cache_path );
+static bool restore_module( struct module* module,
+   struct cache_reader* reader );
+static void free_scripts( struct list* scripts );
+static void free_funcs( struct func* funcs, const char** names,
+   i32 total_funcs );
+static void free_vars( struct var* vars, i32* values, i32 total_vars );
+static void free_strings( struct list* strings );
+static void free_imports( struct list* imports );
+static i32 read_i32( struct cache_reader* reader );
+static const char* read_name( struct module* module,
+   struct cache_reader* reader );
+static struct script_array* read_arrays( struct cache_reader* reader,
+   i32* total_arrays, isize* total_size );
+static void write_i32( FILE* fh, i32 value );
+static void write_name( FILE* fh, struct module* module, const char* name );
+static void write_arrays( FILE* fh, struct script_array* arrays,
+   i32 total_arrays );
+
+static const char g_magic[ 8 ] = { 'A', 'C', 'S', 'V', 'M', 'I', 'M', 'G' };
+
+/**
+ * Restores a module from its cache file. The object of the module must
+ * already be initialized. Returns false if there is no usable cache file, in
+ * which case the module is left unchanged.
+ */
+bool vm_restore_cached_module( struct vm* vm, struct module* module,
+   const char* path ) {
+   struct cache_key key;
+   if ( ! read_key( module, path, &key ) ) {
+      return false;
+   }
+   struct str cache_path;
+   str_init( &cache_path );
+   get_cache_path( vm, module, path, &cache_path );
+   struct fs_mapping mapping;
+   bool restored = false;
+   if ( fs_map_file( cache_path.value, &mapping ) ) {
+      struct cache_header header;
+      if ( mapping.size >= sizeof( header ) ) {
+         memcpy( &header, mapping.data, sizeof( header ) );
+         if ( memcmp( header.magic, g_magic, sizeof( g_magic ) ) == 0 &&
+            header.version == CACHE_VERSION &&
+            header.byte_order == CACHE_BYTE_ORDER &&
+            memcmp( &header.key, &key, sizeof( key ) ) == 0 ) {
+            struct cache_reader reader = {
+               .data = mapping.data,
+               .size = mapping.size,
+               .pos = sizeof( header ),
+               .err = false,
+            };
+            restored = restore_module( module, &reader );
+         }
+      }
+      fs_unmap_file( &mapping );
+   }
+   if ( restored ) {
+      v_diag( vm, DIAG_DBG, "restored module `%s` from %s", module->name,
+         cache_path.value );
+   }
+   str_deinit( &cache_path );
+   return restored;
+}
+
+static bool read_key( struct module* module, const char* path,
+   struct cache_key* key ) {
+   // Zero the padding too, so the key can be compared with memcmp().
+   memset( key, 0, sizeof( *key ) );
+   struct fs_query query;
+   fs_init_query( &query, path );
+   struct fs_timestamp mtime;
+   if ( ! c_read_fileid( &key->fileid, path ) ||
+      ! fs_get_mtime( &query, &mtime ) ) {
+      return false;
+   }
+   key->mtime = mtime.value;
+   key->size = module->object.size;
+   key->content_hash = hash_calc_data( module->object.data,
+      module->object.size );
+   return true;
+}
+
+/**
+ * The cache file is named after a hash of the full path of the object file
+ * and the name of the module.
+ */
+static void get_cache_path( struct vm* vm, struct module* module,
+   const char* path, struct str* cache_path ) {
+   struct str full_path;
+   str_init( &full_path );
+   if ( ! c_read_full_path( path, &full_path ) ) {
+      str_copy( &full_path, path, strlen( path ) );
+   }
+   // A WAD archive holds several modules, so tell them apart by name.
+   str_append( &full_path, ":" );
+   str_append( &full_path, module->name );
+   str_append( cache_path, vm->options->cache_dir );
+   str_append( cache_path, OS_PATHSEP );
+   str_append_format( cache_path, "%016llx.acsvmc",
+      hash_calc_data( full_path.value, full_path.length ) );
+   str_deinit( &full_path );
+}
+
+/**
+ * The state is first read into temporary storage, so that the module is left
+ * unchanged if the cache file turns out to be malformed.
+ */
+static bool restore_module( struct module* module,
+   struct cache_reader* reader ) {
+   // Scripts. Each one takes at least seven numbers.
+   struct list scripts;
+   list_init( &scripts );
+   i32 total_scripts = read_i32( reader );
+   if ( total_scripts < 0 || ( usize ) total_scripts >
+      ( reader->size - reader->pos ) / ( sizeof( i32 ) * 7 ) ) {
+      reader->err = true;
+      total_scripts = 0;
+   }
+   for ( i32 i = 0; i < total_scripts && ! reader->err; ++i ) {
+      struct script* script = mem_alloc( sizeof( *script ) );
+      struct script_info* info = mem_alloc( sizeof( *info ) );
+      script->info = info;
+      script->number = read_i32( reader );
+      info->type = read_i32( reader );
+      info->flags = read_i32( reader );
+      script->start = read_i32( reader );
+      script->num_vars = read_i32( reader );
+      info->name = read_name( module, reader );
+      // Numbered scripts have no name.
+      if ( info->name[ 0 ] == '\0' ) {
+         info->name = null;
+      }
+      script->arrays = read_arrays( reader, &script->num_arrays,
+         &script->total_array_size );
+      list_append( &scripts, script );
+   }
+   // Functions. Each one takes at least six numbers.
+   struct func* funcs = NULL;
+   const char** func_names = NULL;
+   i32 total_funcs = read_i32( reader );
+   if ( total_funcs < 0 || ( usize ) total_funcs >
+      ( reader->size - reader->pos ) / ( sizeof( i32 ) * 6 ) ) {
+      reader->err = true;
+      total_funcs = 0;
+   }
+   if ( total_funcs > 0 && ! reader->err ) {
+      funcs = mem_alloc( sizeof( funcs[ 0 ] ) * total_funcs );
+      func_names = mem_alloc( sizeof( func_names[ 0 ] ) * total_funcs );
+      // Functions that are not read have no arrays to free.
+      memset( funcs, 0, sizeof( funcs[ 0 ] ) * total_funcs );
+   }
+   for ( i32 i = 0; i < total_funcs && ! reader->err; ++i ) {
+      struct func* func = &funcs[ i ];
+      func->module = module;
+      func->params = read_i32( reader );
+      func->local_size = read_i32( reader );
+      func->start = read_i32( reader );
+      func->imported = ( read_i32( reader ) != 0 );
+      func_names[ i ] = read_name( module, reader );
+      func->arrays = read_arrays( reader, &func->num_arrays,
+         &func->total_array_size );
+   }
+   // Map variables. Each one takes at least six numbers.
+   i32 total_vars = read_i32( reader );
+   if ( total_vars < 0 || ( usize ) total_vars >
+      ( reader->size - reader->pos ) / ( sizeof( i32 ) * 6 ) ) {
+      reader->err = true;
+      total_vars = 0;
+   }
+   isize vars_size = ( total_vars > 0 ? total_vars : 1 );
+   struct var* vars = mem_alloc( sizeof( vars[ 0 ] ) * vars_size );
+   i32* values = mem_alloc( sizeof( values[ 0 ] ) * vars_size );
+   // Variables that are not read have no elements to free.
+   memset( vars, 0, sizeof( vars[ 0 ] ) * vars_size );
+   for ( i32 i = 0; i < total_vars && ! reader->err; ++i ) {
+      struct var* var = &vars[ i ];
+      var->name = read_name( module, reader );
+      values[ i ] = read_i32( reader );
+      var->size = read_i32( reader );
+      var->array = ( read_i32( reader ) != 0 );
+      var->imported = ( read_i32( reader ) != 0 );
+      var->elements = NULL;
+      var->region = NULL;
+      bool has_elements = ( read_i32( reader ) != 0 );
+      if ( has_elements && var->size >= 0 &&
+         reader->size - reader->pos >= sizeof( i32 ) * ( usize ) var->size ) {
+         var->elements = mem_alloc( sizeof( var->elements[ 0 ] ) * var->size );
+         memcpy( var->elements, reader->data + reader->pos,
+            sizeof( var->elements[ 0 ] ) * var->size );
+         reader->pos += sizeof( var->elements[ 0 ] ) * var->size;
+      }
+      else if ( has_elements ) {
+         reader->err = true;
+      }
+   }
+   // Strings.
+   struct list strings;
+   list_init( &strings );
+   i32 total_strings = read_i32( reader );
+   for ( i32 i = 0; i < total_strings && ! reader->err; ++i ) {
+      i32 length = read_i32( reader );
+      if ( length < 0 || reader->size - reader->pos < ( usize ) length ) {
+         reader->err = true;
+         break;
+      }
+      struct str* string = mem_alloc( sizeof( *string ) );
+      str_init( string );
+      str_copy( string, ( const char* ) reader->data + reader->pos, length );
+      reader->pos += length;
+      list_append( &strings, string );
+   }
+   // Imported modules.
+   struct list imports;
+   list_init( &imports );
+   i32 total_imports = read_i32( reader );
+   for ( i32 i = 0; i < total_imports && ! reader->err; ++i ) {
+      struct import* import = mem_alloc( sizeof( *import ) );
+      import->module_name = read_name( module, reader );
+      import->module = null;
+      list_append( &imports, import );
+   }
+   if ( reader->err ) {
+      free_scripts( &scripts );
+      free_funcs( funcs, func_names, total_funcs );
+      free_vars( vars, values, total_vars );
+      free_strings( &strings );
+      free_imports( &imports );
+      return false;
+   }
+
+   struct list_iter i;
+   list_iterate( &scripts, &i );
+   while ( ! list_end( &i ) ) {
+      struct script* script = list_data( &i );
+      hash_add_number( &module->script_table, script->number, script );
+      list_next( &i );
+   }
+   list_merge( &module->scripts, &scripts );
+   module->func_table.entries = funcs;
+   module->func_table.names = func_names;
+   module->func_table.size = ( funcs != NULL ) ? total_funcs : 0;
+   vm_alloc_map_vars( module, total_vars );
+   for ( i32 k = 0; k < total_vars; ++k ) {
+      module->vars[ k ] = vars[ k ];
+      module->vars[ k ].link = &module->vars[ k ];
+      module->var_values[ k ] = values[ k ];
+      if ( module->vars[ k ].elements == NULL ) {
+         module->vars[ k ].elements = &module->var_values[ k ];
+      }
+   }
+   mem_free( vars );
+   mem_free( values );
+   list_merge( &module->strings, &strings );
+   list_merge( &module->imports, &imports );
+   return true;
+}
+
+/**
+ * The functions below free what was read from a malformed cache file. The
+ * names point into the object file, so they are not freed.
+ */
+static void free_scripts( struct list* scripts ) {
+   struct list_iter i;
+   list_iterate( scripts, &i );
+   while ( ! list_end( &i ) ) {
+      struct script* script = list_data( &i );
+      if ( script->arrays != NULL ) {
+         mem_free( script->arrays );
+      }
+      mem_free( script->info );
+      mem_free( script );
+      list_next( &i );
+   }
+   list_deinit( scripts );
+}
+
+static void free_funcs( struct func* funcs, const char** names,
+   i32 total_funcs ) {
+   if ( funcs == NULL ) {
+      return;
+   }
+   for ( i32 i = 0; i < total_funcs; ++i ) {
+      if ( funcs[ i ].arrays != NULL ) {
+         mem_free( funcs[ i ].arrays );
+      }
+   }
+   mem_free( funcs );
+   mem_free( names );
+}
+
+static void free_vars( struct var* vars, i32* values, i32 total_vars ) {
+   for ( i32 i = 0; i < total_vars; ++i ) {
+      if ( vars[ i ].elements != NULL ) {
+         mem_free( vars[ i ].elements );
+      }
+   }
+   mem_free( vars );
+   mem_free( values );
+}
+
+static void free_strings( struct list* strings ) {
+   struct list_iter i;
+   list_iterate( strings, &i );
+   while ( ! list_end( &i ) ) {
+      struct str* string = list_data( &i );
+      str_deinit( string );
+      mem_free( string );
+      list_next( &i );
+   }
+   list_deinit( strings );
+}
+
+static void free_imports( struct list* imports ) {
+   struct list_iter i;
+   list_iterate( imports, &i );
+   while ( ! list_end( &i ) ) {
+      mem_free( list_data( &i ) );
+      list_next( &i );
+   }
+   list_deinit( imports );
+}
+
+static i32 read_i32( struct cache_reader* reader ) {
+   i32 value = 0;
+   if ( reader->size - reader->pos >= sizeof( value ) ) {
+      memcpy( &value, reader->data + reader->pos, sizeof( value ) );
+      reader->pos += sizeof( value );
+   }
+   else {
+      reader->err = true;
+   }
+   return value;
+}
+
+/**
+ * Names are stored as offsets into the object file.
+ */
+static const char* read_name( struct module* module,
+   struct cache_reader* reader ) {
+   i32 offset = read_i32( reader );
+   if ( offset == NO_NAME ) {
+      return "";
+   }
+   if ( offset < 0 || offset >= module->object.size ||
+      ! memchr( module->object.data + offset, '\0',
+         module->object.size - offset ) ) {
+      reader->err = true;
+      return "";
+   }
+   return ( const char* ) ( module->object.data + offset );
+}
+
+static struct script_array* read_arrays( struct cache_reader* reader,
+   i32* total_arrays, isize* total_size ) {
+   *total_arrays = read_i32( reader );
+   *total_size = 0;
+   // Each array has its size stored, so there cannot be more arrays than
+   // there are sizes left to read.
+   if ( ! reader->err && ( *total_arrays < 0 ||
+      ( usize ) *total_arrays > ( reader->size - reader->pos ) /
+         sizeof( i32 ) ) ) {
+      reader->err = true;
+   }
+   if ( *total_arrays <= 0 || reader->err ) {
+      *total_arrays = 0;
+      return NULL;
+   }
+   struct script_array* arrays = mem_alloc( sizeof( arrays[ 0 ] ) *
+      *total_arrays );
+   for ( i32 i = 0; i < *total_arrays; ++i ) {
+      arrays[ i ].start = *total_size;
+      arrays[ i ].size = read_i32( reader );
+      // A damaged cache file can contain sizes that are negative or that add
+      // up to more than the arrays can hold.
+      if ( arrays[ i ].size < 0 || *total_size > INT_MAX - arrays[ i ].size ) {
+         reader->err = true;
+      }
+      if ( reader->err ) {
+         mem_free( arrays );
+         *total_arrays = 0;
+         *total_size = 0;
+         return NULL;
+      }
+      *total_size += arrays[ i ].size;
+   }
+   return arrays;
+}
+
+/**
+ * Saves the state of a freshly loaded module to its cache file. The state
+ * must be saved before the module is linked. Failing to save the cache file
+ * is not an error.
+ */
+void vm_cache_module( struct vm* vm, struct module* module,
+   const char* path ) {
+   struct cache_header header;
+   memset( &header, 0, sizeof( header ) );
+   if ( ! read_key( module, path, &header.key ) ) {
+      return;
+   }
+   memcpy( header.magic, g_magic, sizeof( g_magic ) );
+   header.version = CACHE_VERSION;
+   header.byte_order = CACHE_BYTE_ORDER;
+
+   struct fs_result result;
+   fs_create_dir( vm->options->cache_dir, &result );
+   struct str cache_path;
+   str_init( &cache_path );
+   get_cache_path( vm, module, path, &cache_path );
+   // Write to a temporary file first, so a concurrent run never maps a
+   // partially written cache file.
+   struct str temp_path;
+   str_init( &temp_path );
+   str_append_format( &temp_path, "%s.%d.tmp", cache_path.value,
+      ( int ) getpid() );
+   FILE* fh = fopen( temp_path.value, "wb" );
+   if ( ! fh ) {
+      v_diag( vm, DIAG_DBG, "failed to create cache file %s",
+         temp_path.value );
+      goto deinit;
+   }
+   fwrite( &header, sizeof( header ), 1, fh );
+   // Scripts.
+   write_i32( fh, list_size( &module->scripts ) );
+   struct list_iter i;
+   list_iterate( &module->scripts, &i );
+   while ( ! list_end( &i ) ) {
+      struct script* script = list_data( &i );
+      write_i32( fh, script->number );
+      write_i32( fh, script->info->type );
+      write_i32( fh, script->info->flags );
+      write_i32( fh, script->start );
+      write_i32( fh, script->num_vars );
+      write_name( fh, module, script->info->name );
+      write_arrays( fh, script->arrays, script->num_arrays );
+      list_next( &i );
+   }
+   // Functions.
+   write_i32( fh, module->func_table.size );
+   for ( i32 k = 0; k < module->func_table.size; ++k ) {
+      struct func* func = &module->func_table.entries[ k ];
+      write_i32( fh, func->params );
+      write_i32( fh, func->local_size );
+      write_i32( fh, func->start );
+      write_i32( fh, func->imported );
+      write_name( fh, module, module->func_table.names[ k ] );
+      write_arrays( fh, func->arrays, func->num_arrays );
+   }
+   // Map variables.
+   write_i32( fh, module->num_vars );
+   for ( i32 k = 0; k < module->num_vars; ++k ) {
+      struct var* var = &module->vars[ k ];
+      bool has_elements = ( var->elements != &module->var_values[ k ] );
+      write_name( fh, module, var->name );
+      write_i32( fh, module->var_values[ k ] );
+      write_i32( fh, var->size );
+      write_i32( fh, var->array );
+      write_i32( fh, var->imported );
+      write_i32( fh, has_elements );
+      if ( has_elements ) {
+         fwrite( var->elements, sizeof( var->elements[ 0 ] ), var->size, fh );
+      }
+   }
+   // Strings.
+   write_i32( fh, list_size( &module->strings ) );
+   list_iterate( &module->strings, &i );
+   while ( ! list_end( &i ) ) {
+      struct str* string = list_data( &i );
+      write_i32( fh, string->length );
+      fwrite( string->value, 1, string->length, fh );
+      list_next( &i );
+   }
+   // Imported modules.
+   write_i32( fh, list_size( &module->imports ) );
+   list_iterate( &module->imports, &i );
+   while ( ! list_end( &i ) ) {
+      struct import* import = list_data( &i );
+      write_name( fh, module, import->module_name );
+      list_next( &i );
+   }
+   bool written = ( ferror( fh ) == 0 );
+   if ( fclose( fh ) == 0 && written &&
+      rename( temp_path.value, cache_path.value ) == 0 ) {
+      v_diag( vm, DIAG_DBG, "saved module `%s` to %s", module->name,
+         cache_path.value );
+   }
+   else {
+      fs_delete_file( temp_path.value );
+   }
+   deinit:
+   str_deinit( &temp_path );
+   str_deinit( &cache_path );
+}
+
+static void write_i32( FILE* fh, i32 value ) {
+   fwrite( &value, sizeof( value ), 1, fh );
+}
+
+static void write_name( FILE* fh, struct module* module, const char* name ) {
+   const u8* data = ( const u8* ) name;
+   if ( data >= module->object.data &&
+      data < module->object.data + module->object.size ) {
+      write_i32( fh, data - module->object.data );
+   }
+   else {
+      write_i32( fh, NO_NAME );
+   }
+}
+
+static void write_arrays( FILE* fh, struct script_array* arrays,
+   i32 total_arrays ) {
+   write_i32( fh, total_arrays );
+   for ( i32 i = 0; i < total_arrays; ++i ) {
+      write_i32( fh, arrays[ i ].size );
+   }
+}
@@ -0,0 +1,1004 @@
+/**
+ * This file implements checkpoints. A checkpoint holds the execution state of
+ * a virtual machine between two tics: the queued and suspended script
+ * instances, the variables and arrays, the tic counter, and the state of the
+ * random number generator. A checkpoint can be restored into a virtual
+ * machine that has loaded the same modules, in this process or in another
+ * one, so a session can be moved between hosts.
+ *
+ * The modules are not saved. A full checkpoint lists each module by name,
+ * size, and a hash of its contents, and a restore checks that they match.
+ * Variables are saved as runs of the values that differ from a base: the
+ * pristine state saved by vm_save_pristine_state() when the virtual machine
+ * has one, and zero otherwise. With a pristine state, the pages that were not
+ * written since the last reset are skipped without being compared.
+ *
+ * From the first checkpoint on, writes to the variables are tracked. An
+ * increment holds only the pages of variables and of world and global arrays
+ * written since the previous checkpoint, so saving one costs in proportion to
+ * how much was written. Each
+ * checkpoint has an ID, and an increment names the ID of the checkpoint it
+ * builds on, so a chain of checkpoints is restored in order: the full
+ * checkpoint, then each increment.
+ *
+ * A checkpoint is restored straight from its buffer, which can be a mapped
+ * file. The buffer is read twice: the first pass only checks it, so a
+ * malformed checkpoint leaves the virtual machine unchanged.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include "common/misc.h"
+#include "common/mem.h"
+#include "common/str.h"
+#include "common/list.h"
+#include "vm.h"
+
+enum { CHECKPOINT_VERSION = 3 };
+enum { CHECKPOINT_BYTE_ORDER = 0x01020304 };
+enum {
+   CHECKPOINT_PRISTINE_BASE = 0x1,
+   CHECKPOINT_INCREMENT = 0x2,
+};
+enum { END_OF_RUNS = -1 };
+// A run of changed values goes on through this many unchanged values, which
+// is smaller than starting a new run.
+enum { MAX_RUN_GAP = 3 };
+// Index of the first region of module variables.
+enum { FIRST_MODULE_REGION = 2 };
+
+struct checkpoint_header {
+   char magic[ 8 ];
+   u32 version;
+   u32 byte_order;
+   u32 flags;
+   i32 num_modules;
+   // Hash of the rest of the checkpoint, combined with the base ID.
+   u64 id;
+   u64 base_id; // ID of the checkpoint an increment builds on, or 0.
+};
+
+struct checkpoint_reader {
+   struct vm* vm;
+   const u8* data;
+   usize size;
+   usize pos;
+   u32 flags;
+   u64 id;
+   // In the first pass, the checkpoint is only checked.
+   bool apply;
+   bool err;
+   const char* reason; // Why the checkpoint was rejected.
+};
+
+// Untracked values that a run can be written to.
+struct run_target {
+   i32* values;
+   isize size;
+};
+
+static bool save( struct vm* vm, struct checkpoint* checkpoint,
+   bool increment );
+static bool has_waiting_scripts( struct vm* vm );
+static void write_header( struct vm* vm, struct checkpoint* checkpoint,
+   bool increment );
+static void write_counters( struct vm* vm, struct checkpoint* checkpoint );
+static void write_vars( struct vm* vm, struct checkpoint* checkpoint );
+static void write_dirty_pages( struct vm* vm,
+   struct checkpoint* checkpoint );
+static void write_all_arrays( struct vm* vm, struct checkpoint* checkpoint,
+   bool increment );
+static void write_arrays( struct checkpoint* checkpoint,
+   struct sparse_array* arrays, isize num_arrays, bool all_pages );
+static i32 count_pages( struct sparse_array* array, bool all_pages );
+static void write_scripts( struct vm* vm, struct checkpoint* checkpoint );
+static void write_instance( struct checkpoint* checkpoint,
+   struct instance* instance );
+static void write_runs( struct checkpoint* checkpoint, i32 id,
+   const i32* values, const struct dirty_region* region, isize size );
+static void write_runs_in_range( struct checkpoint* checkpoint, i32 id,
+   const i32* values, const i32* base, isize start, isize end );
+static void write_run( struct checkpoint* checkpoint, i32 id,
+   const i32* values, isize start, isize count );
+static void write_i32( struct checkpoint* checkpoint, i32 value );
+static void write_i64( struct checkpoint* checkpoint, i64 value );
+static void write_data( struct checkpoint* checkpoint, const void* data,
+   usize size );
+static u64 calc_id( u64 base_id, const u8* data, usize size );
+static void finish( struct vm* vm, u64 id );
+static void clear_written_pages( struct sparse_array* arrays,
+   isize num_arrays );
+static isize find_module_index( struct vm* vm, struct script* script );
+static struct module* get_module_at( struct vm* vm, isize index );
+static void prepare_restore( struct vm* vm, u32 flags );
+static void clear_region( struct vm* vm, struct dirty_region* region );
+static void read_checkpoint( struct checkpoint_reader* reader );
+static void read_header( struct checkpoint_reader* reader );
+static void check_header( struct checkpoint_reader* reader,
+   struct checkpoint_header* header );
+static void read_counters( struct checkpoint_reader* reader );
+static void read_vars( struct checkpoint_reader* reader );
+static void read_dirty_pages( struct checkpoint_reader* reader );
+static void read_all_arrays( struct checkpoint_reader* reader );
+static void read_arrays( struct checkpoint_reader* reader,
+   struct sparse_array* arrays, isize num_arrays );
+static void read_array_page( struct checkpoint_reader* reader,
+   struct sparse_array* array );
+static void read_scripts( struct checkpoint_reader* reader );
+static struct instance* read_instance( struct checkpoint_reader* reader,
+   struct module* module );
+static void read_region_runs( struct checkpoint_reader* reader,
+   struct dirty_region* regions, isize num_regions );
+static void read_runs( struct checkpoint_reader* reader,
+   struct run_target* targets, i32 num_targets );
+static bool read_run( struct checkpoint_reader* reader, i32* id,
+   i32* start, i32* count );
+static i32 read_i32( struct checkpoint_reader* reader );
+static i64 read_i64( struct checkpoint_reader* reader );
+static void read_data( struct checkpoint_reader* reader, void* data,
+   usize size );
+static void reject( struct checkpoint_reader* reader, const char* reason );
+
+static const char g_magic[ 8 ] = { 'A', 'C', 'S', 'V', 'M', 'C', 'K', 'P' };
+
+void vm_init_checkpoint( struct checkpoint* checkpoint ) {
+   checkpoint->data = NULL;
+   checkpoint->size = 0;
+   checkpoint->capacity = 0;
+}
+
+void vm_deinit_checkpoint( struct checkpoint* checkpoint ) {
+   if ( checkpoint->data != NULL ) {
+      mem_free( checkpoint->data );
+   }
+}
+
+/**
+ * Saves the execution state of the virtual machine into the checkpoint,
+ * replacing what the checkpoint held. Call between tics. Returns false if a
+ * script is delayed inside a function, because the locals of a function call
+ * live on the stack of the turn that made the call and cannot be saved. Also
+ * returns false if a script is waiting for another script to finish, because
+ * the scripts that wait are not saved.
+ */
+bool vm_checkpoint( struct vm* vm, struct checkpoint* checkpoint ) {
+   return save( vm, checkpoint, false );
+}
+
+/**
+ * Saves the changes since the last checkpoint that the virtual machine saved
+ * or restored. Returns false if there is no such checkpoint.
+ */
+bool vm_checkpoint_increment( struct vm* vm,
+   struct checkpoint* checkpoint ) {
+   if ( vm->checkpoint_id == 0 ) {
+      v_diag( vm, DIAG_ERR,
+         "cannot save an increment without an earlier checkpoint" );
+      return false;
+   }
+   return save( vm, checkpoint, true );
+}
+
+static bool save( struct vm* vm, struct checkpoint* checkpoint,
+   bool increment ) {
+   if ( vm->call_stack != NULL ) {
+      v_diag( vm, DIAG_ERR,
+         "cannot save a checkpoint while a script is inside a function" );
+      return false;
+   }
+   if ( has_waiting_scripts( vm ) ) {
+      v_diag( vm, DIAG_ERR,
+         "cannot save a checkpoint while a script waits for another script" );
+      return false;
+   }
+   vm_track_writes( vm );
+   checkpoint->size = 0;
+   write_header( vm, checkpoint, increment );
+   write_counters( vm, checkpoint );
+   if ( increment ) {
+      write_dirty_pages( vm, checkpoint );
+   }
+   else {
+      write_vars( vm, checkpoint );
+   }
+   write_all_arrays( vm, checkpoint, increment );
+   write_scripts( vm, checkpoint );
+   struct checkpoint_header header;
+   memcpy( &header, checkpoint->data, sizeof( header ) );
+   header.id = calc_id( header.base_id, checkpoint->data + sizeof( header ),
+      checkpoint->size - sizeof( header ) );
+   memcpy( checkpoint->data, &header, sizeof( header ) );
+   finish( vm, header.id );
+   return true;
+}
+
+/**
+ * A script that waits for another script is only found through the list of
+ * scripts waiting on the other one, which can itself be queued or suspended.
+ */
+static bool has_waiting_scripts( struct vm* vm ) {
+   struct list_iter i;
+   list_iterate( &vm->modules, &i );
+   while ( ! list_end( &i ) ) {
+      struct module* module = list_data( &i );
+      struct run_queue* queue = &module->waiting_scripts;
+      for ( isize k = queue->head; k < queue->tail; ++k ) {
+         struct list* waiting = queue->instances[ k ]->waiting;
+         if ( waiting != NULL && list_size( waiting ) > 0 ) {
+            return true;
+         }
+      }
+      list_next( &i );
+   }
+   list_iterate( &vm->suspended_scripts, &i );
+   while ( ! list_end( &i ) ) {
+      struct instance* instance = list_data( &i );
+      if ( instance->waiting != NULL && list_size( instance->waiting ) > 0 ) {
+         return true;
+      }
+      list_next( &i );
+   }
+   return false;
+}
+
+/**
+ * The ID is filled in after the rest of the checkpoint is written.
+ */
+static void write_header( struct vm* vm, struct checkpoint* checkpoint,
+   bool increment ) {
+   struct checkpoint_header header;
+   memset( &header, 0, sizeof( header ) );
+   memcpy( header.magic, g_magic, sizeof( g_magic ) );
+   header.version = CHECKPOINT_VERSION;
+   header.byte_order = CHECKPOINT_BYTE_ORDER;
+   if ( vm->pristine != NULL ) {
+      header.flags |= CHECKPOINT_PRISTINE_BASE;
+   }
+   if ( increment ) {
+      header.flags |= CHECKPOINT_INCREMENT;
+      header.base_id = vm->checkpoint_id;
+   }
+   header.num_modules = list_size( &vm->modules );
+   write_data( checkpoint, &header, sizeof( header ) );
+   if ( increment ) {
+      return;
+   }
+   struct list_iter i;
+   list_iterate( &vm->modules, &i );
+   while ( ! list_end( &i ) ) {
+      struct module* module = list_data( &i );
+      write_data( checkpoint, module->name, sizeof( module->name ) );
+      write_i32( checkpoint, module->object.size );
+      write_i64( checkpoint, ( i64 ) hash_calc_data( module->object.data,
+         module->object.size ) );
+      list_next( &i );
+   }
+}
+
+static void write_counters( struct vm* vm, struct checkpoint* checkpoint ) {
+   write_i64( checkpoint, vm->tics );
+   write_i64( checkpoint, vm->num_active_scripts );
+   for ( isize i = 0; i < ARRAY_SIZE( vm->rng.state ); ++i ) {
+      write_i64( checkpoint, ( i64 ) vm->rng.state[ i ] );
+   }
+}
+
+/**
+ * The world variables, the global variables, and the variables of each
+ * module are each saved as a list of runs. In the list of a module, a run
+ * starts with the index of the variable.
+ */
+static void write_vars( struct vm* vm, struct checkpoint* checkpoint ) {
+   struct write_tracker* tracker = vm->tracker;
+   write_runs( checkpoint, 0, vm->world_vars, vm->world_region,
+      ARRAY_SIZE( vm->world_vars ) );
+   write_i32( checkpoint, END_OF_RUNS );
+   write_runs( checkpoint, 0, vm->global_vars, vm->global_region,
+      ARRAY_SIZE( vm->global_vars ) );
+   write_i32( checkpoint, END_OF_RUNS );
+   isize first_region = FIRST_MODULE_REGION;
+   struct list_iter i;
+   list_iterate( &vm->modules, &i );
+   while ( ! list_end( &i ) ) {
+      struct module* module = list_data( &i );
+      for ( isize k = 0; k < module->num_vars; ++k ) {
+         struct dirty_region* region = &tracker->regions[ first_region + k ];
+         write_runs( checkpoint, k, region->values, region, region->size );
+      }
+      write_i32( checkpoint, END_OF_RUNS );
+      first_region += module->num_vars;
+      list_next( &i );
+   }
+}
+
+/**
+ * An increment saves each page written since the last checkpoint: the index
+ * of the region of the page, the index of the page, and the runs of values in
+ * the page that differ from their base. When restored, the page is put back
+ * to its base first, so the values that went back to their base are not
+ * saved.
+ */
+static void write_dirty_pages( struct vm* vm,
+   struct checkpoint* checkpoint ) {
+   struct write_tracker* tracker = vm->tracker;
+   struct page_log* log = &tracker->checkpoint_log;
+   for ( isize i = 0; i < log->size; ++i ) {
+      struct dirty_region* region = log->pages[ i ].region;
+      isize start = log->pages[ i ].page << DIRTY_PAGE_SHIFT;
+      isize end = start + ( 1 << DIRTY_PAGE_SHIFT );
+      if ( end > region->size ) {
+         end = region->size;
+      }
+      // An empty region has a page, but nothing to save.
+      if ( start < end ) {
+         write_i32( checkpoint, region - tracker->regions );
+         write_i32( checkpoint, log->pages[ i ].page );
+         write_runs_in_range( checkpoint, 0, region->values,
+            region->pristine, start, end );
+         write_i32( checkpoint, END_OF_RUNS );
+      }
+   }
+   write_i32( checkpoint, END_OF_RUNS );
+}
+
+/**
+ * The arrays are saved by page. An increment saves only the pages written
+ * since the last checkpoint, unless the arrays were emptied since then. A flag
+ * tells whether every page is saved, in which case the arrays are emptied
+ * before they are restored.
+ */
+static void write_all_arrays( struct vm* vm, struct checkpoint* checkpoint,
+   bool increment ) {
+   bool all_pages = ( ! increment || vm->arrays_cleared );
+   write_i32( checkpoint, all_pages );
+   write_arrays( checkpoint, vm->world_arrays,
+      ARRAY_SIZE( vm->world_arrays ), all_pages );
+   write_arrays( checkpoint, vm->global_arrays,
+      ARRAY_SIZE( vm->global_arrays ), all_pages );
+}
+
+/**
+ * A page starts with the index of its first element, followed by the runs of
+ * nonzero elements, with the index of a run relative to the page.
+ */
+static void write_arrays( struct checkpoint* checkpoint,
+   struct sparse_array* arrays, isize num_arrays, bool all_pages ) {
+   for ( isize i = 0; i < num_arrays; ++i ) {
+      i32 num_pages = count_pages( &arrays[ i ], all_pages );
+      if ( num_pages > 0 ) {
+         write_i32( checkpoint, i );
+         write_i32( checkpoint, num_pages );
+         struct sparse_page* page = arrays[ i ].pages;
+         for ( ; page != NULL; page = page->next ) {
+            if ( all_pages || page->written ) {
+               write_i32( checkpoint, ( i32 ) page->first );
+               write_runs_in_range( checkpoint, 0, page->elements, NULL, 0,
+                  SPARSE_PAGE_SIZE );
+               write_i32( checkpoint, END_OF_RUNS );
+            }
+         }
+      }
+   }
+   write_i32( checkpoint, END_OF_RUNS );
+}
+
+static i32 count_pages( struct sparse_array* array, bool all_pages ) {
+   i32 count = 0;
+   struct sparse_page* page = array->pages;
+   for ( ; page != NULL; page = page->next ) {
+      if ( all_pages || page->written ) {
+         ++count;
+      }
+   }
+   return count;
+}
+
+static void write_scripts( struct vm* vm, struct checkpoint* checkpoint ) {
+   struct list_iter i;
+   list_iterate( &vm->modules, &i );
+   while ( ! list_end( &i ) ) {
+      struct module* module = list_data( &i );
+      struct run_queue* queue = &module->waiting_scripts;
+      write_i32( checkpoint, queue->tail - queue->head );
+      for ( isize k = queue->head; k < queue->tail; ++k ) {
+         write_instance( checkpoint, queue->instances[ k ] );
+      }
+      list_next( &i );
+   }
+   write_i32( checkpoint, list_size( &vm->suspended_scripts ) );
+   list_iterate( &vm->suspended_scripts, &i );
+   while ( ! list_end( &i ) ) {
+      struct instance* instance = list_data( &i );
+      write_i32( checkpoint, find_module_index( vm, instance->script ) );
+      write_instance( checkpoint, instance );
+      list_next( &i );
+   }
+}
+
+static void write_instance( struct checkpoint* checkpoint,
+   struct instance* instance ) {
+   write_i32( checkpoint, instance->script->number );
+   write_i32( checkpoint, instance->state );
+   write_i32( checkpoint, instance->delay_amount );
+   write_i64( checkpoint, instance->resume_time );
+   write_i64( checkpoint, instance->ip );
+   write_runs( checkpoint, 0, instance->vars, NULL,
+      instance->script->num_vars );
+   write_runs( checkpoint, 1, instance->arrays, NULL,
+      instance->script->total_array_size );
+   write_i32( checkpoint, END_OF_RUNS );
+}
+
+/**
+ * Writes the values that differ from their base, as runs of values. The base
+ * is the pristine copy of the region when it has one, and zero otherwise.
+ * With a pristine copy, the pages not written since the last reset are
+ * skipped, and a run does not go past a page.
+ */
+static void write_runs( struct checkpoint* checkpoint, i32 id,
+   const i32* values, const struct dirty_region* region, isize size ) {
+   const i32* base = ( region != NULL ) ? region->pristine : NULL;
+   isize page_size = ( base != NULL ) ? 1 << DIRTY_PAGE_SHIFT : size;
+   for ( isize start = 0; start < size; start += page_size ) {
+      if ( base != NULL && ! ( region->pages[ start >> DIRTY_PAGE_SHIFT ] &
+         PAGE_DIRTY_RESET ) ) {
+         continue;
+      }
+      isize end = start + page_size;
+      if ( end > size ) {
+         end = size;
+      }
+      write_runs_in_range( checkpoint, id, values, base, start, end );
+   }
+}
+
+/**
+ * When the base is NULL, it is zero.
+ */
+static void write_runs_in_range( struct checkpoint* checkpoint, i32 id,
+   const i32* values, const i32* base, isize start, isize end ) {
+   isize i = start;
+   while ( i < end ) {
+      if ( values[ i ] == ( base ? base[ i ] : 0 ) ) {
+         ++i;
+         continue;
+      }
+      isize last = i;
+      for ( isize k = i + 1; k < end && k - last <= MAX_RUN_GAP; ++k ) {
+         if ( values[ k ] != ( base ? base[ k ] : 0 ) ) {
+            last = k;
+         }
+      }
+      write_run( checkpoint, id, values, i, last - i + 1 );
+      i = last + 1;
+   }
+}
+
+/**
+ * A run starts with the ID of the values, the index of the first value in the
+ * run, and the number of values in the run.
+ */
+static void write_run( struct checkpoint* checkpoint, i32 id,
+   const i32* values, isize start, isize count ) {
+   write_i32( checkpoint, id );
+   write_i32( checkpoint, start );
+   write_i32( checkpoint, count );
+   write_data( checkpoint, &values[ start ], sizeof( values[ 0 ] ) * count );
+}
+
+static void write_i32( struct checkpoint* checkpoint, i32 value ) {
+   write_data( checkpoint, &value, sizeof( value ) );
+}
+
+static void write_i64( struct checkpoint* checkpoint, i64 value ) {
+   write_data( checkpoint, &value, sizeof( value ) );
+}
+
+static void write_data( struct checkpoint* checkpoint, const void* data,
+   usize size ) {
+   if ( checkpoint->capacity - checkpoint->size < size ) {
+      usize capacity = ( checkpoint->capacity > 0 ) ?
+         checkpoint->capacity : 1024;
+      while ( capacity - checkpoint->size < size ) {
+         capacity *= 2;
+      }
+      checkpoint->data = mem_realloc( checkpoint->data, capacity );
+      checkpoint->capacity = capacity;
+   }
+   memcpy( checkpoint->data + checkpoint->size, data, size );
+   checkpoint->size += size;
+}
+
+static u64 calc_id( u64 base_id, const u8* data, usize size ) {
+   u64 hash = hash_calc_data( data, size );
+   hash ^= base_id + 0x9e3779b97f4a7c15ull + ( hash << 6 ) + ( hash >> 2 );
+   // Zero means no checkpoint.
+   return ( hash != 0 ) ? hash : 1;
+}
+
+/**
+ * The virtual machine is now at the checkpoint, so nothing is written since.
+ */
+static void finish( struct vm* vm, u64 id ) {
+   vm->checkpoint_id = id;
+   vm->dirty_flags |= PAGE_DIRTY_CHECKPOINT;
+   vm_clear_dirty_pages( vm, PAGE_DIRTY_CHECKPOINT );
+   clear_written_pages( vm->world_arrays, ARRAY_SIZE( vm->world_arrays ) );
+   clear_written_pages( vm->global_arrays, ARRAY_SIZE( vm->global_arrays ) );
+   vm->arrays_cleared = false;
+}
+
+static void clear_written_pages( struct sparse_array* arrays,
+   isize num_arrays ) {
+   for ( isize i = 0; i < num_arrays; ++i ) {
+      struct sparse_page* page = arrays[ i ].pages;
+      for ( ; page != NULL; page = page->next ) {
+         page->written = false;
+      }
+   }
+}
+
+static isize find_module_index( struct vm* vm, struct script* script ) {
+   struct list_iter i;
+   list_iterate( &vm->modules, &i );
+   for ( isize k = 0; ! list_end( &i ); ++k ) {
+      struct module* module = list_data( &i );
+      if ( hash_find_number( &module->script_table,
+         script->number ) == script ) {
+         return k;
+      }
+      list_next( &i );
+   }
+   UNREACHABLE();
+   return 0;
+}
+
+static struct module* get_module_at( struct vm* vm, isize index ) {
+   struct list_iter i;
+   list_iterate( &vm->modules, &i );
+   for ( isize k = 0; k < index; ++k ) {
+      list_next( &i );
+   }
+   return list_data( &i );
+}
+
+/**
+ * Replaces the execution state of the virtual machine with the one in the
+ * checkpoint. The virtual machine must have loaded the same modules as the one
+ * the checkpoint was saved from, and to restore an increment, it must be at
+ * the checkpoint the increment builds on. The scripts that were running are
+ * dropped, without their memory being freed. Returns false, and leaves the
+ * virtual machine unchanged, if the checkpoint cannot be restored.
+ */
+bool vm_restore( struct vm* vm, const void* data, usize size ) {
+   vm_track_writes( vm );
+   struct checkpoint_reader reader = {
+      .vm = vm,
+      .data = data,
+      .size = size,
+      .pos = 0,
+      .flags = 0,
+      .id = 0,
+      .apply = false,
+      .err = false,
+      .reason = NULL,
+   };
+   read_checkpoint( &reader );
+   if ( reader.err ) {
+      v_diag( vm, DIAG_ERR, "failed to restore checkpoint: %s",
+         reader.reason );
+      return false;
+   }
+   prepare_restore( vm, reader.flags );
+   reader.pos = 0;
+   reader.apply = true;
+   read_checkpoint( &reader );
+   finish( vm, reader.id );
+   return true;
+}
+
+/**
+ * Drops the running scripts. For a full checkpoint, also puts the variables
+ * back to the base the checkpoint is relative to.
+ */
+static void prepare_restore( struct vm* vm, u32 flags ) {
+   if ( flags & CHECKPOINT_INCREMENT ) {
+      vm_clear_run_state( vm );
+   }
+   else if ( flags & CHECKPOINT_PRISTINE_BASE ) {
+      vm_reset( vm );
+   }
+   else {
+      struct write_tracker* tracker = vm->tracker;
+      for ( isize i = 0; i < tracker->num_regions; ++i ) {
+         clear_region( vm, &tracker->regions[ i ] );
+      }
+      vm_clear_run_state( vm );
+   }
+}
+
+static void clear_region( struct vm* vm, struct dirty_region* region ) {
+   memset( region->values, 0, sizeof( region->values[ 0 ] ) * region->size );
+   vm_record_writes( vm, region, 0, region->size );
+}
+
+static void read_checkpoint( struct checkpoint_reader* reader ) {
+   struct vm* vm = reader->vm;
+   read_header( reader );
+   read_counters( reader );
+   if ( reader->flags & CHECKPOINT_INCREMENT ) {
+      read_dirty_pages( reader );
+   }
+   else {
+      read_vars( reader );
+   }
+   read_all_arrays( reader );
+   read_scripts( reader );
+   if ( ! reader->err && reader->pos != reader->size ) {
+      reject( reader, "malformed checkpoint" );
+   }
+}
+
+static void read_header( struct checkpoint_reader* reader ) {
+   struct vm* vm = reader->vm;
+   struct checkpoint_header header;
+   read_data( reader, &header, sizeof( header ) );
+   if ( reader->err ) {
+      return;
+   }
+   reader->flags = header.flags;
+   reader->id = header.id;
+   // The header is checked in the first pass.
+   if ( ! reader->apply ) {
+      check_header( reader, &header );
+   }
+   if ( reader->err || ( header.flags & CHECKPOINT_INCREMENT ) ) {
+      return;
+   }
+   struct list_iter i;
+   list_iterate( &vm->modules, &i );
+   while ( ! list_end( &i ) && ! reader->err ) {
+      struct module* module = list_data( &i );
+      char name[ sizeof( module->name ) ];
+      read_data( reader, name, sizeof( name ) );
+      i32 size = read_i32( reader );
+      u64 hash = ( u64 ) read_i64( reader );
+      if ( ! reader->apply && ! reader->err && (
+         memcmp( name, module->name, sizeof( name ) ) != 0 ||
+         size != module->object.size ||
+         hash != hash_calc_data( module->object.data,
+            module->object.size ) ) ) {
+         reject( reader, "checkpoint was saved with different modules" );
+      }
+      list_next( &i );
+   }
+}
+
+/**
+ * An increment is checked through the checkpoint it builds on, so its
+ * modules are not listed.
+ */
+static void check_header( struct checkpoint_reader* reader,
+   struct checkpoint_header* header ) {
+   struct vm* vm = reader->vm;
+   if ( memcmp( header->magic, g_magic, sizeof( g_magic ) ) != 0 ||
+      header->version != CHECKPOINT_VERSION ||
+      header->byte_order != CHECKPOINT_BYTE_ORDER ||
+      ( header->flags & ~( CHECKPOINT_PRISTINE_BASE |
+         CHECKPOINT_INCREMENT ) ) != 0 ) {
+      reject( reader, "unsupported format" );
+   }
+   else if ( header->id != calc_id( header->base_id,
+      reader->data + reader->pos, reader->size - reader->pos ) ) {
+      reject( reader, "checkpoint is damaged" );
+   }
+   else if ( ( header->flags & CHECKPOINT_PRISTINE_BASE ) &&
+      vm->pristine == NULL ) {
+      reject( reader, "checkpoint is relative to a pristine state, and the "
+         "virtual machine has none" );
+   }
+   // The pages of an increment are relative to the same base as the values
+   // they replace.
+   else if ( ( header->flags & CHECKPOINT_INCREMENT ) &&
+      ! ( header->flags & CHECKPOINT_PRISTINE_BASE ) && vm->pristine != NULL ) {
+      reject( reader, "increment is not relative to the pristine state of "
+         "the virtual machine" );
+   }
+   else if ( header->num_modules != list_size( &vm->modules ) ) {
+      reject( reader, "checkpoint was saved with different modules" );
+   }
+   else if ( ( header->flags & CHECKPOINT_INCREMENT ) &&
+      ( header->base_id != vm->checkpoint_id ||
+      vm->tracker->checkpoint_log.size > 0 ) ) {
+      reject( reader, "virtual machine is not at the checkpoint the "
+         "increment builds on" );
+   }
+}
+
+static void read_counters( struct checkpoint_reader* reader ) {
+   struct vm* vm = reader->vm;
+   i64 tics = read_i64( reader );
+   i64 num_active_scripts = read_i64( reader );
+   struct rng rng;
+   for ( isize i = 0; i < ARRAY_SIZE( rng.state ); ++i ) {
+      rng.state[ i ] = ( u64 ) read_i64( reader );
+   }
+   if ( reader->apply ) {
+      vm->tics = tics;
+      vm->num_active_scripts = num_active_scripts;
+      vm->rng = rng;
+   }
+}
+
+static void read_vars( struct checkpoint_reader* reader ) {
+   struct write_tracker* tracker = reader->vm->tracker;
+   read_region_runs( reader, &tracker->regions[ 0 ], 1 );
+   read_region_runs( reader, &tracker->regions[ 1 ], 1 );
+   isize first_region = FIRST_MODULE_REGION;
+   struct list_iter i;
+   list_iterate( &reader->vm->modules, &i );
+   while ( ! list_end( &i ) ) {
+      struct module* module = list_data( &i );
+      read_region_runs( reader, &tracker->regions[ first_region ],
+         module->num_vars );
+      first_region += module->num_vars;
+      list_next( &i );
+   }
+}
+
+static void read_dirty_pages( struct checkpoint_reader* reader ) {
+   struct write_tracker* tracker = reader->vm->tracker;
+   while ( ! reader->err ) {
+      i32 index = read_i32( reader );
+      if ( index == END_OF_RUNS || reader->err ) {
+         break;
+      }
+      i32 page = read_i32( reader );
+      if ( index < 0 || index >= tracker->num_regions || page < 0 ||
+         page > ( ( tracker->regions[ index ].size - 1 ) >>
+            DIRTY_PAGE_SHIFT ) ) {
+         reject( reader, "malformed checkpoint" );
+         break;
+      }
+      struct dirty_region* region = &tracker->regions[ index ];
+      if ( reader->apply ) {
+         isize start = ( isize ) page << DIRTY_PAGE_SHIFT;
+         isize count = region->size - start;
+         if ( count > ( 1 << DIRTY_PAGE_SHIFT ) ) {
+            count = 1 << DIRTY_PAGE_SHIFT;
+         }
+         if ( region->pristine != NULL ) {
+            memcpy( &region->values[ start ], &region->pristine[ start ],
+               sizeof( region->values[ 0 ] ) * count );
+         }
+         else {
+            memset( &region->values[ start ], 0,
+               sizeof( region->values[ 0 ] ) * count );
+         }
+         vm_record_writes( reader->vm, region, start, count );
+      }
+      read_region_runs( reader, region, 1 );
+   }
+}
+
+static void read_all_arrays( struct checkpoint_reader* reader ) {
+   struct vm* vm = reader->vm;
+   i32 all_pages = read_i32( reader );
+   if ( reader->err ) {
+      return;
+   }
+   if ( all_pages != 1 && ( all_pages != 0 ||
+      ! ( reader->flags & CHECKPOINT_INCREMENT ) ) ) {
+      reject( reader, "malformed checkpoint" );
+      return;
+   }
+   if ( reader->apply && all_pages ) {
+      vm_clear_arrays( vm );
+   }
+   read_arrays( reader, vm->world_arrays, ARRAY_SIZE( vm->world_arrays ) );
+   read_arrays( reader, vm->global_arrays, ARRAY_SIZE( vm->global_arrays ) );
+}
+
+static void read_arrays( struct checkpoint_reader* reader,
+   struct sparse_array* arrays, isize num_arrays ) {
+   while ( ! reader->err ) {
+      i32 index = read_i32( reader );
+      if ( index == END_OF_RUNS || reader->err ) {
+         break;
+      }
+      i32 num_pages = read_i32( reader );
+      if ( index < 0 || index >= num_arrays || num_pages <= 0 ) {
+         reject( reader, "malformed checkpoint" );
+         break;
+      }
+      for ( i32 i = 0; i < num_pages && ! reader->err; ++i ) {
+         read_array_page( reader, &arrays[ index ] );
+      }
+   }
+}
+
+/**
+ * A saved page replaces the whole page.
+ */
+static void read_array_page( struct checkpoint_reader* reader,
+   struct sparse_array* array ) {
+   u32 first = ( u32 ) read_i32( reader );
+   if ( reader->err ) {
+      return;
+   }
+   if ( ( first & ( SPARSE_PAGE_SIZE - 1 ) ) != 0 ) {
+      reject( reader, "malformed checkpoint" );
+      return;
+   }
+   struct run_target target = { NULL, SPARSE_PAGE_SIZE };
+   if ( reader->apply ) {
+      struct sparse_page* page = sparse_get_page( array, first );
+      memset( page->elements, 0, sizeof( page->elements ) );
+      target.values = page->elements;
+   }
+   read_runs( reader, &target, 1 );
+}
+
+static void read_scripts( struct checkpoint_reader* reader ) {
+   struct vm* vm = reader->vm;
+   struct list_iter i;
+   list_iterate( &vm->modules, &i );
+   while ( ! list_end( &i ) ) {
+      struct module* module = list_data( &i );
+      i32 count = read_i32( reader );
+      for ( i32 k = 0; k < count && ! reader->err; ++k ) {
+         struct instance* instance = read_instance( reader, module );
+         // The queue was saved in order, so each script goes at the end.
+         if ( reader->apply ) {
+            vm_enq_script( &module->waiting_scripts, instance );
+         }
+      }
+      list_next( &i );
+   }
+   i32 count = read_i32( reader );
+   for ( i32 k = 0; k < count && ! reader->err; ++k ) {
+      i32 index = read_i32( reader );
+      if ( index < 0 || index >= list_size( &vm->modules ) ) {
+         reject( reader, "malformed checkpoint" );
+         break;
+      }
+      struct instance* instance = read_instance( reader,
+         get_module_at( vm, index ) );
+      if ( reader->apply ) {
+         list_append( &vm->suspended_scripts, instance );
+      }
+   }
+}
+
+static struct instance* read_instance( struct checkpoint_reader* reader,
+   struct module* module ) {
+   i32 number = read_i32( reader );
+   i32 state = read_i32( reader );
+   i32 delay_amount = read_i32( reader );
+   i64 resume_time = read_i64( reader );
+   i64 ip = read_i64( reader );
+   if ( reader->err ) {
+      return NULL;
+   }
+   struct script* script = hash_find_number( &module->script_table, number );
+   if ( script == NULL ||
+      state < SCRIPTSTATE_TERMINATED || state > SCRIPTSTATE_WAITING ||
+      ip < 0 || ip >= module->object.size ) {
+      reject( reader, "malformed checkpoint" );
+      return NULL;
+   }
+   struct instance* instance = NULL;
+   struct run_target targets[] = {
+      { NULL, script->num_vars },
+      { NULL, script->total_array_size },
+   };
+   if ( reader->apply ) {
+      instance = vm_alloc_instance( reader->vm, script );
+      instance->delay_amount = delay_amount;
+      instance->state = state;
+      instance->resume_time = resume_time;
+      instance->ip = ip;
+      targets[ 0 ].values = instance->vars;
+      targets[ 1 ].values = instance->arrays;
+   }
+   read_runs( reader, targets, ARRAY_SIZE( targets ) );
+   return instance;
+}
+
+/**
+ * Restored values are written like any other, so the next reset puts them
+ * back.
+ */
+static void read_region_runs( struct checkpoint_reader* reader,
+   struct dirty_region* regions, isize num_regions ) {
+   i32 id, start, count;
+   while ( read_run( reader, &id, &start, &count ) ) {
+      if ( id >= num_regions || start > regions[ id ].size - count ) {
+         reject( reader, "malformed checkpoint" );
+         break;
+      }
+      struct dirty_region* region = &regions[ id ];
+      if ( reader->apply ) {
+         read_data( reader, &region->values[ start ],
+            sizeof( region->values[ 0 ] ) * count );
+         vm_record_writes( reader->vm, region, start, count );
+      }
+      else {
+         read_data( reader, NULL, sizeof( region->values[ 0 ] ) * count );
+      }
+   }
+}
+
+static void read_runs( struct checkpoint_reader* reader,
+   struct run_target* targets, i32 num_targets ) {
+   i32 id, start, count;
+   while ( read_run( reader, &id, &start, &count ) ) {
+      if ( id >= num_targets || start > targets[ id ].size - count ) {
+         reject( reader, "malformed checkpoint" );
+         break;
+      }
+      struct run_target* target = &targets[ id ];
+      read_data( reader, reader->apply ? &target->values[ start ] : NULL,
+         sizeof( target->values[ 0 ] ) * count );
+   }
+}
+
+/**
+ * Reads the start of the next run. Returns false at the end of the runs.
+ */
+static bool read_run( struct checkpoint_reader* reader, i32* id,
+   i32* start, i32* count ) {
+   *id = read_i32( reader );
+   if ( *id == END_OF_RUNS || reader->err ) {
+      return false;
+   }
+   *start = read_i32( reader );
+   *count = read_i32( reader );
+   if ( reader->err ) {
+      return false;
+   }
+   if ( *id < 0 || *start < 0 || *count <= 0 ) {
+      reject( reader, "malformed checkpoint" );
+      return false;
+   }
+   return true;
+}
+
+static i32 read_i32( struct checkpoint_reader* reader ) {
+   i32 value = 0;
+   read_data( reader, &value, sizeof( value ) );
+   return value;
+}
+
+static i64 read_i64( struct checkpoint_reader* reader ) {
+   i64 value = 0;
+   read_data( reader, &value, sizeof( value ) );
+   return value;
+}
+
+/**
+ * When the data is NULL, the bytes are skipped.
+ */
+static void read_data( struct checkpoint_reader* reader, void* data,
+   usize size ) {
+   if ( reader->err ) {
+      return;
+   }
+   if ( reader->size - reader->pos < size ) {
+      reject( reader, "malformed checkpoint" );
+      return;
+   }
+   if ( data != NULL ) {
+      memcpy( data, reader->data + reader->pos, size );
+   }
+   reader->pos += size;
+}
+
+static void reject( struct checkpoint_reader* reader, const char* reason ) {
+   if ( ! reader->err ) {
+      reader->err = true;
+      reader->reason = reason;
+   }
+}
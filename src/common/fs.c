@@ -165,11 +165,46 @@ bool fs_delete_file( const char* path ) {
    return ( DeleteFileA( path ) == TRUE );
 }
 
+bool fs_map_file( const char* path, struct fs_mapping* mapping ) {
+   mapping->file = CreateFileA( path, GENERIC_READ, FILE_SHARE_READ, NULL,
+      OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+   if ( mapping->file == INVALID_HANDLE_VALUE ) {
+      return false;
+   }
+   LARGE_INTEGER size;
+   if ( ! GetFileSizeEx( mapping->file, &size ) || size.QuadPart == 0 ) {
+      CloseHandle( mapping->file );
+      return false;
+   }
+   mapping->view = CreateFileMappingA( mapping->file, NULL, PAGE_READONLY, 0,
+      0, NULL );
+   if ( mapping->view == NULL ) {
+      CloseHandle( mapping->file );
+      return false;
+   }
+   mapping->data = MapViewOfFile( mapping->view, FILE_MAP_READ, 0, 0, 0 );
+   if ( mapping->data == NULL ) {
+      CloseHandle( mapping->view );
+      CloseHandle( mapping->file );
+      return false;
+   }
+   mapping->size = ( size_t ) size.QuadPart;
+   return true;
+}
+
+void fs_unmap_file( struct fs_mapping* mapping ) {
+   UnmapViewOfFile( mapping->data );
+   CloseHandle( mapping->view );
+   CloseHandle( mapping->file );
+}
+
 #else
 
 #include <unistd.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #ifdef __APPLE__
 #include <limits.h> // PATH_MAX on OS X is defined in limits.h
@@ -255,6 +290,34 @@ bool fs_delete_file( const char* path ) {
    return ( unlink( path ) == 0 );
 }
 
+/**
+ * Maps the contents of a file into memory, for reading. An empty file cannot
+ * be mapped.
+ */
+bool fs_map_file( const char* path, struct fs_mapping* mapping ) {
+   int fd = open( path, O_RDONLY );
+   if ( fd == -1 ) {
+      return false;
+   }
+   struct stat stat;
+   if ( fstat( fd, &stat ) != 0 || stat.st_size == 0 ) {
+      close( fd );
+      return false;
+   }
+   void* data = mmap( NULL, stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+   close( fd );
+   if ( data == MAP_FAILED ) {
+      return false;
+   }
+   mapping->data = data;
+   mapping->size = stat.st_size;
+   return true;
+}
+
+void fs_unmap_file( struct fs_mapping* mapping ) {
+   munmap( ( void* ) mapping->data, mapping->size );
+}
+
 #endif
 
 void c_extract_dirname( struct str* path ) {
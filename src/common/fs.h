@@ -30,6 +30,13 @@ struct fs_timestamp {
    time_t value;
 };
 
+struct fs_mapping {
+   const void* data;
+   size_t size;
+   HANDLE file;
+   HANDLE view;
+};
+
 #define strcasecmp _stricmp
 
 #else
@@ -56,6 +63,11 @@ struct fs_timestamp {
    time_t value;
 };
 
+struct fs_mapping {
+   const void* data;
+   size_t size;
+};
+
 #endif
 
 struct file_contents {
@@ -86,5 +98,7 @@ const char* fs_get_tempdir( void );
 void fs_get_file_contents( const char* path, struct file_contents* contents );
 void fs_strip_trailing_pathsep( struct str* path );
 bool fs_delete_file( const char* path );
+bool fs_map_file( const char* path, struct fs_mapping* mapping );
+void fs_unmap_file( struct fs_mapping* mapping );
 
 #endif
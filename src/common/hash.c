@@ -0,0 +1,148 @@
+#include <string.h>
+
+#include "misc.h"
+#include "mem.h"
+#include "hash.h"
+
+enum { INITIAL_CAPACITY = 16 };
+
+static void* add_entry( struct hash_table* table, const char* name,
+   i32 number, u32 hash, void* data );
+static struct hash_entry* find_slot( struct hash_table* table,
+   const char* name, i32 number, u32 hash );
+static void grow( struct hash_table* table );
+static u32 calc_number_hash( i32 number );
+
+void hash_init( struct hash_table* table ) {
+   table->entries = NULL;
+   table->capacity = 0;
+   table->size = 0;
+}
+
+void* hash_add_name( struct hash_table* table, const char* name,
+   void* data ) {
+   return add_entry( table, name, 0, hash_calc_name( name ), data );
+}
+
+void* hash_add_number( struct hash_table* table, i32 number, void* data ) {
+   return add_entry( table, NULL, number, calc_number_hash( number ), data );
+}
+
+static void* add_entry( struct hash_table* table, const char* name,
+   i32 number, u32 hash, void* data ) {
+   // Keep the load factor at or below 3/4.
+   if ( ( table->size + 1 ) * 4 > table->capacity * 3 ) {
+      grow( table );
+   }
+   struct hash_entry* entry = find_slot( table, name, number, hash );
+   if ( entry->data != NULL ) {
+      return entry->data;
+   }
+   entry->name = name;
+   entry->number = number;
+   entry->hash = hash;
+   entry->data = data;
+   ++table->size;
+   return NULL;
+}
+
+/**
+ * Returns the slot that holds the entry with the specified key. If no such
+ * entry exists, the empty slot where the entry would go is returned.
+ */
+static struct hash_entry* find_slot( struct hash_table* table,
+   const char* name, i32 number, u32 hash ) {
+   usize mask = table->capacity - 1;
+   usize i = hash & mask;
+   while ( true ) {
+      struct hash_entry* entry = &table->entries[ i ];
+      if ( entry->data == NULL ) {
+         return entry;
+      }
+      if ( entry->hash == hash ) {
+         if ( name != NULL ) {
+            if ( strcmp( entry->name, name ) == 0 ) {
+               return entry;
+            }
+         }
+         else if ( entry->number == number ) {
+            return entry;
+         }
+      }
+      i = ( i + 1 ) & mask;
+   }
+}
+
+static void grow( struct hash_table* table ) {
+   struct hash_entry* entries = table->entries;
+   isize capacity = table->capacity;
+   table->capacity = ( capacity == 0 ) ? INITIAL_CAPACITY : capacity * 2;
+   table->entries = mem_alloc( sizeof( table->entries[ 0 ] ) *
+      table->capacity );
+   for ( isize i = 0; i < table->capacity; ++i ) {
+      table->entries[ i ].data = NULL;
+   }
+   for ( isize i = 0; i < capacity; ++i ) {
+      if ( entries[ i ].data != NULL ) {
+         struct hash_entry* entry = find_slot( table, entries[ i ].name,
+            entries[ i ].number, entries[ i ].hash );
+         *entry = entries[ i ];
+      }
+   }
+   if ( entries != NULL ) {
+      mem_free( entries );
+   }
+}
+
+void* hash_find_name( struct hash_table* table, const char* name ) {
+   if ( table->size == 0 ) {
+      return NULL;
+   }
+   return find_slot( table, name, 0, hash_calc_name( name ) )->data;
+}
+
+void* hash_find_number( struct hash_table* table, i32 number ) {
+   if ( table->size == 0 ) {
+      return NULL;
+   }
+   return find_slot( table, NULL, number, calc_number_hash( number ) )->data;
+}
+
+/**
+ * FNV-1a hash of a NUL-terminated string.
+ */
+u32 hash_calc_name( const char* name ) {
+   u32 hash = 2166136261u;
+   while ( *name ) {
+      hash ^= ( u8 ) *name;
+      hash *= 16777619u;
+      ++name;
+   }
+   return hash;
+}
+
+/**
+ * 64-bit FNV-1a hash of a block of data. Used to identify the contents of a
+ * file.
+ */
+u64 hash_calc_data( const void* data, usize size ) {
+   const u8* bytes = data;
+   u64 hash = 14695981039346656037ull;
+   for ( usize i = 0; i < size; ++i ) {
+      hash ^= bytes[ i ];
+      hash *= 1099511628211ull;
+   }
+   return hash;
+}
+
+static u32 calc_number_hash( i32 number ) {
+   // Fibonacci hashing spreads consecutive numbers across the table.
+   u32 hash = ( u32 ) number * 2654435769u;
+   return hash ^ ( hash >> 16 );
+}
+
+void hash_deinit( struct hash_table* table ) {
+   if ( table->entries != NULL ) {
+      mem_free( table->entries );
+   }
+}
@@ -0,0 +1,37 @@
+#ifndef SRC_COMMON_HASH_H
+#define SRC_COMMON_HASH_H
+
+/**
+ * Hash table
+ *
+ * An open-addressing table that maps either names or numbers to data. A
+ * single table should use one kind of key only. The data cannot be NULL,
+ * because NULL is used to mark an empty slot.
+ */
+
+struct hash_entry {
+   const char* name;
+   void* data;
+   u32 hash;
+   i32 number;
+};
+
+struct hash_table {
+   struct hash_entry* entries;
+   isize capacity; // Always a power of two.
+   isize size;
+};
+
+void hash_init( struct hash_table* table );
+// Adds an entry. If an entry with the same key already exists, the table is
+// left unchanged and the data of the existing entry is returned. Otherwise,
+// NULL is returned.
+void* hash_add_name( struct hash_table* table, const char* name, void* data );
+void* hash_add_number( struct hash_table* table, i32 number, void* data );
+void* hash_find_name( struct hash_table* table, const char* name );
+void* hash_find_number( struct hash_table* table, i32 number );
+u32 hash_calc_name( const char* name );
+u64 hash_calc_data( const void* data, usize size );
+void hash_deinit( struct hash_table* table );
+
+#endif
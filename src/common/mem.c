@@ -7,86 +7,163 @@
 // NOTE: The functions below may be violating the strict-aliasing rule.
 // ==========================================================================
 
-// Linked list of current allocations. The head is the most recent allocation.
-// This way, a short-term allocation can be found and removed quicker.
-static struct alloc {
-   struct alloc* next;
-}* g_alloc = NULL;
 // Allocation sizes for bulk allocation.
-static struct {
+static const struct {
    size_t size;
    size_t quantity;
 } g_bulk_sizes[] = {
    { sizeof( struct list_link ), 256 },
 };
-// Bulk allocations.
-static struct {
-   struct {
-      size_t size;
-      size_t quantity;
-      size_t left;
-      char* block;
-      struct free_block {
-         struct free_block* next;
-      }* free_block;
-   } slots[ ARRAY_SIZE( g_bulk_sizes ) ];
-   size_t slots_used;
-} g_bulk;
-
-static void unlink_alloc( struct alloc* );
+
+// An arena holds a set of allocations that are freed together.
+struct mem_arena {
+   // Linked list of current allocations. The head is the most recent
+   // allocation. This way, a short-term allocation can be found and removed
+   // quicker.
+   struct alloc {
+      struct alloc* next;
+   }* allocs;
+   // Bulk allocations.
+   struct bulk {
+      struct {
+         size_t size;
+         size_t quantity;
+         size_t left;
+         char* block;
+         struct free_block {
+            struct free_block* next;
+         }* free_block;
+      } slots[ ARRAY_SIZE( g_bulk_sizes ) ];
+      size_t slots_used;
+   } bulk;
+   // Called when an allocation fails. Must not return.
+   void ( *fail )( void* data );
+   void* fail_data;
+};
+
+// Each thread has its own arena, so allocating needs no locking. A thread can
+// switch to another arena with mem_use_arena(); NULL selects the arena of the
+// thread.
+static __thread struct mem_arena g_thread_arena;
+static __thread struct mem_arena* g_arena = NULL;
+
+static struct mem_arena* get_arena( void );
+static void init_bulk( struct mem_arena* arena );
+static void unlink_alloc( struct mem_arena* arena, struct alloc* alloc );
+static void free_allocs( struct alloc* alloc );
 
 void mem_init( void ) {
-   g_bulk.slots_used = 0;
+   init_bulk( get_arena() );
+}
+
+static struct mem_arena* get_arena( void ) {
+   return ( g_arena != NULL ) ? g_arena : &g_thread_arena;
+}
+
+static void init_bulk( struct mem_arena* arena ) {
+   arena->bulk.slots_used = 0;
    size_t i = 0;
    while ( i < ARRAY_SIZE( g_bulk_sizes ) ) {
       // Find slot with specified allocation size.
       size_t k = 0;
-      while ( k < g_bulk.slots_used &&
-         g_bulk.slots[ k ].size != g_bulk_sizes[ i ].size ) {
+      while ( k < arena->bulk.slots_used &&
+         arena->bulk.slots[ k ].size != g_bulk_sizes[ i ].size ) {
          ++k;
       }
       // If slot doesn't exist, allocate one.
-      if ( k == g_bulk.slots_used ) {
-         g_bulk.slots[ k ].size = g_bulk_sizes[ i ].size;
-         g_bulk.slots[ k ].quantity = g_bulk_sizes[ i ].quantity;
-         g_bulk.slots[ k ].left = 0;
-         g_bulk.slots[ k ].block = NULL;
-         g_bulk.slots[ k ].free_block = NULL;
-         ++g_bulk.slots_used;
+      if ( k == arena->bulk.slots_used ) {
+         arena->bulk.slots[ k ].size = g_bulk_sizes[ i ].size;
+         arena->bulk.slots[ k ].quantity = g_bulk_sizes[ i ].quantity;
+         arena->bulk.slots[ k ].left = 0;
+         arena->bulk.slots[ k ].block = NULL;
+         arena->bulk.slots[ k ].free_block = NULL;
+         ++arena->bulk.slots_used;
       }
       else {
          // On duplicate allocation size, use higher quantity.
-         if ( g_bulk.slots[ k ].quantity < g_bulk_sizes[ i ].quantity ) {
-            g_bulk.slots[ k ].quantity = g_bulk_sizes[ i ].quantity;
+         if ( arena->bulk.slots[ k ].quantity < g_bulk_sizes[ i ].quantity ) {
+            arena->bulk.slots[ k ].quantity = g_bulk_sizes[ i ].quantity;
          }
       }
       ++i;
    }
 }
 
+/**
+ * Creates an empty arena. Returns NULL if there is not enough memory.
+ */
+struct mem_arena* mem_create_arena( void ) {
+   struct mem_arena* arena = malloc( sizeof( *arena ) );
+   if ( arena != NULL ) {
+      arena->allocs = NULL;
+      arena->fail = NULL;
+      arena->fail_data = NULL;
+      init_bulk( arena );
+   }
+   return arena;
+}
+
+/**
+ * Frees the arena together with every allocation in it.
+ */
+void mem_destroy_arena( struct mem_arena* arena ) {
+   free_allocs( arena->allocs );
+   free( arena );
+}
+
+/**
+ * Makes the current thread allocate from the specified arena, and returns the
+ * arena that was used before, so it can be restored.
+ */
+struct mem_arena* mem_use_arena( struct mem_arena* arena ) {
+   struct mem_arena* prev_arena = g_arena;
+   g_arena = arena;
+   return prev_arena;
+}
+
+/**
+ * Sets the function called when an allocation from the current arena fails.
+ * The function must not return; it usually calls longjmp(). Without a
+ * function, the error is shown and the program exits.
+ */
+void mem_set_fail_handler( void ( *fail )( void* data ), void* data ) {
+   struct mem_arena* arena = get_arena();
+   arena->fail = fail;
+   arena->fail_data = data;
+}
+
 void* mem_alloc( size_t size ) {
    return mem_realloc( NULL, size );
 }
 
 void* mem_realloc( void* block, size_t size ) {
+   struct mem_arena* arena = get_arena();
    struct alloc* alloc = NULL;
    if ( block ) {
       alloc = ( struct alloc* ) block - 1;
-      unlink_alloc( alloc );
+      unlink_alloc( arena, alloc );
    }
-   alloc = realloc( alloc, sizeof( *alloc ) + size );
-   if ( ! alloc ) {
+   struct alloc* new_alloc = realloc( alloc, sizeof( *alloc ) + size );
+   if ( ! new_alloc ) {
+      // The old block is left as it was, so keep tracking it.
+      if ( alloc ) {
+         alloc->next = arena->allocs;
+         arena->allocs = alloc;
+      }
+      if ( arena->fail != NULL ) {
+         arena->fail( arena->fail_data );
+      }
       mem_free_all();
       printf( "error: failed to allocate memory block of %zd bytes\n", size );
       exit( EXIT_FAILURE );
    }
-   alloc->next = g_alloc;
-   g_alloc = alloc;
-   return alloc + 1;
+   new_alloc->next = arena->allocs;
+   arena->allocs = new_alloc;
+   return new_alloc + 1;
 }
 
-void unlink_alloc( struct alloc* alloc ) {
-   struct alloc* curr = g_alloc;
+static void unlink_alloc( struct mem_arena* arena, struct alloc* alloc ) {
+   struct alloc* curr = arena->allocs;
    struct alloc* prev = NULL;
    while ( curr != alloc ) {
       prev = curr;
@@ -96,30 +173,32 @@ void unlink_alloc( struct alloc* alloc ) {
       prev->next = alloc->next;
    }
    else {
-      g_alloc = alloc->next;
+      arena->allocs = alloc->next;
    }
 }
 
 void* mem_slot_alloc( size_t size ) {
+   struct mem_arena* arena = get_arena();
+   struct bulk* bulk = &arena->bulk;
    size_t i = 0;
-   while ( i < g_bulk.slots_used ) {
-      if ( g_bulk.slots[ i ].size == size ) {
+   while ( i < bulk->slots_used ) {
+      if ( bulk->slots[ i ].size == size ) {
          // Reuse a previously allocated block.
-         if ( g_bulk.slots[ i ].free_block ) {
-            struct free_block* free_block = g_bulk.slots[ i ].free_block;
-            g_bulk.slots[ i ].free_block = free_block->next;
+         if ( bulk->slots[ i ].free_block ) {
+            struct free_block* free_block = bulk->slots[ i ].free_block;
+            bulk->slots[ i ].free_block = free_block->next;
             return free_block;
          }
          // When no more blocks are left, allocate a series of blocks in a
          // single allocation.
-         if ( ! g_bulk.slots[ i ].left ) {
-            g_bulk.slots[ i ].left = g_bulk.slots[ i ].quantity;
-            g_bulk.slots[ i ].block = mem_alloc( g_bulk.slots[ i ].size *
-               g_bulk.slots[ i ].quantity );
+         if ( ! bulk->slots[ i ].left ) {
+            bulk->slots[ i ].block = mem_alloc( bulk->slots[ i ].size *
+               bulk->slots[ i ].quantity );
+            bulk->slots[ i ].left = bulk->slots[ i ].quantity;
          }
-         char* block = g_bulk.slots[ i ].block;
-         g_bulk.slots[ i ].block += g_bulk.slots[ i ].size;
-         --g_bulk.slots[ i ].left;
+         char* block = bulk->slots[ i ].block;
+         bulk->slots[ i ].block += bulk->slots[ i ].size;
+         --bulk->slots[ i ].left;
          return block;
       }
       ++i;
@@ -129,17 +208,18 @@ void* mem_slot_alloc( size_t size ) {
 
 void mem_free( void* block ) {
    struct alloc* alloc = ( struct alloc* ) block - 1;
-   unlink_alloc( alloc );
+   unlink_alloc( get_arena(), alloc );
    free( alloc );
 }
 
 void mem_slot_free( void* block, size_t size ) {
+   struct bulk* bulk = &get_arena()->bulk;
    size_t i = 0;
-   while ( i < g_bulk.slots_used ) {
-      if ( g_bulk.slots[ i ].size == size ) {
+   while ( i < bulk->slots_used ) {
+      if ( bulk->slots[ i ].size == size ) {
          struct free_block* free_block = block;
-         free_block->next = g_bulk.slots[ i ].free_block;
-         g_bulk.slots[ i ].free_block = free_block;
+         free_block->next = bulk->slots[ i ].free_block;
+         bulk->slots[ i ].free_block = free_block;
          return;
       }
       ++i;
@@ -147,10 +227,53 @@ void mem_slot_free( void* block, size_t size ) {
    mem_free( block );
 }
 
+/**
+ * Removes all allocations from the current arena and returns them in a new
+ * arena, so another thread can take ownership of them.
+ */
+struct mem_arena* mem_detach( void ) {
+   struct mem_arena* arena = get_arena();
+   struct mem_arena* detached_arena = mem_create_arena();
+   if ( detached_arena == NULL ) {
+      if ( arena->fail != NULL ) {
+         arena->fail( arena->fail_data );
+      }
+      mem_free_all();
+      printf( "error: failed to allocate memory arena\n" );
+      exit( EXIT_FAILURE );
+   }
+   detached_arena->allocs = arena->allocs;
+   arena->allocs = NULL;
+   // Blocks left in the bulk slots belong to the detached allocations.
+   init_bulk( arena );
+   return detached_arena;
+}
+
+/**
+ * Takes ownership of allocations detached by another thread, and frees the
+ * arena that held them. The allocations are placed at the end of the list,
+ * because they are usually long-lived.
+ */
+void mem_attach( struct mem_arena* detached_arena ) {
+   struct alloc** tail = &get_arena()->allocs;
+   while ( *tail ) {
+      tail = &( *tail )->next;
+   }
+   *tail = detached_arena->allocs;
+   free( detached_arena );
+}
+
 void mem_free_all( void ) {
-   while ( g_alloc ) {
-      struct alloc* next = g_alloc->next;
-      free( g_alloc );
-      g_alloc = next;
+   struct mem_arena* arena = get_arena();
+   free_allocs( arena->allocs );
+   arena->allocs = NULL;
+   init_bulk( arena );
+}
+
+static void free_allocs( struct alloc* alloc ) {
+   while ( alloc ) {
+      struct alloc* next = alloc->next;
+      free( alloc );
+      alloc = next;
    }
 }
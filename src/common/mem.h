@@ -8,5 +8,18 @@ void* mem_slot_alloc( size_t );
 void mem_slot_free( void* block, size_t size );
 void mem_free( void* );
 void mem_free_all( void );
+// Allocations are tracked per thread. A thread other than the main thread must
+// call mem_init() before allocating. When the thread is done, it hands its
+// allocations over with mem_detach(), and the thread that joins it takes
+// ownership of them with mem_attach().
+struct mem_arena;
+struct mem_arena* mem_detach( void );
+void mem_attach( struct mem_arena* arena );
+// A thread can also allocate from a separate arena, whose allocations are
+// freed all at once when the arena is destroyed.
+struct mem_arena* mem_create_arena( void );
+void mem_destroy_arena( struct mem_arena* arena );
+struct mem_arena* mem_use_arena( struct mem_arena* arena );
+void mem_set_fail_handler( void ( *fail )( void* data ), void* data );
 
 #endif
@@ -0,0 +1,149 @@
+#include <string.h>
+
+#include "misc.h"
+#include "mem.h"
+#include "output.h"
+
+static void write_stream( const char* text, isize length, void* data );
+static void reserve( struct output* output, isize length );
+
+void output_init( struct output* output,
+   void ( *write )( const char* text, isize length, void* data ),
+   void* data ) {
+   output->write = write;
+   output->data = data;
+   output->buffer = NULL;
+   output->length = 0;
+   output->capacity = 0;
+}
+
+void output_init_stream( struct output* output, FILE* stream ) {
+   output_init( output, write_stream, stream );
+}
+
+/**
+ * The whole buffer is given to the stream in one call, so the stream is
+ * locked once per buffer rather than once per message.
+ */
+static void write_stream( const char* text, isize length, void* data ) {
+   FILE* stream = data;
+   fwrite( text, 1, length, stream );
+   fflush( stream );
+}
+
+void output_init_memory( struct output* output ) {
+   output_init( output, NULL, NULL );
+}
+
+/**
+ * Flushes the remaining text and frees the buffer.
+ */
+void output_deinit( struct output* output ) {
+   output_flush( output );
+   if ( output->buffer != NULL ) {
+      mem_free( output->buffer );
+      output->buffer = NULL;
+   }
+   output->length = 0;
+   output->capacity = 0;
+}
+
+void output_write( struct output* output, const char* text, isize length ) {
+   reserve( output, length );
+   if ( length > output->capacity - output->length ) {
+      // Too long to be buffered.
+      output->write( text, length, output->data );
+   }
+   else {
+      memcpy( output->buffer + output->length, text, length );
+      output->length += length;
+   }
+}
+
+/**
+ * Makes room for the specified number of characters, when possible. The
+ * buffer of a memory backend grows as needed; other buffers are flushed.
+ */
+static void reserve( struct output* output, isize length ) {
+   if ( output->buffer == NULL ) {
+      output->capacity = OUTPUT_BUFFER_SIZE;
+      output->buffer = mem_alloc( output->capacity );
+   }
+   if ( length <= output->capacity - output->length ) {
+      return;
+   }
+   if ( output->write != NULL ) {
+      output_flush( output );
+   }
+   else {
+      while ( length > output->capacity - output->length ) {
+         output->capacity *= 2;
+      }
+      output->buffer = mem_realloc( output->buffer, output->capacity );
+   }
+}
+
+void output_printf( struct output* output, const char* format, ... ) {
+   va_list args;
+   va_start( args, format );
+   output_vprintf( output, format, args );
+   va_end( args );
+}
+
+/**
+ * The text is formatted straight into the buffer. When it does not fit, the
+ * length of the text is known after the first attempt, so it is formatted a
+ * second time after room has been made.
+ */
+void output_vprintf( struct output* output, const char* format,
+   va_list args ) {
+   if ( output->buffer == NULL ) {
+      reserve( output, 0 );
+   }
+   va_list retry_args;
+   va_copy( retry_args, args );
+   isize space = output->capacity - output->length;
+   isize length = vsnprintf( output->buffer + output->length, space, format,
+      args );
+   if ( length < 0 ) {
+      va_end( retry_args );
+      return;
+   }
+   // The formatted text needs one more character for the NUL character.
+   if ( length >= space ) {
+      reserve( output, length + 1 );
+      space = output->capacity - output->length;
+      if ( length >= space ) {
+         char* text = mem_alloc( length + 1 );
+         vsnprintf( text, length + 1, format, retry_args );
+         output->write( text, length, output->data );
+         mem_free( text );
+         va_end( retry_args );
+         return;
+      }
+      vsnprintf( output->buffer + output->length, space, format,
+         retry_args );
+   }
+   output->length += length;
+   va_end( retry_args );
+}
+
+/**
+ * Hands the buffered text to the backend. Does nothing for the memory
+ * backend, which keeps the text.
+ */
+void output_flush( struct output* output ) {
+   if ( output->write != NULL && output->length > 0 ) {
+      output->write( output->buffer, output->length, output->data );
+      output->length = 0;
+   }
+}
+
+/**
+ * Returns the text written to a memory backend. The text is not
+ * NUL-terminated.
+ */
+const char* output_captured( struct output* output, isize* length ) {
+   *length = output->length;
+   return output->buffer;
+}
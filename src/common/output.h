@@ -0,0 +1,42 @@
+#ifndef SRC_COMMON_OUTPUT_H
+#define SRC_COMMON_OUTPUT_H
+
+/**
+ * Buffered output
+ *
+ * Text is collected in a buffer and handed to the backend in large blocks, so
+ * writing a message costs no more than formatting it into memory. The memory
+ * backend keeps all the text written instead, which is useful for capturing
+ * the output of a run.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+
+enum { OUTPUT_BUFFER_SIZE = 65536 };
+
+struct output {
+   // Receives the buffered text when the buffer is full or flushed. NULL for
+   // the memory backend.
+   void ( *write )( const char* text, isize length, void* data );
+   void* data;
+   // Allocated on the first write.
+   char* buffer;
+   isize length;
+   isize capacity;
+};
+
+void output_init( struct output* output,
+   void ( *write )( const char* text, isize length, void* data ),
+   void* data );
+void output_init_stream( struct output* output, FILE* stream );
+void output_init_memory( struct output* output );
+void output_deinit( struct output* output );
+void output_write( struct output* output, const char* text, isize length );
+void output_printf( struct output* output, const char* format, ... );
+void output_vprintf( struct output* output, const char* format,
+   va_list args );
+void output_flush( struct output* output );
+const char* output_captured( struct output* output, isize* length );
+
+#endif
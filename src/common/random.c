@@ -0,0 +1,124 @@
+#include <stdlib.h>
+#include <errno.h>
+
+#include "misc.h"
+#include "random.h"
+
+static u64 splitmix64( u64* state );
+static u64 rotl( u64 value, int shift );
+
+/**
+ * The state is filled from the seed with SplitMix64, as recommended by the
+ * authors of xoshiro, so any seed, including 0, gives a usable state.
+ */
+void rng_seed( struct rng* rng, u64 seed ) {
+   for ( isize i = 0; i < ARRAY_SIZE( rng->state ); ++i ) {
+      rng->state[ i ] = splitmix64( &seed );
+   }
+}
+
+/**
+ * Reads a seed written as a decimal, hexadecimal, or octal number. Returns
+ * false if the text is not a whole number, or the number does not fit.
+ */
+bool rng_read_seed( const char* text, u64* seed ) {
+   char* end = NULL;
+   errno = 0;
+   unsigned long long value = strtoull( text, &end, 0 );
+   if ( end == text || *end != '\0' || errno == ERANGE ) {
+      return false;
+   }
+   *seed = value;
+   return true;
+}
+
+static u64 splitmix64( u64* state ) {
+   u64 z = ( *state += 0x9e3779b97f4a7c15ull );
+   z = ( z ^ ( z >> 30 ) ) * 0xbf58476d1ce4e5b9ull;
+   z = ( z ^ ( z >> 27 ) ) * 0x94d049bb133111ebull;
+   return z ^ ( z >> 31 );
+}
+
+u64 rng_next( struct rng* rng ) {
+   u64* s = rng->state;
+   u64 result = rotl( s[ 1 ] * 5, 7 ) * 9;
+   u64 t = s[ 1 ] << 17;
+   s[ 2 ] ^= s[ 0 ];
+   s[ 3 ] ^= s[ 1 ];
+   s[ 1 ] ^= s[ 2 ];
+   s[ 0 ] ^= s[ 3 ];
+   s[ 2 ] ^= t;
+   s[ 3 ] = rotl( s[ 3 ], 45 );
+   return result;
+}
+
+static u64 rotl( u64 value, int shift ) {
+   return ( value << shift ) | ( value >> ( 64 - shift ) );
+}
+
+u32 rng_next_u32( struct rng* rng ) {
+   // The upper bits are the strongest.
+   return ( u32 ) ( rng_next( rng ) >> 32 );
+}
+
+/**
+ * Returns a number in the range [0, range), without bias. Uses Lemire's
+ * multiply-and-shift method, which needs a division only in the rare case
+ * that a number has to be rejected. A range of 0 stands for the full 32-bit
+ * range.
+ */
+u32 rng_bounded( struct rng* rng, u32 range ) {
+   if ( range == 0 ) {
+      return rng_next_u32( rng );
+   }
+   u64 product = ( u64 ) rng_next_u32( rng ) * range;
+   u32 low = ( u32 ) product;
+   if ( low < range ) {
+      u32 threshold = -range % range;
+      while ( low < threshold ) {
+         product = ( u64 ) rng_next_u32( rng ) * range;
+         low = ( u32 ) product;
+      }
+   }
+   return ( u32 ) ( product >> 32 );
+}
+
+/**
+ * Returns a number between min and max, inclusive. The bounds can be given in
+ * either order.
+ */
+i32 rng_between( struct rng* rng, i32 min, i32 max ) {
+   if ( max < min ) {
+      i32 temp = min;
+      min = max;
+      max = temp;
+   }
+   u32 range = ( u32 ) max - ( u32 ) min + 1;
+   return ( i32 ) ( ( u32 ) min + rng_bounded( rng, range ) );
+}
+
+void rng_fill( struct rng* rng, u32* values, isize count ) {
+   // Each step produces 64 bits, enough for two values.
+   isize i = 0;
+   for ( ; i + 1 < count; i += 2 ) {
+      u64 value = rng_next( rng );
+      values[ i ] = ( u32 ) ( value >> 32 );
+      values[ i + 1 ] = ( u32 ) value;
+   }
+   if ( i < count ) {
+      values[ i ] = rng_next_u32( rng );
+   }
+}
+
+void rng_fill_between( struct rng* rng, i32 min, i32 max, i32* values,
+   isize count ) {
+   if ( max < min ) {
+      i32 temp = min;
+      min = max;
+      max = temp;
+   }
+   u32 range = ( u32 ) max - ( u32 ) min + 1;
+   for ( isize i = 0; i < count; ++i ) {
+      values[ i ] = ( i32 ) ( ( u32 ) min + rng_bounded( rng, range ) );
+   }
+}
@@ -0,0 +1,26 @@
+#ifndef SRC_COMMON_RANDOM_H
+#define SRC_COMMON_RANDOM_H
+
+/**
+ * Pseudo-random number generator
+ *
+ * xoshiro256** by David Blackman and Sebastiano Vigna. Each generator has its
+ * own state, so generators can be used from different threads, and a sequence
+ * can be reproduced by using the same seed.
+ */
+
+struct rng {
+   u64 state[ 4 ];
+};
+
+void rng_seed( struct rng* rng, u64 seed );
+bool rng_read_seed( const char* text, u64* seed );
+u64 rng_next( struct rng* rng );
+u32 rng_next_u32( struct rng* rng );
+u32 rng_bounded( struct rng* rng, u32 range );
+i32 rng_between( struct rng* rng, i32 min, i32 max );
+void rng_fill( struct rng* rng, u32* values, isize count );
+void rng_fill_between( struct rng* rng, i32 min, i32 max, i32* values,
+   isize count );
+
+#endif
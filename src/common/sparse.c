@@ -0,0 +1,97 @@
+#include <string.h>
+
+#include "misc.h"
+#include "mem.h"
+#include "sparse.h"
+
+enum { NUM_DIRS = 1 << ( 32 - SPARSE_DIR_SHIFT - SPARSE_PAGE_SHIFT ) };
+enum { DIR_SIZE = 1 << SPARSE_DIR_SHIFT };
+
+static struct sparse_page** find_slot( struct sparse_array* array,
+   u32 index );
+static struct sparse_page** alloc_slot( struct sparse_array* array,
+   u32 index );
+
+/**
+ * Initializes an empty array. Nothing is allocated until an element is
+ * written.
+ */
+void sparse_init( struct sparse_array* array ) {
+   array->dirs = NULL;
+   array->pages = NULL;
+}
+
+/**
+ * Retrieves the value of an element. An element that was never written is
+ * zero.
+ */
+i32 sparse_get( struct sparse_array* array, u32 index ) {
+   struct sparse_page** slot = find_slot( array, index );
+   if ( slot != NULL && *slot != NULL ) {
+      return ( *slot )->elements[ index & ( SPARSE_PAGE_SIZE - 1 ) ];
+   }
+   else {
+      return 0;
+   }
+}
+
+/**
+ * Retrieves a pointer to an element that is about to be written. The page of
+ * the element is allocated if needed, and is marked as written.
+ */
+i32* sparse_at( struct sparse_array* array, u32 index ) {
+   struct sparse_page* page = sparse_get_page( array, index );
+   page->written = true;
+   return &page->elements[ index & ( SPARSE_PAGE_SIZE - 1 ) ];
+}
+
+/**
+ * Retrieves the page that holds an element, allocating the page, with its
+ * elements set to zero, if needed.
+ */
+struct sparse_page* sparse_get_page( struct sparse_array* array, u32 index ) {
+   struct sparse_page** slot = find_slot( array, index );
+   if ( slot == NULL ) {
+      slot = alloc_slot( array, index );
+   }
+   if ( *slot == NULL ) {
+      struct sparse_page* page = mem_alloc( sizeof( *page ) );
+      page->next = array->pages;
+      page->first = index & ~( u32 ) ( SPARSE_PAGE_SIZE - 1 );
+      page->written = false;
+      memset( page->elements, 0, sizeof( page->elements ) );
+      array->pages = page;
+      *slot = page;
+   }
+   return *slot;
+}
+
+/**
+ * Returns NULL when the directory of the index is not allocated.
+ */
+static struct sparse_page** find_slot( struct sparse_array* array,
+   u32 index ) {
+   if ( array->dirs != NULL ) {
+      struct sparse_page** dir = array->dirs[ index >>
+         ( SPARSE_DIR_SHIFT + SPARSE_PAGE_SHIFT ) ];
+      if ( dir != NULL ) {
+         return &dir[ ( index >> SPARSE_PAGE_SHIFT ) & ( DIR_SIZE - 1 ) ];
+      }
+   }
+   return NULL;
+}
+
+static struct sparse_page** alloc_slot( struct sparse_array* array,
+   u32 index ) {
+   if ( array->dirs == NULL ) {
+      array->dirs = mem_alloc( sizeof( array->dirs[ 0 ] ) * NUM_DIRS );
+      memset( array->dirs, 0, sizeof( array->dirs[ 0 ] ) * NUM_DIRS );
+   }
+   struct sparse_page*** dir = &array->dirs[ index >>
+      ( SPARSE_DIR_SHIFT + SPARSE_PAGE_SHIFT ) ];
+   if ( *dir == NULL ) {
+      *dir = mem_alloc( sizeof( ( *dir )[ 0 ] ) * DIR_SIZE );
+      memset( *dir, 0, sizeof( ( *dir )[ 0 ] ) * DIR_SIZE );
+   }
+   return &( *dir )[ ( index >> SPARSE_PAGE_SHIFT ) & ( DIR_SIZE - 1 ) ];
+}
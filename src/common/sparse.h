@@ -0,0 +1,33 @@
+#ifndef SRC_COMMON_SPARSE_H
+#define SRC_COMMON_SPARSE_H
+
+enum { SPARSE_PAGE_SHIFT = 10 }; // 1024 elements, or 4 KiB, per page.
+enum { SPARSE_PAGE_SIZE = 1 << SPARSE_PAGE_SHIFT };
+enum { SPARSE_DIR_SHIFT = 11 };
+
+struct sparse_page {
+   struct sparse_page* next;
+   u32 first; // Index of the first element in the page.
+   // Set when an element of the page is returned for writing.
+   bool written;
+   i32 elements[ SPARSE_PAGE_SIZE ];
+};
+
+/**
+ * An array of integers indexed by any 32-bit index. Elements that were never
+ * written are zero, and take no memory: a page of elements is allocated on the
+ * first write to it.
+ */
+struct sparse_array {
+   // Directories of pages, or NULL before the first write. The top bits of an
+   // index select the directory, and the middle bits select the page.
+   struct sparse_page*** dirs;
+   struct sparse_page* pages; // Allocated pages, most recent first.
+};
+
+void sparse_init( struct sparse_array* array );
+i32 sparse_get( struct sparse_array* array, u32 index );
+i32* sparse_at( struct sparse_array* array, u32 index );
+struct sparse_page* sparse_get_page( struct sparse_array* array, u32 index );
+
+#endif
@@ -13,7 +13,7 @@ void dgb_show_waiting_scripts( struct vm* vm ) {
    list_iterate( &vm->waiting_scripts, &i );
    while ( ! list_end( &i ) ) {
       struct script* script = list_data( &i );
-      printf( "script %d\n", script->number );
+      output_printf( &vm->output, "script %d\n", script->number );
       list_next( &i );
    }
 }
@@ -91,16 +91,16 @@ void dbg_dump_scripts( struct vm* vm ) {
 
 void dbg_dump_script( struct vm* vm, struct script* script ) {
    v_diag( vm, DIAG_DBG | DIAG_MULTI_PART,
-      "script=%d type=%d", script->number, script->type );
+      "script=%d type=%d", script->number, script->info->type );
 
    v_diag_more( vm, " flags=" );
-   if ( script->flags != 0 ) {
+   if ( script->info->flags != 0 ) {
       bool added_flag = false;
-      if ( ( script->flags & FLAG_NET ) != 0 ) {
+      if ( ( script->info->flags & FLAG_NET ) != 0 ) {
          v_diag_more( vm, "net" );
          added_flag = true;
       }
-      if ( ( script->flags & FLAG_CLIENTSIDE ) != 0 ) {
+      if ( ( script->info->flags & FLAG_CLIENTSIDE ) != 0 ) {
          if ( added_flag ) {
             v_diag_more( vm, "|" );
          }
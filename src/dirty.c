@@ -0,0 +1,165 @@
+/**
+ * This file implements the tracking of writes to the variables. The world
+ * variables, the global variables, and the variables of each module are split
+ * into regions, and each region into pages. The instructions that write a
+ * variable record the write, and the first write to a page after one of its
+ * flags was cleared adds the page to the log of that flag. A reset and an
+ * incremental checkpoint then go through their log instead of through every
+ * variable, so their cost depends on how much was written.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include "common/misc.h"
+#include "common/mem.h"
+#include "common/str.h"
+#include "common/list.h"
+#include "vm.h"
+
+static isize init_region( struct dirty_region* region, i32* values,
+   isize size );
+static struct page_log* get_log( struct write_tracker* tracker, u8 flag );
+
+/**
+ * Starts tracking the writes to the variables, if they are not tracked yet.
+ * Every module is read and linked first, so no module is added later. No flag
+ * is recorded until it is added to the dirty flags of the virtual machine.
+ */
+void vm_track_writes( struct vm* vm ) {
+   if ( vm->tracker != NULL ) {
+      return;
+   }
+   vm_link_all_modules( vm );
+   struct write_tracker* tracker = mem_alloc( sizeof( *tracker ) );
+   // A region for the world variables, one for the global variables, and
+   // one for each map variable.
+   tracker->num_regions = 2;
+   struct list_iter i;
+   list_iterate( &vm->modules, &i );
+   while ( ! list_end( &i ) ) {
+      struct module* module = list_data( &i );
+      tracker->num_regions += module->num_vars;
+      list_next( &i );
+   }
+   tracker->regions = mem_alloc( sizeof( tracker->regions[ 0 ] ) *
+      tracker->num_regions );
+   isize total_pages = 0;
+   struct dirty_region* region = tracker->regions;
+   total_pages += init_region( region, vm->world_vars,
+      ARRAY_SIZE( vm->world_vars ) );
+   vm->world_region = region;
+   ++region;
+   total_pages += init_region( region, vm->global_vars,
+      ARRAY_SIZE( vm->global_vars ) );
+   vm->global_region = region;
+   ++region;
+   list_iterate( &vm->modules, &i );
+   while ( ! list_end( &i ) ) {
+      struct module* module = list_data( &i );
+      for ( isize k = 0; k < module->num_vars; ++k ) {
+         // An array is written through its elements, and any other variable
+         // through its value.
+         struct var* var = &module->vars[ k ];
+         total_pages += init_region( region, var->elements,
+            var->array ? var->size : 1 );
+         var->region = region;
+         ++region;
+      }
+      list_next( &i );
+   }
+   // An imported variable is written through the region of the variable it
+   // is imported from.
+   list_iterate( &vm->modules, &i );
+   while ( ! list_end( &i ) ) {
+      struct module* module = list_data( &i );
+      for ( isize k = 0; k < module->num_vars; ++k ) {
+         module->map_var_regions[ k ] = module->vars[ k ].link->region;
+      }
+      list_next( &i );
+   }
+   tracker->reset_log.pages = mem_alloc(
+      sizeof( tracker->reset_log.pages[ 0 ] ) * total_pages );
+   tracker->reset_log.size = 0;
+   tracker->checkpoint_log.pages = mem_alloc(
+      sizeof( tracker->checkpoint_log.pages[ 0 ] ) * total_pages );
+   tracker->checkpoint_log.size = 0;
+   vm->tracker = tracker;
+}
+
+/**
+ * Returns the number of pages in the region. An empty region still has a
+ * page, for writes that go nowhere, like a write to the value of an array.
+ */
+static isize init_region( struct dirty_region* region, i32* values,
+   isize size ) {
+   isize num_pages = ( size + ( 1 << DIRTY_PAGE_SHIFT ) - 1 ) >>
+      DIRTY_PAGE_SHIFT;
+   if ( num_pages == 0 ) {
+      num_pages = 1;
+   }
+   region->values = values;
+   region->pristine = NULL;
+   region->pages = mem_alloc( sizeof( region->pages[ 0 ] ) * num_pages );
+   memset( region->pages, 0, sizeof( region->pages[ 0 ] ) * num_pages );
+   region->size = size;
+   return num_pages;
+}
+
+/**
+ * Records the first write to a page since some of its flags were cleared.
+ */
+void vm_record_page( struct vm* vm, struct dirty_region* region,
+   isize page ) {
+   u8 missing = vm->dirty_flags & ~region->pages[ page ];
+   region->pages[ page ] |= missing;
+   for ( u8 flag = PAGE_DIRTY_RESET; flag <= PAGE_DIRTY_CHECKPOINT;
+      flag <<= 1 ) {
+      if ( missing & flag ) {
+         struct page_log* log = get_log( vm->tracker, flag );
+         log->pages[ log->size ].region = region;
+         log->pages[ log->size ].page = page;
+         ++log->size;
+      }
+   }
+}
+
+/**
+ * Records a write to a range of values, which is not done by a script.
+ */
+void vm_record_writes( struct vm* vm, struct dirty_region* region,
+   isize start, isize count ) {
+   if ( region == NULL || count == 0 ) {
+      return;
+   }
+   isize last_page = ( start + count - 1 ) >> DIRTY_PAGE_SHIFT;
+   for ( isize page = start >> DIRTY_PAGE_SHIFT; page <= last_page; ++page ) {
+      if ( ( region->pages[ page ] & vm->dirty_flags ) != vm->dirty_flags ) {
+         vm_record_page( vm, region, page );
+      }
+   }
+}
+
+/**
+ * Clears a flag from every page that has it, and empties the log of the flag.
+ */
+void vm_clear_dirty_pages( struct vm* vm, u8 flag ) {
+   struct page_log* log = get_log( vm->tracker, flag );
+   for ( isize i = 0; i < log->size; ++i ) {
+      log->pages[ i ].region->pages[ log->pages[ i ].page ] &= ~flag;
+   }
+   log->size = 0;
+}
+
+static struct page_log* get_log( struct write_tracker* tracker, u8 flag ) {
+   switch ( flag ) {
+   case PAGE_DIRTY_RESET:
+      return &tracker->reset_log;
+   case PAGE_DIRTY_CHECKPOINT:
+      return &tracker->checkpoint_log;
+   default:
+      UNREACHABLE();
+      return NULL;
+   }
+}
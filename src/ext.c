@@ -30,6 +30,12 @@ static const char* get_ext_func_name( i32 id );
 void vm_run_callfunc( struct vm* vm, struct turn* turn ) {
    i32 num_args = read_arg( vm, turn, ARG_U8 );
    i32 func = read_arg( vm, turn, ARG_I16 );
+   struct host_func* host_func = vm_find_callfunc_binding( vm, func );
+   if ( host_func != NULL ) {
+      const i32* args = vm_pop_args( vm, turn, num_args );
+      vm_push( turn, host_func->run( vm, args, num_args, host_func->data ) );
+      return;
+   }
    switch ( func ) {
    case EXTFUNC_DUMPSCRIPT:
       call_dump_script( vm, turn,
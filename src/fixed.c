@@ -0,0 +1,226 @@
+/**
+ * This file implements fixed-point arithmetic. Multiplication and division
+ * use 64-bit intermediate results, so they are exact. Sine and arctangent are
+ * read from tables and linearly interpolated between entries. Only a quarter
+ * of a turn is stored; the rest is found by symmetry.
+ */
+
+#include <limits.h>
+
+#include "common/misc.h"
+#include "fixed.h"
+
+enum {
+   // A full turn is 65536 units. The sine table covers a quarter turn in
+   // 256 steps of 64 units.
+   ANGLE_QUARTER_TURN = 0x4000,
+   ANGLE_HALF_TURN = 0x8000,
+   ANGLE_MASK = 0xFFFF,
+   SINE_STEP_SHIFT = 6,
+   // The ratio used to look up the arctangent is in the 16.16 format, and
+   // the arctangent table covers ratios from 0 to 1 in 256 steps.
+   ATAN_STEP_SHIFT = 8
+};
+
+static i32 interpolate( const i32* table, i32 position, i32 shift );
+static i32 quarter_sine( i32 angle );
+
+// sin( i / 256 * pi / 2 ), in the 16.16 format.
+static const i32 g_sine_table[] = {
+   0, 402, 804, 1206, 1608, 2010, 2412, 2814, 3216, 3617,
+   4019, 4420, 4821, 5222, 5623, 6023, 6424, 6824, 7224, 7623,
+   8022, 8421, 8820, 9218, 9616, 10014, 10411, 10808, 11204, 11600,
+   11996, 12391, 12785, 13180, 13573, 13966, 14359, 14751, 15143, 15534,
+   15924, 16314, 16703, 17091, 17479, 17867, 18253, 18639, 19024, 19409,
+   19792, 20175, 20557, 20939, 21320, 21699, 22078, 22457, 22834, 23210,
+   23586, 23961, 24335, 24708, 25080, 25451, 25821, 26190, 26558, 26925,
+   27291, 27656, 28020, 28383, 28745, 29106, 29466, 29824, 30182, 30538,
+   30893, 31248, 31600, 31952, 32303, 32652, 33000, 33347, 33692, 34037,
+   34380, 34721, 35062, 35401, 35738, 36075, 36410, 36744, 37076, 37407,
+   37736, 38064, 38391, 38716, 39040, 39362, 39683, 40002, 40320, 40636,
+   40951, 41264, 41576, 41886, 42194, 42501, 42806, 43110, 43412, 43713,
+   44011, 44308, 44604, 44898, 45190, 45480, 45769, 46056, 46341, 46624,
+   46906, 47186, 47464, 47741, 48015, 48288, 48559, 48828, 49095, 49361,
+   49624, 49886, 50146, 50404, 50660, 50914, 51166, 51417, 51665, 51911,
+   52156, 52398, 52639, 52878, 53114, 53349, 53581, 53812, 54040, 54267,
+   54491, 54714, 54934, 55152, 55368, 55582, 55794, 56004, 56212, 56418,
+   56621, 56823, 57022, 57219, 57414, 57607, 57798, 57986, 58172, 58356,
+   58538, 58718, 58896, 59071, 59244, 59415, 59583, 59750, 59914, 60075,
+   60235, 60392, 60547, 60700, 60851, 60999, 61145, 61288, 61429, 61568,
+   61705, 61839, 61971, 62101, 62228, 62353, 62476, 62596, 62714, 62830,
+   62943, 63054, 63162, 63268, 63372, 63473, 63572, 63668, 63763, 63854,
+   63944, 64031, 64115, 64197, 64277, 64354, 64429, 64501, 64571, 64639,
+   64704, 64766, 64827, 64884, 64940, 64993, 65043, 65091, 65137, 65180,
+   65220, 65259, 65294, 65328, 65358, 65387, 65413, 65436, 65457, 65476,
+   65492, 65505, 65516, 65525, 65531, 65535, 65536
+};
+
+// atan( i / 256 ), as a fraction of a turn, where a full turn is 2^32.
+static const i32 g_atan_table[] = {
+   0, 2670163, 5340245, 8010164, 10679838, 13349187,
+   16018129, 18686582, 21354465, 24021698, 26688200, 29353889,
+   32018685, 34682507, 37345276, 40006910, 42667331, 45326458,
+   47984212, 50640513, 53295284, 55948444, 58599915, 61249621,
+   63897482, 66543421, 69187361, 71829226, 74468939, 77106424,
+   79741605, 82374407, 85004756, 87632577, 90257796, 92880340,
+   95500135, 98117110, 100731191, 103342309, 105950391, 108555367,
+   111157167, 113755721, 116350962, 118942819, 121531227, 124116117,
+   126697423, 129275078, 131849018, 134419178, 136985493, 139547900,
+   142106335, 144660738, 147211045, 149757197, 152299132, 154836791,
+   157370116, 159899047, 162423527, 164943499, 167458907, 169969696,
+   172475810, 174977196, 177473799, 179965568, 182452450, 184934394,
+   187411349, 189883266, 192350096, 194811789, 197268300, 199719579,
+   202165583, 204606264, 207041579, 209471483, 211895933, 214314887,
+   216728303, 219136141, 221538359, 223934919, 226325781, 228710908,
+   231090262, 233463808, 235831508, 238193329, 240549235, 242899194,
+   245243172, 247581137, 249913059, 252238905, 254558647, 256872255,
+   259179700, 261480955, 263775993, 266064788, 268347313, 270623543,
+   272893455, 275157025, 277414230, 279665048, 281909457, 284147437,
+   286378966, 288604026, 290822599, 293034664, 295240206, 297439207,
+   299631651, 301817523, 303996806, 306169488, 308335554, 310494991,
+   312647786, 314793928, 316933406, 319066208, 321192324, 323311746,
+   325424463, 327530468, 329629752, 331722309, 333808132, 335887214,
+   337959550, 340025134, 342083962, 344136031, 346181336, 348219874,
+   350251643, 352276640, 354294865, 356306316, 358310992, 360308894,
+   362300021, 364284375, 366261957, 368232767, 370196809, 372154086,
+   374104599, 376048352, 377985350, 379915596, 381839095, 383755852,
+   385665872, 387569162, 389465727, 391355574, 393238710, 395115141,
+   396984877, 398847924, 400704291, 402553986, 404397019, 406233399,
+   408063135, 409886237, 411702716, 413512582, 415315845, 417112518,
+   418902610, 420686135, 422463104, 424233528, 425997422, 427754796,
+   429505665, 431250041, 432987938, 434719370, 436444350, 438162893,
+   439875013, 441580724, 443280042, 444972981, 446659557, 448339785,
+   450013680, 451681259, 453342536, 454997530, 456646255, 458288728,
+   459924966, 461554985, 463178803, 464796437, 466407904, 468013221,
+   469612406, 471205476, 472792449, 474373344, 475948178, 477516969,
+   479079736, 480636498, 482187271, 483732076, 485270931, 486803855,
+   488330866, 489851983, 491367227, 492876615, 494380167, 495877903,
+   497369841, 498856002, 500336404, 501811068, 503280012, 504743258,
+   506200824, 507652730, 509098996, 510539643, 511974689, 513404156,
+   514828063, 516246430, 517659277, 519066625, 520468494, 521864904,
+   523255875, 524641427, 526021581, 527396357, 528765775, 530129856,
+   531488619, 532842087, 534190278, 535533213, 536870912
+};
+
+i32 fixed_mul( i32 a, i32 b ) {
+   return ( i32 ) ( ( ( i64 ) a * b ) >> FIXED_SHIFT );
+}
+
+/**
+ * Like the engine, a quotient that does not fit, which includes division by
+ * zero, is clamped to the largest number with the sign of the quotient.
+ */
+i32 fixed_div( i32 a, i32 b ) {
+   if ( b == 0 ) {
+      return ( a < 0 ) ? INT_MIN : INT_MAX;
+   }
+   i64 quotient = ( ( i64 ) a * FIXED_ONE ) / b;
+   if ( quotient > INT_MAX ) {
+      return INT_MAX;
+   }
+   if ( quotient < INT_MIN ) {
+      return INT_MIN;
+   }
+   return ( i32 ) quotient;
+}
+
+i32 fixed_sin( i32 angle ) {
+   angle &= ANGLE_MASK;
+   if ( angle < ANGLE_HALF_TURN ) {
+      return quarter_sine( angle );
+   }
+   return - quarter_sine( angle - ANGLE_HALF_TURN );
+}
+
+i32 fixed_cos( i32 angle ) {
+   return fixed_sin( ( angle & ANGLE_MASK ) + ANGLE_QUARTER_TURN );
+}
+
+/**
+ * Returns the sine of an angle in the first half of a turn.
+ */
+static i32 quarter_sine( i32 angle ) {
+   if ( angle > ANGLE_QUARTER_TURN ) {
+      angle = ANGLE_HALF_TURN - angle;
+   }
+   return interpolate( g_sine_table, angle, SINE_STEP_SHIFT );
+}
+
+/**
+ * Looks up a value between two entries of a table. The position is the index
+ * of the entry, shifted left by the specified amount.
+ */
+static i32 interpolate( const i32* table, i32 position, i32 shift ) {
+   i32 index = position >> shift;
+   i32 fraction = position & ( ( 1 << shift ) - 1 );
+   if ( fraction == 0 ) {
+      return table[ index ];
+   }
+   i64 step = table[ index + 1 ] - table[ index ];
+   return table[ index ] + ( i32 ) ( ( step * fraction +
+      ( 1 << ( shift - 1 ) ) ) >> shift );
+}
+
+/**
+ * Returns the angle of the vector ( x, y ), between 0 and 1. The vector is
+ * reflected into the first eighth of a turn, where the angle is the
+ * arctangent of a ratio between 0 and 1, and the angle is then reflected
+ * back.
+ */
+i32 fixed_vector_angle( i32 x, i32 y ) {
+   u32 abs_x = ( x < 0 ) ? - ( u32 ) x : ( u32 ) x;
+   u32 abs_y = ( y < 0 ) ? - ( u32 ) y : ( u32 ) y;
+   u32 angle;
+   if ( abs_x == 0 && abs_y == 0 ) {
+      return 0;
+   }
+   else if ( abs_y <= abs_x ) {
+      i32 ratio = ( i32 ) ( ( ( u64 ) abs_y << FIXED_SHIFT ) / abs_x );
+      angle = ( u32 ) interpolate( g_atan_table, ratio, ATAN_STEP_SHIFT );
+   }
+   else {
+      i32 ratio = ( i32 ) ( ( ( u64 ) abs_x << FIXED_SHIFT ) / abs_y );
+      angle = 0x40000000u -
+         ( u32 ) interpolate( g_atan_table, ratio, ATAN_STEP_SHIFT );
+   }
+   if ( x < 0 ) {
+      angle = 0x80000000u - angle;
+   }
+   if ( y < 0 ) {
+      angle = - angle;
+   }
+   return ( i32 ) ( angle >> FIXED_SHIFT );
+}
+
+void fixed_mul_batch( const i32* a, const i32* b, i32* results,
+   isize count ) {
+   for ( isize i = 0; i < count; ++i ) {
+      results[ i ] = fixed_mul( a[ i ], b[ i ] );
+   }
+}
+
+void fixed_div_batch( const i32* a, const i32* b, i32* results,
+   isize count ) {
+   for ( isize i = 0; i < count; ++i ) {
+      results[ i ] = fixed_div( a[ i ], b[ i ] );
+   }
+}
+
+void fixed_sin_batch( const i32* angles, i32* results, isize count ) {
+   for ( isize i = 0; i < count; ++i ) {
+      results[ i ] = fixed_sin( angles[ i ] );
+   }
+}
+
+void fixed_cos_batch( const i32* angles, i32* results, isize count ) {
+   for ( isize i = 0; i < count; ++i ) {
+      results[ i ] = fixed_cos( angles[ i ] );
+   }
+}
+
+void fixed_vector_angle_batch( const i32* x, const i32* y, i32* results,
+   isize count ) {
+   for ( isize i = 0; i < count; ++i ) {
+      results[ i ] = fixed_vector_angle( x[ i ], y[ i ] );
+   }
+}
@@ -0,0 +1,36 @@
+#ifndef SRC_FIXED_H
+#define SRC_FIXED_H
+
+/**
+ * Fixed-point arithmetic
+ *
+ * Numbers are in the 16.16 format used by the game. An angle is a fraction of
+ * a full turn, so 0.25 is a quarter turn, and only the fractional part of an
+ * angle is significant. The functions give the same results as the engine,
+ * except that sine, cosine, and vector angles are approximated with tables
+ * and can differ from the engine in the last bit.
+ *
+ * The batch functions apply a function to each element of arrays, so a host
+ * can run many calculations in one call.
+ */
+
+enum {
+   FIXED_SHIFT = 16,
+   FIXED_ONE = 1 << FIXED_SHIFT
+};
+
+i32 fixed_mul( i32 a, i32 b );
+i32 fixed_div( i32 a, i32 b );
+i32 fixed_sin( i32 angle );
+i32 fixed_cos( i32 angle );
+i32 fixed_vector_angle( i32 x, i32 y );
+void fixed_mul_batch( const i32* a, const i32* b, i32* results,
+   isize count );
+void fixed_div_batch( const i32* a, const i32* b, i32* results,
+   isize count );
+void fixed_sin_batch( const i32* angles, i32* results, isize count );
+void fixed_cos_batch( const i32* angles, i32* results, isize count );
+void fixed_vector_angle_batch( const i32* x, const i32* y, i32* results,
+   isize count );
+
+#endif
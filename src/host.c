@@ -0,0 +1,165 @@
+/**
+ * This file implements the binding of host functions. A program that embeds
+ * the virtual machine uses these functions to implement line specials,
+ * builtins, and CALLFUNC functions. A bound function takes precedence over
+ * the implementation provided by the virtual machine.
+ */
+
+#include <stdio.h>
+#include <setjmp.h>
+
+#include "common/misc.h"
+#include "common/mem.h"
+#include "common/str.h"
+#include "common/list.h"
+#include "vm.h"
+#include "pcode.h"
+
+static void bind_func( struct hash_table* table, i32 id,
+   struct host_func func );
+static void init_batch( struct host_call_batch* batch );
+static void grow_batch( struct host_call_batch* batch, i32 num_args );
+
+void vm_init_host_calls( struct vm* vm ) {
+   hash_init( &vm->lspec_table );
+   hash_init( &vm->callfunc_table );
+   vm->builtin_funcs = mem_alloc( sizeof( vm->builtin_funcs[ 0 ] ) *
+      PCD_TOTAL );
+   for ( isize i = 0; i < PCD_TOTAL; ++i ) {
+      vm->builtin_funcs[ i ].run = NULL;
+      vm->builtin_funcs[ i ].data = NULL;
+   }
+   vm->batch_handler.run = NULL;
+   vm->batch_handler.data = NULL;
+   init_batch( &vm->batch );
+}
+
+static void init_batch( struct host_call_batch* batch ) {
+   batch->kinds = NULL;
+   batch->ids = NULL;
+   batch->first_arg = NULL;
+   batch->num_args = NULL;
+   batch->args = NULL;
+   batch->size = 0;
+   batch->total_args = 0;
+   batch->capacity = 0;
+   batch->args_capacity = 0;
+}
+
+/**
+ * Forgets the arrays of the batch without freeing them. Used on a reset,
+ * when the memory of the run is freed all at once. The bound functions are
+ * kept.
+ */
+void vm_reset_host_calls( struct vm* vm ) {
+   init_batch( &vm->batch );
+}
+
+void vm_bind_lspec( struct vm* vm, i32 id, struct host_func func ) {
+   bind_func( &vm->lspec_table, id, func );
+}
+
+/**
+ * Returns false if the opcode does not run a builtin.
+ */
+bool vm_bind_builtin( struct vm* vm, i32 opcode, struct host_func func ) {
+   if ( vm_find_builtin( opcode ) == NULL ) {
+      return false;
+   }
+   vm->builtin_funcs[ opcode ] = func;
+   return true;
+}
+
+void vm_bind_callfunc( struct vm* vm, i32 id, struct host_func func ) {
+   bind_func( &vm->callfunc_table, id, func );
+}
+
+/**
+ * Binding a function to an ID that is already bound replaces the previous
+ * function.
+ */
+static void bind_func( struct hash_table* table, i32 id,
+   struct host_func func ) {
+   struct host_func* bound_func = hash_find_number( table, id );
+   if ( bound_func == NULL ) {
+      bound_func = mem_alloc( sizeof( *bound_func ) );
+      hash_add_number( table, id, bound_func );
+   }
+   *bound_func = func;
+}
+
+struct host_func* vm_find_lspec_binding( struct vm* vm, i32 id ) {
+   return hash_find_number( &vm->lspec_table, id );
+}
+
+struct host_func* vm_find_callfunc_binding( struct vm* vm, i32 id ) {
+   return hash_find_number( &vm->callfunc_table, id );
+}
+
+/**
+ * Enables batching of host calls. Calls to line specials and builtins that do
+ * not return a value, and that the virtual machine does not implement itself,
+ * are no longer made right away. Instead, they are collected and given to the
+ * handler at the end of each tic, in the order they were made.
+ */
+void vm_set_batch_handler( struct vm* vm, struct batch_handler handler ) {
+   vm->batch_handler = handler;
+}
+
+/**
+ * Adds a call to the batch of the current tic. Returns false if batching is
+ * not enabled, in which case the call should be made right away.
+ */
+bool vm_batch_host_call( struct vm* vm, i32 kind, i32 id, const i32* args,
+   i32 num_args ) {
+   if ( vm->batch_handler.run == NULL ) {
+      return false;
+   }
+   struct host_call_batch* batch = &vm->batch;
+   if ( batch->size == batch->capacity ||
+      batch->total_args + num_args > batch->args_capacity ) {
+      grow_batch( batch, num_args );
+   }
+   batch->kinds[ batch->size ] = kind;
+   batch->ids[ batch->size ] = id;
+   batch->first_arg[ batch->size ] = batch->total_args;
+   batch->num_args[ batch->size ] = num_args;
+   for ( i32 i = 0; i < num_args; ++i ) {
+      batch->args[ batch->total_args + i ] = args[ i ];
+   }
+   batch->total_args += num_args;
+   ++batch->size;
+   return true;
+}
+
+static void grow_batch( struct host_call_batch* batch, i32 num_args ) {
+   if ( batch->size == batch->capacity ) {
+      batch->capacity = ( batch->capacity == 0 ) ? 64 : batch->capacity * 2;
+      batch->kinds = mem_realloc( batch->kinds,
+         sizeof( batch->kinds[ 0 ] ) * batch->capacity );
+      batch->ids = mem_realloc( batch->ids,
+         sizeof( batch->ids[ 0 ] ) * batch->capacity );
+      batch->first_arg = mem_realloc( batch->first_arg,
+         sizeof( batch->first_arg[ 0 ] ) * batch->capacity );
+      batch->num_args = mem_realloc( batch->num_args,
+         sizeof( batch->num_args[ 0 ] ) * batch->capacity );
+   }
+   while ( batch->total_args + num_args > batch->args_capacity ) {
+      batch->args_capacity = ( batch->args_capacity == 0 ) ? 256 :
+         batch->args_capacity * 2;
+   }
+   batch->args = mem_realloc( batch->args,
+      sizeof( batch->args[ 0 ] ) * batch->args_capacity );
+}
+
+/**
+ * Hands the calls collected during the tic to the host, and empties the
+ * batch. The arrays are kept for the next tic.
+ */
+void vm_flush_host_calls( struct vm* vm ) {
+   if ( vm->batch.size > 0 ) {
+      vm->batch_handler.run( vm, &vm->batch, vm->batch_handler.data );
+      vm->batch.size = 0;
+      vm->batch.total_args = 0;
+   }
+}
@@ -10,24 +10,27 @@
 #include "pcode.h"
 #include "debug.h"
 
-struct pcode_func {
-   const char* name;
-   i32 opcode;
-   i8 num_args;
-   bool returns_value;
-};
-
 static void check_div_by_zero( struct vm* vm, struct turn* turn,
    i32 denominator );
+static void check_map_var( struct vm* vm, struct turn* turn, i32 index );
 static i32* get_script_var( struct vm* vm, struct turn* turn, i32 index );
 static i32* get_script_element( struct vm* vm, struct turn* turn,
    i32 array_index, i32 element );
 static i32* get_element( struct vm* vm, struct turn* turn, i32* array_data,
    struct script_array* entry, int element );
-static void run_updateworldarray( struct vm* vm, struct turn* turn );
-static struct vector* get_world_vector( struct vm* vm, i32 index );
-static void extend_array_if_out_of_bounds( struct vector* vector, i32 index );
-static void run_pushworldarray( struct vm* vm, struct turn* turn );
+static i32* write_world_var( struct vm* vm, i32 index );
+static i32* write_global_var( struct vm* vm, i32 index );
+static i32* write_map_var( struct vm* vm, struct turn* turn, i32 index );
+static i32* write_map_element( struct vm* vm, struct turn* turn, i32 index,
+   i32 element );
+static void record_write( struct vm* vm, struct dirty_region* region,
+   isize index );
+static void run_push_array( struct vm* vm, struct turn* turn,
+   struct sparse_array* arrays, isize num_arrays );
+static void run_update_array( struct vm* vm, struct turn* turn,
+   struct sparse_array* arrays, isize num_arrays );
+static struct sparse_array* get_array( struct vm* vm, struct turn* turn,
+   struct sparse_array* arrays, isize num_arrays );
 static void decode_opcode( struct vm* vm, struct turn* turn );
 static void push( struct turn* turn, i32 value );
 static i32 pop( struct vm* vm, struct turn* turn );
@@ -35,14 +38,12 @@ static void add_waiting_script( struct instance* script,
    struct instance* waiting_script );
 static void delay_current_script( struct vm* vm, struct turn* turn,
    i32 amount );
-static void push_random_number( struct turn* turn, i32 min, i32 max );
+static void push_random_number( struct vm* vm, struct turn* turn, i32 min,
+   i32 max );
 static void run_call( struct vm* vm, struct turn* turn );
 static struct call* push_call( struct vm* vm );
 static void run_return( struct vm* vm, struct turn* turn );
 static struct call* pop_call( struct vm* vm );
-static void run_pcode_func( struct vm* vm, struct turn* turn );
-static enum opcode translate_direct_opcode( enum opcode opcode );
-static const struct pcode_func* get_pcode_func( enum opcode opcode );
 
 /**
  * Executes a single instruction of a script.
@@ -181,11 +182,11 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
       }
       break;
    case PCD_ASSIGNMAPVAR:
-      turn->module->map_vars[ ( int ) *turn->ip ]->value = pop( vm, turn );
+      *write_map_var( vm, turn, *turn->ip ) = pop( vm, turn );
       ++turn->ip;
       break;
    case PCD_ASSIGNWORLDVAR:
-      vm->world_vars[ ( int ) *turn->ip ] = pop( vm, turn );
+      *write_world_var( vm, *turn->ip ) = pop( vm, turn );
       ++turn->ip;
       break;
    case PCD_PUSHSCRIPTVAR:
@@ -196,7 +197,8 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
       }
       break;
    case PCD_PUSHMAPVAR:
-      push( turn, turn->module->map_vars[ ( int ) *turn->ip ]->value );
+      check_map_var( vm, turn, *turn->ip );
+      push( turn, *turn->module->map_vars[ ( int ) *turn->ip ] );
       ++turn->ip;
       break;
    case PCD_PUSHWORLDVAR:
@@ -208,11 +210,11 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
       ++turn->ip;
       break;
    case PCD_ADDMAPVAR:
-      turn->module->map_vars[ ( int ) *turn->ip ]->value += pop( vm, turn );
+      *write_map_var( vm, turn, *turn->ip ) += pop( vm, turn );
       ++turn->ip;
       break;
    case PCD_ADDWORLDVAR:
-      vm->world_vars[ ( int ) *turn->ip ] += pop( vm, turn );
+      *write_world_var( vm, *turn->ip ) += pop( vm, turn );
       ++turn->ip;
       break;
    case PCD_SUBSCRIPTVAR:
@@ -220,11 +222,11 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
       ++turn->ip;
       break;
    case PCD_SUBMAPVAR:
-      turn->module->map_vars[ ( int ) *turn->ip ]->value -= pop( vm, turn );
+      *write_map_var( vm, turn, *turn->ip ) -= pop( vm, turn );
       ++turn->ip;
       break;
    case PCD_SUBWORLDVAR:
-      vm->world_vars[ ( int ) *turn->ip ] -= pop( vm, turn );
+      *write_world_var( vm, *turn->ip ) -= pop( vm, turn );
       ++turn->ip;
       break;
    case PCD_MULSCRIPTVAR:
@@ -232,11 +234,11 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
       ++turn->ip;
       break;
    case PCD_MULMAPVAR:
-      turn->module->map_vars[ ( int ) *turn->ip ]->value *= pop( vm, turn );
+      *write_map_var( vm, turn, *turn->ip ) *= pop( vm, turn );
       ++turn->ip;
       break;
    case PCD_MULWORLDVAR:
-      vm->world_vars[ ( int ) *turn->ip ] *= pop( vm, turn );
+      *write_world_var( vm, *turn->ip ) *= pop( vm, turn );
       ++turn->ip;
       break;
    case PCD_DIVSCRIPTVAR:
@@ -255,7 +257,7 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
          if ( r == 0 ) {
             goto divzero_err;
          }
-         turn->module->map_vars[ ( int ) *turn->ip ]->value /= r;
+         *write_map_var( vm, turn, *turn->ip ) /= r;
          ++turn->ip;
       }
       break;
@@ -265,7 +267,7 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
          if ( r == 0 ) {
             goto divzero_err;
          }
-         vm->world_vars[ ( int ) *turn->ip ] /= r;
+         *write_world_var( vm, *turn->ip ) /= r;
          ++turn->ip;
       }
       break;
@@ -285,7 +287,7 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
          if ( r == 0 ) {
             goto modzero_err;
          }
-         turn->module->map_vars[ ( int ) *turn->ip ]->value %= r;
+         *write_map_var( vm, turn, *turn->ip ) %= r;
          ++turn->ip;
       }
       break;
@@ -295,7 +297,7 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
          if ( r == 0 ) {
             goto modzero_err;
          }
-         vm->world_vars[ ( int ) *turn->ip ] %= r;
+         *write_world_var( vm, *turn->ip ) %= r;
          ++turn->ip;
       }
       break;
@@ -304,11 +306,11 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
       ++turn->ip;
       break;
    case PCD_INCMAPVAR:
-      ++turn->module->map_vars[ ( int ) *turn->ip ]->value;
+      ++*write_map_var( vm, turn, *turn->ip );
       ++turn->ip;
       break;
    case PCD_INCWORLDVAR:
-      ++vm->world_vars[ ( int ) *turn->ip ];
+      ++*write_world_var( vm, *turn->ip );
       ++turn->ip;
       break;
    case PCD_DECSCRIPTVAR:
@@ -316,11 +318,11 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
       ++turn->ip;
       break;
    case PCD_DECMAPVAR:
-      --turn->module->map_vars[ ( int ) *turn->ip ]->value;
+      --*write_map_var( vm, turn, *turn->ip );
       ++turn->ip;
       break;
    case PCD_DECWORLDVAR:
-      --vm->world_vars[ ( int ) *turn->ip ];
+      --*write_world_var( vm, *turn->ip );
       ++turn->ip;
       break;
    case PCD_ANDSCRIPTVAR:
@@ -328,15 +330,15 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
       ++turn->ip;
       break;
    case PCD_ANDMAPVAR:
-      turn->module->map_vars[ ( int ) *turn->ip ]->value &= pop( vm, turn );
+      *write_map_var( vm, turn, *turn->ip ) &= pop( vm, turn );
       ++turn->ip;
       break;
    case PCD_ANDWORLDVAR:
-      vm->world_vars[ ( int ) *turn->ip ] &= pop( vm, turn );
+      *write_world_var( vm, *turn->ip ) &= pop( vm, turn );
       ++turn->ip;
       break;
    case PCD_ANDGLOBALVAR:
-      vm->global_vars[ ( int ) *turn->ip ] &= pop( vm, turn );
+      *write_global_var( vm, *turn->ip ) &= pop( vm, turn );
       ++turn->ip;
       break;
    case PCD_ORSCRIPTVAR:
@@ -344,15 +346,15 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
       ++turn->ip;
       break;
    case PCD_ORMAPVAR:
-      turn->module->map_vars[ ( int ) *turn->ip ]->value |= pop( vm, turn );
+      *write_map_var( vm, turn, *turn->ip ) |= pop( vm, turn );
       ++turn->ip;
       break;
    case PCD_ORWORLDVAR:
-      vm->world_vars[ ( int ) *turn->ip ] |= pop( vm, turn );
+      *write_world_var( vm, *turn->ip ) |= pop( vm, turn );
       ++turn->ip;
       break;
    case PCD_ORGLOBALVAR:
-      vm->global_vars[ ( int ) *turn->ip ] |= pop( vm, turn );
+      *write_global_var( vm, *turn->ip ) |= pop( vm, turn );
       ++turn->ip;
       break;
    case PCD_EORSCRIPTVAR:
@@ -360,15 +362,15 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
       ++turn->ip;
       break;
    case PCD_EORMAPVAR:
-      turn->module->map_vars[ ( int ) *turn->ip ]->value ^= pop( vm, turn );
+      *write_map_var( vm, turn, *turn->ip ) ^= pop( vm, turn );
       ++turn->ip;
       break;
    case PCD_EORWORLDVAR:
-      vm->world_vars[ ( int ) *turn->ip ] ^= pop( vm, turn );
+      *write_world_var( vm, *turn->ip ) ^= pop( vm, turn );
       ++turn->ip;
       break;
    case PCD_EORGLOBALVAR:
-      vm->global_vars[ ( int ) *turn->ip ] ^= pop( vm, turn );
+      *write_global_var( vm, *turn->ip ) ^= pop( vm, turn );
       ++turn->ip;
       break;
    case PCD_LSSCRIPTVAR:
@@ -376,15 +378,15 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
       ++turn->ip;
       break;
    case PCD_LSMAPVAR:
-      turn->module->map_vars[ ( int ) *turn->ip ]->value <<= pop( vm, turn );
+      *write_map_var( vm, turn, *turn->ip ) <<= pop( vm, turn );
       ++turn->ip;
       break;
    case PCD_LSWORLDVAR:
-      vm->world_vars[ ( int ) *turn->ip ] <<= pop( vm, turn );
+      *write_world_var( vm, *turn->ip ) <<= pop( vm, turn );
       ++turn->ip;
       break;
    case PCD_LSGLOBALVAR:
-      vm->global_vars[ ( int ) *turn->ip ] <<= pop( vm, turn );
+      *write_global_var( vm, *turn->ip ) <<= pop( vm, turn );
       ++turn->ip;
       break;
    case PCD_RSSCRIPTVAR:
@@ -392,15 +394,15 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
       ++turn->ip;
       break;
    case PCD_RSMAPVAR:
-      turn->module->map_vars[ ( int ) *turn->ip ]->value >>= pop( vm, turn );
+      *write_map_var( vm, turn, *turn->ip ) >>= pop( vm, turn );
       ++turn->ip;
       break;
    case PCD_RSWORLDVAR:
-      vm->world_vars[ ( int ) *turn->ip ] >>= pop( vm, turn );
+      *write_world_var( vm, *turn->ip ) >>= pop( vm, turn );
       ++turn->ip;
       break;
    case PCD_RSGLOBALVAR:
-      vm->global_vars[ ( int ) *turn->ip ] >>= pop( vm, turn );
+      *write_global_var( vm, *turn->ip ) >>= pop( vm, turn );
       ++turn->ip;
       break;
    case PCD_GOTO:
@@ -450,7 +452,7 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
       {
          i32 max = pop( vm, turn );
          i32 min = pop( vm, turn );
-         push_random_number( turn, min, max );
+         push_random_number( vm, turn, min, max );
       }
       break;
    case PCD_RANDOMDIRECT:
@@ -461,7 +463,7 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
          } args;
          memcpy( &args, turn->ip, sizeof( args ) );
          turn->ip += sizeof( args );
-         push( turn, args.min + rand() % ( args.max - args.min + 1 ) );
+         push_random_number( vm, turn, args.min, args.max );
       }
       break;
    case PCD_THINGCOUNT:
@@ -474,7 +476,7 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
    case PCD_CHANGEFLOORDIRECT:
    case PCD_CHANGECEILING:
    case PCD_CHANGECEILINGDIRECT:
-      run_pcode_func( vm, turn );
+      vm_run_builtin( vm, turn );
       break;
    case PCD_RESTART:
       // TODO: Should be script->start?
@@ -552,7 +554,7 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
       }
       break;
    case PCD_LINESIDE:
-      run_pcode_func( vm, turn );
+      vm_run_builtin( vm, turn );
       break;
    case PCD_SCRIPTWAIT:
    case PCD_SCRIPTWAITDIRECT:
@@ -575,7 +577,7 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
       }
       break;
    case PCD_CLEARLINESPECIAL:
-      run_pcode_func( vm, turn );
+      vm_run_builtin( vm, turn );
       break;
    case PCD_CASEGOTO:
       {
@@ -690,10 +692,10 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
    case PCD_ISONEFLAGCTF:
    case PCD_GETINVASIONWAVE:
    case PCD_GETINVASIONSTATE:
-      run_pcode_func( vm, turn );
+      vm_run_builtin( vm, turn );
       break;
    case PCD_PRINTNAME:
-      printf( "error: instruction not supported\n" );
+      v_diag( vm, DIAG_ERR, "instruction not supported" );
       v_bail( vm );
       break;
    case PCD_MUSICCHANGE:
@@ -721,7 +723,7 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
    case PCD_SETMUSICDIRECT:
    case PCD_LOCALSETMUSIC:
    case PCD_LOCALSETMUSICDIRECT:
-      run_pcode_func( vm, turn );
+      vm_run_builtin( vm, turn );
       break;
    case PCD_PRINTFIXED:
    case PCD_PRINTLOCALIZED:
@@ -733,7 +735,7 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
       break;
    case PCD_SETFONT:
    case PCD_SETFONTDIRECT:
-      run_pcode_func( vm, turn );
+      vm_run_builtin( vm, turn );
       break;
    case PCD_PUSHBYTE:
       push( turn, *turn->ip );
@@ -759,7 +761,7 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
       {
          i32 min = turn->ip[ 0 ];
          i32 max = turn->ip[ 1 ];
-         push_random_number( turn, min, max );
+         push_random_number( vm, turn, min, max );
          turn->ip += sizeof( turn->ip[ 0 ] ) * 2;
       }
       break;
@@ -801,10 +803,10 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
       turn->ip += sizeof( turn->ip[ 0 ] ) * 5;
       break;
    case PCD_SETTHINGSPECIAL:
-      run_pcode_func( vm, turn );
+      vm_run_builtin( vm, turn );
       break;
    case PCD_ASSIGNGLOBALVAR:
-      vm->global_vars[ ( int ) *turn->ip ] = pop( vm, turn );
+      *write_global_var( vm, *turn->ip ) = pop( vm, turn );
       ++turn->ip;
       break;
    case PCD_PUSHGLOBALVAR:
@@ -812,15 +814,15 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
       ++turn->ip;
       break;
    case PCD_ADDGLOBALVAR:
-      vm->global_vars[ ( int ) *turn->ip ] += pop( vm, turn );
+      *write_global_var( vm, *turn->ip ) += pop( vm, turn );
       ++turn->ip;
       break;
    case PCD_SUBGLOBALVAR:
-      vm->global_vars[ ( int ) *turn->ip ] -= pop( vm, turn );
+      *write_global_var( vm, *turn->ip ) -= pop( vm, turn );
       ++turn->ip;
       break;
    case PCD_MULGLOBALVAR:
-      vm->global_vars[ ( int ) *turn->ip ] *= pop( vm, turn );
+      *write_global_var( vm, *turn->ip ) *= pop( vm, turn );
       ++turn->ip;
       break;
    case PCD_DIVGLOBALVAR:
@@ -829,7 +831,7 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
          if ( r == 0 ) {
             goto divzero_err;
          }
-         vm->global_vars[ ( int ) *turn->ip ] /= r;
+         *write_global_var( vm, *turn->ip ) /= r;
          ++turn->ip;
       }
       break;
@@ -839,16 +841,16 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
          if ( r == 0 ) {
             goto modzero_err;
          }
-         vm->global_vars[ ( int ) *turn->ip ] %= r;
+         *write_global_var( vm, *turn->ip ) %= r;
          ++turn->ip;
       }
       break;
    case PCD_INCGLOBALVAR:
-      ++vm->global_vars[ ( int ) *turn->ip ];
+      ++*write_global_var( vm, *turn->ip );
       ++turn->ip;
       break;
    case PCD_DECGLOBALVAR:
-      --vm->global_vars[ ( int ) *turn->ip ];
+      --*write_global_var( vm, *turn->ip );
       ++turn->ip;
       break;
    case PCD_FADETO:
@@ -860,7 +862,7 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
    case PCD_GETACTORX:
    case PCD_GETACTORY:
    case PCD_GETACTORZ:
-      run_pcode_func( vm, turn );
+      vm_run_builtin( vm, turn );
       break;
    case PCD_STARTTRANSLATION:
    case PCD_TRANSLATIONRANGE1:
@@ -882,8 +884,9 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
    case PCD_PUSHMAPARRAY:
       {
          int index = pop( vm, turn );
-         if ( index >= 0 && index < turn->module->map_vars[ ( int ) *turn->ip ]->size ) {
-            push( turn, turn->module->map_vars[ ( int ) *turn->ip ]->elements[ index ] );
+         check_map_var( vm, turn, *turn->ip );
+         if ( index >= 0 && index < turn->module->map_var_sizes[ ( int ) *turn->ip ] ) {
+            push( turn, turn->module->map_vars[ ( int ) *turn->ip ][ index ] );
          }
          else {
             push( turn, 0 );
@@ -895,8 +898,9 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
       {
          i32 value = pop( vm, turn );
          i32 index = pop( vm, turn );
-         if ( index >= 0 && index < turn->module->map_vars[ ( int ) *turn->ip ]->size ) {
-            turn->module->map_vars[ ( int ) *turn->ip ]->elements[ index ] = value;
+         check_map_var( vm, turn, *turn->ip );
+         if ( index >= 0 && index < turn->module->map_var_sizes[ ( int ) *turn->ip ] ) {
+            *write_map_element( vm, turn, *turn->ip, index ) = value;
          }
          else {
             push( turn, 0 );
@@ -919,8 +923,9 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
    case PCD_INCMAPARRAY:
       {
          int index = pop( vm, turn );
-         if ( index >= 0 && index < turn->module->map_vars[ ( int ) *turn->ip ]->size ) {
-            ++turn->module->map_vars[ ( int ) *turn->ip ]->elements[ index ];
+         check_map_var( vm, turn, *turn->ip );
+         if ( index >= 0 && index < turn->module->map_var_sizes[ ( int ) *turn->ip ] ) {
+            ++*write_map_element( vm, turn, *turn->ip, index );
          }
          else {
          }
@@ -950,13 +955,14 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
    case PCD_VECTORANGLE:
    case PCD_CHECKWEAPON:
    case PCD_SETWEAPON:
-      run_pcode_func( vm, turn );
+      vm_run_builtin( vm, turn );
       break;
    case PCD_TAGSTRING:
       //UNIMPLEMENTED;
       break;
    case PCD_PUSHWORLDARRAY:
-      run_pushworldarray( vm, turn );
+      run_push_array( vm, turn, vm->world_arrays,
+         ARRAY_SIZE( vm->world_arrays ) );
       break;
    case PCD_ASSIGNWORLDARRAY:
    case PCD_ADDWORLDARRAY:
@@ -969,13 +975,15 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
    case PCD_ORWORLDARRAY:
    case PCD_LSWORLDARRAY:
    case PCD_RSWORLDARRAY:
-      run_updateworldarray( vm, turn );
-      break;
    case PCD_INCWORLDARRAY:
    case PCD_DECWORLDARRAY:
-      UNIMPLEMENTED;
+      run_update_array( vm, turn, vm->world_arrays,
+         ARRAY_SIZE( vm->world_arrays ) );
       break;
    case PCD_PUSHGLOBALARRAY:
+      run_push_array( vm, turn, vm->global_arrays,
+         ARRAY_SIZE( vm->global_arrays ) );
+      break;
    case PCD_ASSIGNGLOBALARRAY:
    case PCD_ADDGLOBALARRAY:
    case PCD_SUBGLOBALARRAY:
@@ -989,7 +997,8 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
    case PCD_RSGLOBALARRAY:
    case PCD_INCGLOBALARRAY:
    case PCD_DECGLOBALARRAY:
-      UNIMPLEMENTED;
+      run_update_array( vm, turn, vm->global_arrays,
+         ARRAY_SIZE( vm->global_arrays ) );
       break;
    case PCD_SETMARINEWEAPON:
    case PCD_SETACTORPROPERTY:
@@ -1003,7 +1012,7 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
    case PCD_STRLEN:
    case PCD_SETHUDSIZE:
    case PCD_GETCVAR:
-      run_pcode_func( vm, turn );
+      vm_run_builtin( vm, turn );
       break;
    case PCD_CASEGOTOSORTED:
       UNIMPLEMENTED;
@@ -1014,7 +1023,7 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
    case PCD_GETACTORANGLE:
    case PCD_GETSECTORFLOORZ:
    case PCD_GETSECTORCEILINGZ:
-      run_pcode_func( vm, turn );
+      vm_run_builtin( vm, turn );
       break;
    case PCD_LSPEC5RESULT:
       vm_run_lspec( vm, turn );
@@ -1060,7 +1069,7 @@ void vm_run_instruction( struct vm* vm, struct turn* turn ) {
    case PCD_UNMORPHACTOR:
    case PCD_GETPLAYERINPUT:
    case PCD_CLASSIFYACTOR:
-      run_pcode_func( vm, turn );
+      vm_run_builtin( vm, turn );
       break;
    case PCD_CALLFUNC:
       vm_run_callfunc( vm, turn );
@@ -1220,6 +1229,19 @@ static void check_div_by_zero( struct vm* vm, struct turn* turn,
    }
 }
 
+/**
+ * The number of map variables a module has is only known when it is loaded,
+ * so the index of a map variable is checked when the instruction runs.
+ */
+static void check_map_var( struct vm* vm, struct turn* turn, i32 index ) {
+   if ( index >= turn->module->num_vars ) {
+      v_diag( vm, DIAG_FATALERR,
+         "script %d attempted to access a non-existent map variable "
+         "(index of variable is %d)", turn->script->script->number, index );
+      v_bail( vm );
+   }
+}
+
 static i32* get_script_var( struct vm* vm, struct turn* turn, i32 index ) {
    if ( vm->call_stack != NULL ) {
       return &vm->call_stack->locals[ index ];
@@ -1251,151 +1273,170 @@ static i32* get_element( struct vm* vm, struct turn* turn, i32* array_data,
 }
 
 /**
- * Implements the following instructions:
- * - PCD_ASSIGNWORLDARRAY
- * - PCD_ADDWORLDARRAY
- * - PCD_SUBWORLDARRAY
+ * The following functions return a variable that is about to be written. The
+ * write is recorded when the virtual machine tracks writes.
  */
-static void run_updateworldarray( struct vm* vm, struct turn* turn ) {
-   // Get off the stack the element index and the value to store in the
-   // element. The value is at the top of the stack, followed by the element
-   // index.
-   i32 value = pop( vm, turn );
-   i32 index = pop( vm, turn );
-   i32 array_index = turn->ip[ 0 ];
-   struct vector* vector = get_world_vector( vm, array_index );
-   if ( vector ) {
-      extend_array_if_out_of_bounds( vector, index );
-      // Access the element and store the value in the element.
-      struct vector_result result = vector_get( vector, index );
-      switch ( result.err ) {
-      case VECTORGETERR_NONE:
-         {
-            i32* element = result.element;
-            // Prevent division by zero.
-            switch ( turn->opcode ) {
-            case PCD_DIVWORLDARRAY:
-            case PCD_MODWORLDARRAY:
-               if ( value == 0 ) {
-                  v_diag( vm, DIAG_ERR,
-                     "division by zero in script %d",
-                     turn->script->script->number );
-                  v_bail( vm );
-               }
-               break;
-            default:
-               break;
-            }
-            switch ( turn->opcode ) {
-            case PCD_ASSIGNWORLDARRAY: *element = value; break;
-            case PCD_ADDWORLDARRAY: *element += value; break;
-            case PCD_SUBWORLDARRAY: *element -= value; break;
-            case PCD_MULWORLDARRAY: *element *= value; break;
-            case PCD_DIVWORLDARRAY: *element /= value; break;
-            case PCD_MODWORLDARRAY: *element %= value; break;
-            case PCD_ANDWORLDARRAY: *element &= value; break;
-            case PCD_EORWORLDARRAY: *element ^= value; break;
-            case PCD_ORWORLDARRAY:  *element |= value; break;
-            case PCD_LSWORLDARRAY:  *element <<= value; break;
-            case PCD_RSWORLDARRAY:  *element >>= value; break;
-            default:
-               UNREACHABLE();
-            }
-         }
-         break;
-      default:
-         UNREACHABLE();
-      }
-   }
-   else {
-      v_diag( vm, DIAG_ERR,
-         "script %d attempted to assign to a non-existant array "
-         "(index of array is %d)", turn->script->script->number, array_index );
-      turn->script->state = SCRIPTSTATE_TERMINATED;
+static i32* write_world_var( struct vm* vm, i32 index ) {
+   record_write( vm, vm->world_region, index );
+   return &vm->world_vars[ index ];
+}
+
+static i32* write_global_var( struct vm* vm, i32 index ) {
+   record_write( vm, vm->global_region, index );
+   return &vm->global_vars[ index ];
+}
+
+static i32* write_map_var( struct vm* vm, struct turn* turn, i32 index ) {
+   check_map_var( vm, turn, index );
+   record_write( vm, turn->module->map_var_regions[ index ], 0 );
+   return turn->module->map_vars[ index ];
+}
+
+static i32* write_map_element( struct vm* vm, struct turn* turn, i32 index,
+   i32 element ) {
+   record_write( vm, turn->module->map_var_regions[ index ], element );
+   return &turn->module->map_vars[ index ][ element ];
+}
+
+static void record_write( struct vm* vm, struct dirty_region* region,
+   isize index ) {
+   if ( region != NULL && ( region->pages[ index >> DIRTY_PAGE_SHIFT ] &
+      vm->dirty_flags ) != vm->dirty_flags ) {
+      vm_record_page( vm, region, index >> DIRTY_PAGE_SHIFT );
    }
-   ++turn->ip;
 }
 
 /**
- * Retrieves a world array, represented by a vector. If a world array with the
- * specified index does not exist, NULL is returned.
+ * Implements the PCD_PUSHWORLDARRAY and PCD_PUSHGLOBALARRAY instructions. An
+ * element that was never written is zero, like in the ZDoom virtual machine.
  */
-static struct vector* get_world_vector( struct vm* vm, i32 index ) {
-   if ( index >= 0 && index < ARRAY_SIZE( vm->world_arrays ) ) {
-      return &vm->world_arrays[ index ];
-   }
-   else {
-      return NULL;
+static void run_push_array( struct vm* vm, struct turn* turn,
+   struct sparse_array* arrays, isize num_arrays ) {
+   i32 index = pop( vm, turn );
+   struct sparse_array* array = get_array( vm, turn, arrays, num_arrays );
+   if ( array != NULL ) {
+      push( turn, sparse_get( array, ( u32 ) index ) );
    }
+   // Move past the array index argument.
+   ++turn->ip;
 }
 
 /**
- * Extends the vector if index is outside its range.
+ * Implements the instructions that write an element of a world or global
+ * array. Any index is valid, negative ones included. Only the page of the
+ * written element is allocated, so a large index costs no more than a small
+ * one.
  */
-static void extend_array_if_out_of_bounds( struct vector* vector, i32 index ) {
-   const i32 required_capacity = index + 1;
-   if ( vector->capacity < required_capacity ) {
-      const i32 old_capacity = vector->capacity;
-      // In user code, for sequentially increasing indexes, like in a for loop,
-      // having to extend the array every time a larger index is used is
-      // wasteful. To reduce allocations, extra elements are allocated after
-      // the index.
-      enum { EXTRA_ELEMENTS = 1000 };
-      const i32 new_capacity = required_capacity + EXTRA_ELEMENTS;
-      switch ( vector_grow( vector, new_capacity ) ) {
-      case VECTORGROWERR_NONE:
-         // Initialize any new space with zeroes.
-         for ( isize i = 0; i < new_capacity - old_capacity; ++i ) {
-            struct vector_result result = vector_get( vector,
-               old_capacity + i );
-            switch ( result.err ) {
-            case VECTORGETERR_NONE:
-               {
-                  const i32 zero = 0;
-                  memcpy( result.element, &zero, sizeof( zero ) );
-               }
-               break;
-            default:
-               UNREACHABLE();
-            }
-         }
-         break;
-      default:
-         break;
-      }
+static void run_update_array( struct vm* vm, struct turn* turn,
+   struct sparse_array* arrays, isize num_arrays ) {
+   // The value to store in the element is at the top of the stack, followed
+   // by the element index. Incrementing and decrementing take no value.
+   i32 value = 0;
+   switch ( turn->opcode ) {
+   case PCD_INCWORLDARRAY:
+   case PCD_DECWORLDARRAY:
+   case PCD_INCGLOBALARRAY:
+   case PCD_DECGLOBALARRAY:
+      break;
+   default:
+      value = pop( vm, turn );
+   }
+   i32 index = pop( vm, turn );
+   struct sparse_array* array = get_array( vm, turn, arrays, num_arrays );
+   if ( array == NULL ) {
+      ++turn->ip;
+      return;
+   }
+   // Looking up the element allocates its page and marks the page as
+   // written, so check the divisor first.
+   switch ( turn->opcode ) {
+   case PCD_DIVWORLDARRAY:
+   case PCD_DIVGLOBALARRAY:
+   case PCD_MODWORLDARRAY:
+   case PCD_MODGLOBALARRAY:
+      check_div_by_zero( vm, turn, value );
+      break;
+   default:
+      break;
    }
+   i32* element = sparse_at( array, ( u32 ) index );
+   switch ( turn->opcode ) {
+   case PCD_ASSIGNWORLDARRAY:
+   case PCD_ASSIGNGLOBALARRAY:
+      *element = value;
+      break;
+   case PCD_ADDWORLDARRAY:
+   case PCD_ADDGLOBALARRAY:
+      *element += value;
+      break;
+   case PCD_SUBWORLDARRAY:
+   case PCD_SUBGLOBALARRAY:
+      *element -= value;
+      break;
+   case PCD_MULWORLDARRAY:
+   case PCD_MULGLOBALARRAY:
+      *element *= value;
+      break;
+   case PCD_DIVWORLDARRAY:
+   case PCD_DIVGLOBALARRAY:
+      *element /= value;
+      break;
+   case PCD_MODWORLDARRAY:
+   case PCD_MODGLOBALARRAY:
+      *element %= value;
+      break;
+   case PCD_ANDWORLDARRAY:
+   case PCD_ANDGLOBALARRAY:
+      *element &= value;
+      break;
+   case PCD_EORWORLDARRAY:
+   case PCD_EORGLOBALARRAY:
+      *element ^= value;
+      break;
+   case PCD_ORWORLDARRAY:
+   case PCD_ORGLOBALARRAY:
+      *element |= value;
+      break;
+   case PCD_LSWORLDARRAY:
+   case PCD_LSGLOBALARRAY:
+      *element <<= value;
+      break;
+   case PCD_RSWORLDARRAY:
+   case PCD_RSGLOBALARRAY:
+      *element >>= value;
+      break;
+   case PCD_INCWORLDARRAY:
+   case PCD_INCGLOBALARRAY:
+      ++*element;
+      break;
+   case PCD_DECWORLDARRAY:
+   case PCD_DECGLOBALARRAY:
+      --*element;
+      break;
+   default:
+      UNREACHABLE();
+   }
+   ++turn->ip;
 }
 
 /**
- * Implements the PCD_PUSHWORLDARRAY instruction.
+ * Retrieves the array named by the argument of the instruction. When there is
+ * no such array, the script is terminated and NULL is returned.
  */
-static void run_pushworldarray( struct vm* vm, struct turn* turn ) {
-   // PCD_PUSHWORLDARRAY instruction takes one argument off the stack. This
-   // argument is an index of the element to retrieve from the array.
-   i32 index = pop( vm, turn );
+static struct sparse_array* get_array( struct vm* vm, struct turn* turn,
+   struct sparse_array* arrays, isize num_arrays ) {
    i32 array_index = turn->ip[ 0 ];
-   struct vector* vector = get_world_vector( vm, array_index );
-   if ( vector ) {
-      struct vector_result result = vector_get( vector, index );
-      if ( result.err == VECTORGETERR_NONE ) {
-         i32 value;
-         memcpy( &value, result.element, sizeof( value ) );
-         push( turn, value );
-      }
-      else {
-         // On an out-of-bounds condition, return a 0 just like the ZDoom
-         // virtual machine.
-         push( turn, 0 );
-      }
+   if ( array_index >= 0 && array_index < num_arrays ) {
+      return &arrays[ array_index ];
    }
    else {
       v_diag( vm, DIAG_ERR,
-         "script %d attempted to pop non-existant array "
-         "(index of array is %d)", turn->script->script->number, array_index );
+         "script %d attempted to access a non-existant array "
+         "(index of array is %d)", turn->script->script->number,
+         array_index );
       turn->script->state = SCRIPTSTATE_TERMINATED;
+      return NULL;
    }
-   // Move past the array index argument.
-   ++turn->ip;
 }
 
 static void decode_opcode( struct vm* vm, struct turn* turn ) {
@@ -1429,6 +1470,22 @@ i32 vm_pop( struct vm* vm, struct turn* turn ) {
    return pop( vm, turn );
 }
 
+/**
+ * Removes the specified number of values from the top of the stack and
+ * returns them, in the order they were pushed. The values are not copied, so
+ * they are only valid until the next push.
+ */
+i32* vm_pop_args( struct vm* vm, struct turn* turn, i32 count ) {
+   if ( vm_get_stack_size( turn ) < count ) {
+      v_diag( vm, DIAG_FATALERR,
+         "not enough arguments on the stack (need %d arguments, but only %d "
+         "given)", count, ( i32 ) vm_get_stack_size( turn ) );
+      v_bail( vm );
+   }
+   turn->stack -= count;
+   return turn->stack;
+}
+
 static i32 pop( struct vm* vm, struct turn* turn ) {
    if ( turn->stack == turn->stack_start ) {
       v_diag( vm, DIAG_FATALERR,
@@ -1439,15 +1496,17 @@ static i32 pop( struct vm* vm, struct turn* turn ) {
    return *turn->stack;
 }
 
+/**
+ * Few scripts are waited on, so the list of waiting scripts is only allocated
+ * when a script starts waiting.
+ */
 void add_waiting_script( struct instance* script,
    struct instance* waiting_script ) {
-   if ( script->waiting ) {
-      script->waiting_tail->next_waiting = waiting_script;
-   }
-   else {
-      script->waiting = waiting_script;
+   if ( script->waiting == NULL ) {
+      script->waiting = mem_alloc( sizeof( *script->waiting ) );
+      list_init( script->waiting );
    }
-   script->waiting_tail = waiting_script;
+   list_append( script->waiting, waiting_script );
 }
 
 static void delay_current_script( struct vm* vm, struct turn* turn,
@@ -1458,8 +1517,9 @@ static void delay_current_script( struct vm* vm, struct turn* turn,
    turn->script->resume_time = vm->tics + amount;
 }
 
-static void push_random_number( struct turn* turn, i32 min, i32 max ) {
-   push( turn, min + rand() % ( max - min + 1 ) );
+static void push_random_number( struct vm* vm, struct turn* turn, i32 min,
+   i32 max ) {
+   push( turn, rng_between( &vm->rng, min, max ) );
 }
 
 static void run_call( struct vm* vm, struct turn* turn ) {
@@ -1489,7 +1549,12 @@ static void run_call( struct vm* vm, struct turn* turn ) {
 
 struct func* vm_find_func( struct vm* vm, struct module* module, i32 index ) {
    if ( index >= 0 && index < module->func_table.size ) {
-      return module->func_table.linked_entries[ index ];
+      struct func* func = module->func_table.linked_entries[ index ];
+      // Imported functions are resolved on their first call.
+      if ( func == NULL ) {
+         func = vm_link_func( vm, module, index );
+      }
+      return func;
    }
    else {
       v_diag( vm, DIAG_FATALERR,
@@ -1536,212 +1601,6 @@ static struct call* pop_call( struct vm* vm ) {
    }
 }
 
-static void run_pcode_func( struct vm* vm, struct turn* turn ) {
-   enum opcode opcode = translate_direct_opcode( turn->opcode );
-   bool direct_opcode = ( opcode != turn->opcode );
-   const struct pcode_func* func = get_pcode_func( opcode );
-   if ( func == NULL ) {
-      v_diag( vm, DIAG_INTERNAL | DIAG_ERR,
-         "opcode %d missing a builtin function entry", opcode );
-      v_bail( vm );
-   }
-   if ( ! ( direct_opcode || vm_get_stack_size( turn ) >= func->num_args ) ) {
-      v_diag( vm, DIAG_FATALERR,
-         "not enough arguments on the stack for `%s()` (need %d arguments, "
-         "but only %d given)", func->name, func->num_args,
-         vm_get_stack_size( turn ) );
-      v_bail( vm );
-   }
-   v_diag( vm, DIAG_DBG | DIAG_WARN | DIAG_MULTI_PART,
-      "ignoring %s", func->name );
-   if ( func->num_args > 0 ) {
-      v_diag_more( vm, "( " );
-      for ( i32 i = 0; i < func->num_args; ++i ) {
-         i32 arg;
-         if ( direct_opcode ) {
-            memcpy( &arg, turn->ip + i * sizeof( arg ), sizeof( arg ) );
-         }
-         else {
-            arg = turn->stack[ i - func->num_args ];
-         }
-         v_diag_more( vm, "%d", arg );
-         if ( i + 1 < func->num_args ) {
-            v_diag_more( vm, ", " );
-         }
-      }
-      v_diag_more( vm, " )\n" );
-   }
-   else {
-      v_diag_more( vm, "()\n" );
-   }
-   if ( direct_opcode ) {
-      turn->ip += sizeof( i32 ) * func->num_args;
-   }
-   else {
-      turn->stack -= func->num_args;
-   }
-   if ( func->returns_value ) {
-      push( turn, 0 );
-   }
-}
-
-static enum opcode translate_direct_opcode( enum opcode opcode ) {
-   switch ( opcode ) {
-   case PCD_THINGCOUNTDIRECT: return PCD_THINGCOUNT;
-   case PCD_TAGWAITDIRECT: return PCD_TAGWAIT;
-   case PCD_POLYWAITDIRECT: return PCD_POLYWAIT;
-   case PCD_CHANGEFLOORDIRECT: return PCD_CHANGEFLOOR;
-   case PCD_CHANGECEILINGDIRECT: return PCD_CHANGECEILING;
-   case PCD_SCRIPTWAITDIRECT: return PCD_SCRIPTWAIT;
-   case PCD_CONSOLECOMMANDDIRECT: return PCD_CONSOLECOMMAND;
-   case PCD_SETGRAVITYDIRECT: return PCD_SETGRAVITY;
-   case PCD_SETAIRCONTROLDIRECT: return PCD_SETAIRCONTROL;
-   case PCD_GIVEINVENTORYDIRECT: return PCD_GIVEINVENTORY;
-   case PCD_TAKEINVENTORYDIRECT: return PCD_TAKEINVENTORY;
-   case PCD_CHECKINVENTORYDIRECT: return PCD_CHECKINVENTORY;
-   case PCD_SPAWNDIRECT: return PCD_SPAWN;
-   case PCD_SPAWNSPOTDIRECT: return PCD_SPAWNSPOT;
-   case PCD_SETMUSICDIRECT: return PCD_SETMUSIC;
-   case PCD_LOCALSETMUSICDIRECT: return PCD_LOCALSETMUSIC;
-   case PCD_SETFONTDIRECT: return PCD_SETFONT;
-   default: return opcode;
-   }
-}
-
-static const struct pcode_func* get_pcode_func( enum opcode opcode ) {
-   static const struct pcode_func table[] = {
-      { "ThingCount", PCD_THINGCOUNT, 2, true },
-      { "TagWait", PCD_TAGWAIT, 1, false },
-      { "PolyWait", PCD_POLYWAIT, 1, false },
-      { "ChangeFloor", PCD_CHANGEFLOOR, 2, false },
-      { "ChangeCeiling", PCD_CHANGECEILING, 2, false },
-      { "LineSide", PCD_LINESIDE, 0, true },
-      { "ClearLineSpecial", PCD_CLEARLINESPECIAL, 0, false },
-      { "PlayerCount", PCD_PLAYERCOUNT, 0, true },
-      { "GameType", PCD_GAMETYPE, 0, true },
-      { "GameSkill", PCD_GAMESKILL, 0, true },
-      { "Timer", PCD_TIMER, 0, true },
-      { "SectorSound", PCD_SECTORSOUND, 2, false },
-      { "AmbientSound", PCD_AMBIENTSOUND, 2, false },
-      { "SoundSequence", PCD_SOUNDSEQUENCE, 1, false },
-      { "SetLineTexture", PCD_SETLINETEXTURE, 4, false },
-      { "SetLineBlocking", PCD_SETLINEBLOCKING, 2, false },
-      { "SetLineSpecial", PCD_SETLINESPECIAL, 6, false },
-      { "ThingSound", PCD_THINGSOUND, 3, false },
-      { "ActivatorSound", PCD_ACTIVATORSOUND, 2, false },
-      { "LocalAmbientSound", PCD_LOCALAMBIENTSOUND, 2, false },
-      { "SetLineMonsterBlocking", PCD_SETLINEMONSTERBLOCKING, 2, false },
-      { "IsNetworkGame", PCD_ISMULTIPLAYER, 0, true },
-      { "PlayerTeam", PCD_PLAYERTEAM, 0, true },
-      { "PlayerHealth", PCD_PLAYERHEALTH, 0, true },
-      { "PlayerArmorPoints", PCD_PLAYERARMORPOINTS, 0, true },
-      { "PlayerFrags", PCD_PLAYERFRAGS, 0, true },
-      { "BlueTeamCount", PCD_BLUETEAMCOUNT, 0, true },
-      { "RedTeamCount", PCD_REDTEAMCOUNT, 0, true },
-      { "BlueTeamScore", PCD_BLUETEAMSCORE, 0, true },
-      { "RedTeamScore", PCD_REDTEAMSCORE, 0, true },
-      { "IsOneFlagCTF", PCD_ISONEFLAGCTF, 0, true },
-      { "GetInvasionWave", PCD_GETINVASIONWAVE, 0, true },
-      { "GetInvasionState", PCD_GETINVASIONSTATE, 0, true },
-      { "Music_Change", PCD_MUSICCHANGE, 2, false },
-      { "ConsoleCommand", PCD_CONSOLECOMMAND, 3, false },
-      { "SinglePlayer", PCD_SINGLEPLAYER, 0, true },
-      { "FixedMul", PCD_FIXEDMUL, 2, true },
-      { "FixedDiv", PCD_FIXEDDIV, 2, true },
-      { "SetGravity", PCD_SETGRAVITY, 1, false },
-      { "SetAirControl", PCD_SETAIRCONTROL, 1, false },
-      { "ClearInventory", PCD_CLEARINVENTORY, 0, false },
-      { "GiveInventory", PCD_GIVEINVENTORY, 2, false },
-      { "TakeInventory", PCD_TAKEINVENTORY, 2, false },
-      { "CheckInventory", PCD_CHECKINVENTORY, 1, true },
-      { "Spawn", PCD_SPAWN, 6, true },
-      { "SpawnSpot", PCD_SPAWNSPOT, 4, true },
-      { "SetMusic", PCD_SETMUSIC, 3, false },
-      { "LocalSetMusic", PCD_LOCALSETMUSIC, 3, false },
-      { "SetFont", PCD_SETFONT, 1, false },
-      { "SetThingSpecial", PCD_SETTHINGSPECIAL, 7, false },
-      { "FadeTo", PCD_FADETO, 5, false },
-      { "FadeRange", PCD_FADERANGE, 9, false },
-      { "CancelFade", PCD_CANCELFADE, 0, false },
-      { "PlayMovie", PCD_PLAYMOVIE, 1, true },
-      { "SetFloorTrigger", PCD_SETFLOORTRIGGER, 8, false },
-      { "SetCeilingTrigger", PCD_SETCEILINGTRIGGER, 8, false },
-      { "GetActorX", PCD_GETACTORX, 1, true },
-      { "GetActorY", PCD_GETACTORY, 1, true },
-      { "GetActorZ", PCD_GETACTORZ, 1, true },
-      { "Sin", PCD_SIN, 1, true },
-      { "Cos", PCD_COS, 1, true },
-      { "VectorAngle", PCD_VECTORANGLE, 2, true },
-      { "CheckWeapon", PCD_CHECKWEAPON, 1, true },
-      { "SetWeapon", PCD_SETWEAPON, 1, true },
-      { "SetMarineWeapon", PCD_SETMARINEWEAPON, 2, false },
-      { "SetActorProperty", PCD_SETACTORPROPERTY, 3, false },
-      { "GetActorProperty", PCD_GETACTORPROPERTY, 2, true },
-      { "PlayerNumber", PCD_PLAYERNUMBER, 0, true },
-      { "ActivatorTID", PCD_ACTIVATORTID, 0, true },
-      { "SetMarineSprite", PCD_SETMARINESPRITE, 2, false },
-      { "GetScreenWidth", PCD_GETSCREENWIDTH, 0, true },
-      { "GetScreenHeight", PCD_GETSCREENHEIGHT, 0, true },
-      { "Thing_Projectile2", PCD_THINGPROJECTILE2, 7, false },
-      { "StrLen", PCD_STRLEN, 1, true },
-      { "SetHudSize", PCD_SETHUDSIZE, 3, false },
-      { "GetCVar", PCD_GETCVAR, 1, true },
-      { "SetResultValue", PCD_SETRESULTVALUE, 1, false },
-      { "GetLineRowOffset", PCD_GETLINEROWOFFSET, 0, true },
-      { "GetActorFloorZ", PCD_GETACTORFLOORZ, 1, true },
-      { "GetActorAngle", PCD_GETACTORANGLE, 1, true },
-      { "GetSectorFloorZ", PCD_GETSECTORFLOORZ, 3, true },
-      { "GetSectorCeilingZ", PCD_GETSECTORCEILINGZ, 3, true },
-      { "GetSigilPieces", PCD_GETSIGILPIECES, 0, true },
-      { "GetLevelInfo", PCD_GETLEVELINFO, 1, true },
-      { "ChangeSky", PCD_CHANGESKY, 2, false },
-      { "PlayerInGame", PCD_PLAYERINGAME, 1, true },
-      { "PlayerIsBot", PCD_PLAYERISBOT, 1, true },
-      { "SetCameraToTexture", PCD_SETCAMERATOTEXTURE, 3, false },
-      { "GetAmmoCapacity", PCD_GETAMMOCAPACITY, 1, true },
-      { "SetAmmoCapacity", PCD_SETAMMOCAPACITY, 2, false },
-      { "SetActorAngle", PCD_SETACTORANGLE, 2, false },
-      { "SpawnProjectile", PCD_SPAWNPROJECTILE, 7, false },
-      { "GetSectorLightLevel", PCD_GETSECTORLIGHTLEVEL, 1, true },
-      { "GetActorCeilingZ", PCD_GETACTORCEILINGZ, 1, true },
-      { "SetActorPosition", PCD_SETACTORPOSITION, 5, true },
-      { "ClearActorInventory", PCD_CLEARACTORINVENTORY, 1, false },
-      { "GiveActorInventory", PCD_GIVEACTORINVENTORY, 3, false },
-      { "TakeActorInventory", PCD_TAKEACTORINVENTORY, 3, false },
-      { "CheckActorInventory", PCD_CHECKACTORINVENTORY, 2, true },
-      { "ThingCountName", PCD_THINGCOUNTNAME, 2, true },
-      { "SpawnSpotFacing", PCD_SPAWNSPOTFACING, 3, true },
-      { "PlayerClass", PCD_PLAYERCLASS, 1, true },
-      { "GetPlayerInfo", PCD_GETPLAYERINFO, 2, true },
-      { "ChangeLevel", PCD_CHANGELEVEL, 4, false },
-      { "SectorDamage", PCD_SECTORDAMAGE, 5, false },
-      { "ReplaceTextures", PCD_REPLACETEXTURES, 3, false },
-      { "GetActorPitch", PCD_GETACTORPITCH, 1, true },
-      { "SetActorPitch", PCD_SETACTORPITCH, 2, false },
-      { "SetActorState", PCD_SETACTORSTATE, 3, true },
-      { "Thing_Damage2", PCD_THINGDAMAGE2, 3, true },
-      { "UseInventory", PCD_USEINVENTORY, 1, true },
-      { "UseActorInventory", PCD_USEACTORINVENTORY, 2, true },
-      { "CheckActorCeilingTexture", PCD_CHECKACTORCEILINGTEXTURE, 2, true },
-      { "CheckActorFloorTexture", PCD_CHECKACTORFLOORTEXTURE, 2, true },
-      { "GetActorLightLevel", PCD_GETACTORLIGHTLEVEL, 1, true },
-      { "SetMugShotState", PCD_SETMUGSHOTSTATE, 1, false },
-      { "ThingCountSector", PCD_THINGCOUNTSECTOR, 3, true },
-      { "ThingCountNameSector", PCD_THINGCOUNTNAMESECTOR, 3, true },
-      { "CheckPlayerCamera", PCD_CHECKPLAYERCAMERA, 1, true },
-      { "MorphActor", PCD_MORPHACTOR, 7, true },
-      { "UnMorphActor", PCD_UNMORPHACTOR, 2, true },
-      { "GetPlayerInput", PCD_GETPLAYERINPUT, 2, true },
-      { "ClassifyActor", PCD_CLASSIFYACTOR, 1, true },
-   };
-   for ( isize i = 0; i < ARRAY_SIZE( table ); ++i ) {
-      if ( table[ i ].opcode == opcode ) {
-         return &table[ i ];
-      }
-   }
-   return NULL;
-}
-
 /**
  * Returns the number of values currently in the values stack.
  */
@@ -6,15 +6,21 @@
 #include <setjmp.h>
 #include <string.h>
 #include <ctype.h>
+#include <pthread.h>
 
 #include "common/misc.h"
 #include "common/mem.h"
 #include "common/str.h"
 #include "common/list.h"
+#include "common/fs.h"
 #include "vm.h"
+#include "wad.h"
 #include "debug.h"
 
 enum { ORIGINAL_SCRIPT_VAR_LIMIT = 20 };
+// Largest number of map variables a module can have. It only guards against
+// malformed chunks asking for a huge table.
+enum { MAX_MAP_VARS = 1 << 16 };
 
 struct chunk {
    char name[ 5 ];
@@ -47,6 +53,38 @@ struct chunk {
    } type;
 };
 
+// A file from which a module was loaded. Used to detect when the same file,
+// or a file with identical contents, is loaded more than once.
+struct module_image {
+   struct fileid fileid;
+   struct module* module;
+   u64 content_hash;
+   bool has_fileid;
+   bool hashed;
+};
+
+// Modules waiting to be read by the load workers.
+struct load_queue {
+   struct vm* vm;
+   struct queued_module {
+      struct module* module;
+      bool parsed;
+   }* modules;
+   isize size;
+   isize next;
+   pthread_mutex_t mutex;
+};
+
+struct load_worker {
+   struct load_queue* queue;
+   struct mem_arena* arena;
+   // Messages of the worker, shown once the worker is done.
+   struct output output;
+   pthread_t thread;
+   bool started;
+   bool failed;
+};
+
 struct func_entry {
    u8 num_param;
    u8 size;
@@ -55,15 +93,44 @@ struct func_entry {
    i32 offset;
 };
 
-static void load_module( struct vm* vm, const char* name, const char* path );
+static void load_module( struct vm* vm, const char* name, const char* path,
+   bool lazy );
+static bool load_wad( struct vm* vm, const char* path, bool lazy );
+static struct module* load_wad_library( struct vm* vm, const char* name );
+static bool add_module( struct vm* vm, const char* name, const char* path,
+   const u8* data, isize size, struct fileid* fileid, bool has_fileid,
+   bool lazy );
+static struct module* find_module_by_fileid( struct vm* vm,
+   struct fileid* fileid );
+static struct module* find_identical_module( struct vm* vm, const u8* data,
+   isize size );
+static u64 get_image_hash( struct module_image* image );
+static void share_module( struct vm* vm, struct module* module,
+   const char* name, const char* path );
+static void add_image( struct vm* vm, struct module* module,
+   struct fileid* fileid, bool has_fileid );
 static struct module* alloc_module( void );
+static bool has_open_scripts( struct object* object );
+static void read_module( struct vm* vm, struct module* module );
+static void parse_module( struct vm* vm, struct module* module );
+static void read_modules_in_parallel( struct vm* vm );
+static void* run_load_worker( void* data );
+static struct queued_module* take_queued_module( struct load_queue* queue );
+static struct module* get_loaded_module( struct vm* vm,
+   struct module* module );
 static void read_chunks( struct vm* vm, struct object* object );
+static i32 count_map_vars( struct vm* vm, struct object* object );
+static i32 count_imported_vars( struct chunk* chunk );
+static i32 count_imported_arrays( struct chunk* chunk );
+static i32 max_var_count( i32 count, i32 first_var, i32 num_vars );
+static i32 read_chunk_i32( struct chunk* chunk, i32 index );
+static struct var* get_var( struct vm* vm, struct object* object, i32 index );
 static void init_chunk( struct chunk* chunk, const u8* data );
 static bool find_chunk( struct object* object, struct chunk* chunk, int type );
 static int get_chunk_type( const char* name );
 static void load_sptr( struct vm* vm, struct object* object,
    struct chunk* chunk );
-static void set_script_type( struct script* script, i32 type );
+static void set_script_type( struct script_info* info, i32 type );
 static void load_strl( struct vm* vm, struct object* object,
    struct chunk* chunk );
 static void load_aray( struct vm* vm, struct object* object,
@@ -77,9 +144,10 @@ static void load_func( struct vm* vm, struct object* object,
 static void init_func( struct func* func );
 static void load_sary_fary( struct vm* vm, struct object* object,
    struct chunk* chunk );
-static struct script* get_script( struct vm* vm, i32 number );
 static struct script* get_script_in_module( struct vm* vm,
    struct module* module, i32 number );
+static struct func* get_func_in_module( struct vm* vm, struct module* module,
+   i32 index );
 static void load_sflg( struct vm* vm, struct object* object,
    struct chunk* chunk );
 static void load_svct( struct vm* vm, struct object* object,
@@ -98,7 +166,11 @@ static void load_aimp( struct vm* vm, struct object* object,
    struct chunk* chunk );
 static void load_fnam( struct vm* vm, struct object* object,
    struct chunk* chunk );
+static void build_lookup_tables( struct module* module );
+static void register_module( struct vm* vm, struct module* module );
+static void register_scripts( struct vm* vm, struct module* module );
 static void link_modules( struct vm* vm );
+static void link_module( struct vm* vm, struct module* module );
 static void do_imports( struct vm* vm, struct module* module );
 static struct module* find_module( struct vm* vm, const char* name );
 static void link_vars( struct vm* vm, struct module* module );
@@ -110,32 +182,144 @@ static struct func* find_func_in_module( struct module* module,
 
 /**
  * Loads all the modules that will be executed. This includes the main module
- * and libraries.
+ * and libraries. A library without OPEN scripts is only registered here; its
+ * chunks are read when one of its variables, functions, or scripts is first
+ * needed. When more than one thread is requested, every module is instead
+ * read up front, in parallel.
  */
 void vm_load_modules( struct vm* vm ) {
    //read_modules( vm );
    //link_modules( vm );
+   bool parallel = ( vm->options->jobs > 1 );
    struct list_iter i;
    list_iterate( &vm->options->modules, &i );
    while ( ! list_end( &i ) ) {
       struct module_arg* arg = list_data( &i );
-      load_module( vm, arg->name, arg->path );
+      if ( arg->data != NULL ) {
+         add_module( vm, arg->name, NULL, arg->data, arg->size, NULL, false,
+            ! parallel );
+      }
+      // The main module can also come from a WAD archive.
+      else if ( ! ( arg->name[ 0 ] == '\0' &&
+         load_wad( vm, arg->path, ! parallel ) ) ) {
+         load_module( vm, arg->name, arg->path, ! parallel );
+      }
       list_next( &i );
    }
+   if ( parallel ) {
+      read_modules_in_parallel( vm );
+   }
    link_modules( vm );
    //load_libs( vm );
    //vm_load_module( vm, "", vm->options->object_file );
 }
 
-static void load_module( struct vm* vm, const char* name, const char* path ) {
-   struct module* module = alloc_module();
-   strncpy( module->name, name, sizeof( module->name ) );
+static void load_module( struct vm* vm, const char* name, const char* path,
+   bool lazy ) {
+   // The same file can be passed more than once, possibly through different
+   // paths. Load it only once.
+   struct fileid fileid;
+   bool has_fileid = c_read_fileid( &fileid, path );
+   if ( has_fileid ) {
+      struct module* loaded_module = find_module_by_fileid( vm, &fileid );
+      if ( loaded_module != NULL ) {
+         share_module( vm, loaded_module, name, path );
+         return;
+      }
+   }
 
+   // The image cache needs to hash the whole file anyway, so map the file
+   // instead of copying it.
+   bool use_cache = ( vm->options->cache_dir != NULL );
    struct file_request request;
    vm_init_file_request( &request );
-   vm_load_file( &request, path );
+   if ( use_cache ) {
+      vm_map_file( &request, path );
+   }
+   else {
+      vm_load_file( &request, path );
+   }
+   if ( request.err != FILEREQUESTERR_NONE ) {
+      v_diag( vm, DIAG_FATALERR,
+         "failed to load module file: %s", path );
+      v_bail( vm );
+   }
+
+   if ( ! add_module( vm, name, path, request.data, request.size, &fileid,
+      has_fileid, lazy ) ) {
+      vm_free_file( &request );
+   }
+}
+
+/**
+ * Loads the main module from the BEHAVIOR lump of a WAD archive. Libraries
+ * are then loaded from the archive as they are imported. Returns false if the
+ * file is not a WAD archive.
+ */
+static bool load_wad( struct vm* vm, const char* path, bool lazy ) {
+   struct wad* wad = mem_alloc( sizeof( *wad ) );
+   if ( ! wad_open( wad, path ) ) {
+      mem_free( wad );
+      return false;
+   }
+   struct wad_lump* lump = wad_find_behavior( wad, vm->options->map_name );
+   if ( lump == NULL ) {
+      if ( vm->options->map_name != NULL ) {
+         v_diag( vm, DIAG_FATALERR,
+            "%s: map `%s` not found or has no BEHAVIOR lump", path,
+            vm->options->map_name );
+      }
+      else {
+         v_diag( vm, DIAG_FATALERR,
+            "%s: no BEHAVIOR lump found", path );
+      }
+      v_bail( vm );
+   }
+   // The archive stays mapped, because the modules point into it.
+   vm->wad = wad;
+   add_module( vm, "", path, lump->data, lump->size, NULL, false, lazy );
+   return true;
+}
+
+/**
+ * Loads a library from the WAD archive of the main module. Returns NULL if
+ * there is no such library.
+ */
+static struct module* load_wad_library( struct vm* vm, const char* name ) {
+   if ( vm->wad == NULL ) {
+      return NULL;
+   }
+   struct wad_lump* lump = wad_find_library( vm->wad, name );
+   if ( lump == NULL ) {
+      return NULL;
+   }
+   v_diag( vm, DIAG_DBG, "loading library `%s` from %s", name,
+      vm->wad->path );
+   // The library is found while linking, so it cannot be left for the
+   // parallel loader. Read it now if it has OPEN scripts.
+   add_module( vm, name, vm->wad->path, lump->data, lump->size, NULL, false,
+      true );
+   return find_module( vm, name );
+}
+
+/**
+ * Creates a module from an object and registers it. The data is used in
+ * place, not copied. Returns false if the data is not used: either a loaded
+ * module has the same contents, or the object is not valid.
+ */
+static bool add_module( struct vm* vm, const char* name, const char* path,
+   const u8* data, isize size, struct fileid* fileid, bool has_fileid,
+   bool lazy ) {
+   // A different file can still have the same contents as a loaded one.
+   struct module* loaded_module = find_identical_module( vm, data, size );
+   if ( loaded_module != NULL ) {
+      share_module( vm, loaded_module, name, path );
+      return false;
+   }
 
-   vm_init_object( &module->object, request.data, request.size );
+   struct module* module = alloc_module();
+   strncpy( module->name, name, sizeof( module->name ) );
+   vm_init_object( &module->object, data, size );
    module->object.module = module;
 
    //vm->object = object;
@@ -145,18 +329,103 @@ static void load_module( struct vm* vm, const char* name, const char* path ) {
    case FORMAT_LITTLE_E:
       break;
    default:
-      printf( "error: unsupported format\n" );
-      return;
+      v_diag( vm, DIAG_ERR, "unsupported format" );
+      return false;
    }
-   read_chunks( vm, &module->object );
+   module->path = path;
+   register_module( vm, module );
+   add_image( vm, module, fileid, has_fileid );
+   // The main module and libraries with OPEN scripts run right away, so they
+   // need to be read now.
+   if ( lazy && ( name[ 0 ] == '\0' ||
+      has_open_scripts( &module->object ) ) ) {
+      read_module( vm, module );
+   }
+   return true;
+}
 
-   list_append( &vm->modules, module );
+static struct module* find_module_by_fileid( struct vm* vm,
+   struct fileid* fileid ) {
+   struct list_iter i;
+   list_iterate( &vm->images, &i );
+   while ( ! list_end( &i ) ) {
+      struct module_image* image = list_data( &i );
+      if ( image->has_fileid && c_same_fileid( &image->fileid, fileid ) ) {
+         return image->module;
+      }
+      list_next( &i );
+   }
+   return NULL;
+}
+
+/**
+ * Finds a loaded module whose object file has the same contents as the
+ * specified data. Contents are hashed only when the sizes match.
+ */
+static struct module* find_identical_module( struct vm* vm, const u8* data,
+   isize size ) {
+   bool hashed = false;
+   u64 hash = 0;
+   struct list_iter i;
+   list_iterate( &vm->images, &i );
+   while ( ! list_end( &i ) ) {
+      struct module_image* image = list_data( &i );
+      struct object* object = &image->module->object;
+      if ( object->size == size ) {
+         if ( ! hashed ) {
+            hash = hash_calc_data( data, size );
+            hashed = true;
+         }
+         if ( get_image_hash( image ) == hash &&
+            memcmp( object->data, data, size ) == 0 ) {
+            return image->module;
+         }
+      }
+      list_next( &i );
+   }
+   return NULL;
+}
+
+static u64 get_image_hash( struct module_image* image ) {
+   if ( ! image->hashed ) {
+      image->content_hash = hash_calc_data( image->module->object.data,
+         image->module->object.size );
+      image->hashed = true;
+   }
+   return image->content_hash;
+}
+
+/**
+ * Makes an already loaded module available under another name, instead of
+ * loading a second copy of it.
+ */
+static void share_module( struct vm* vm, struct module* module,
+   const char* name, const char* path ) {
+   v_diag( vm, DIAG_DBG, "%s is already loaded as module `%s`",
+      ( path != NULL ) ? path : name, module->name );
+   if ( strcmp( module->name, name ) != 0 ) {
+      hash_add_name( &vm->module_table, name, module );
+   }
+}
+
+static void add_image( struct vm* vm, struct module* module,
+   struct fileid* fileid, bool has_fileid ) {
+   struct module_image* image = mem_alloc( sizeof( *image ) );
+   if ( has_fileid ) {
+      image->fileid = *fileid;
+   }
+   image->module = module;
+   image->content_hash = 0;
+   image->has_fileid = has_fileid;
+   image->hashed = false;
+   list_append( &vm->images, image );
 }
 
 void vm_init_file_request( struct file_request* request ) {
    request->err = FILEREQUESTERR_NONE;
    request->data = NULL;
    request->size = 0;
+   request->mapped = false;
 }
 
 void vm_load_file( struct file_request* request, const char* path ) {
@@ -175,24 +444,246 @@ void vm_load_file( struct file_request* request, const char* path ) {
    fclose( fh );
 }
 
+/**
+ * Like vm_load_file(), but the contents of the file are mapped into memory
+ * instead of being copied. The mapping stays valid for the rest of the run.
+ */
+void vm_map_file( struct file_request* request, const char* path ) {
+   if ( ! fs_map_file( path, &request->mapping ) ) {
+      request->err = FILEREQUESTERR_OPEN;
+      return;
+   }
+   request->data = ( u8* ) request->mapping.data;
+   request->size = request->mapping.size;
+   request->mapped = true;
+}
+
+/**
+ * Frees the contents of a file loaded by vm_load_file() or vm_map_file().
+ */
+void vm_free_file( struct file_request* request ) {
+   if ( request->mapped ) {
+      fs_unmap_file( &request->mapping );
+   }
+   else if ( request->data != NULL ) {
+      mem_free( request->data );
+   }
+   request->data = NULL;
+   request->size = 0;
+   request->mapped = false;
+}
+
 static struct module* alloc_module( void ) {
    struct module* module = mem_alloc( sizeof( *module ) );
    module->name[ 0 ] = '\0';
    list_init( &module->imports );
    list_init( &module->scripts );
    list_init( &module->strings );
-   list_init( &module->waiting_scripts );
-   for ( isize i = 0; i < ARRAY_SIZE( module->vars ); ++i ) {
-      module->vars[ i ].name = "";
-      module->vars[ i ].elements = &module->vars[ i ].value;
-      module->vars[ i ].value = 0;
-      module->vars[ i ].size = 0;
-      module->vars[ i ].array = false;
-      module->vars[ i ].imported = false;
-      module->map_vars[ i ] = &module->vars[ i ];
-   }
+   vm_init_run_queue( &module->waiting_scripts );
+   module->vars = NULL;
+   module->var_values = NULL;
+   module->map_vars = NULL;
+   module->map_var_sizes = NULL;
+   module->map_var_regions = NULL;
+   module->num_vars = 0;
    module->func_table.entries = NULL;
+   module->func_table.names = NULL;
+   module->func_table.linked_entries = NULL;
    module->func_table.size = 0;
+   hash_init( &module->script_table );
+   hash_init( &module->var_table );
+   hash_init( &module->func_name_table );
+   module->path = "";
+   module->loaded = false;
+   module->linked = false;
+   return module;
+}
+
+/**
+ * Tells whether the module has any OPEN scripts. Only the script pointers are
+ * looked at, so this is much cheaper than reading the module. If the script
+ * pointers cannot be examined, the module is assumed to have OPEN scripts.
+ */
+static bool has_open_scripts( struct object* object ) {
+   struct chunk chunk;
+   if ( ! find_chunk( object, &chunk, CHUNK_SPTR ) ) {
+      return false;
+   }
+   if ( ! object->indirect_format ) {
+      return true;
+   }
+   struct {
+      short number;
+      char type;
+      char num_param;
+      int offset;
+   } entry;
+   for ( int size = 0; size + ( int ) sizeof( entry ) <= chunk.size;
+      size += sizeof( entry ) ) {
+      memcpy( &entry, chunk.data + size, sizeof( entry ) );
+      if ( entry.type == SCRIPTTYPE_OPEN ) {
+         return true;
+      }
+   }
+   return false;
+}
+
+/**
+ * Reads the chunks of a registered module, either from the object file or
+ * from the image cache.
+ */
+static void read_module( struct vm* vm, struct module* module ) {
+   parse_module( vm, module );
+   register_scripts( vm, module );
+   module->loaded = true;
+}
+
+/**
+ * Fills in the module from its object. Only the module itself is modified,
+ * so different modules can be parsed at the same time.
+ */
+static void parse_module( struct vm* vm, struct module* module ) {
+   // The cache is keyed by path, so modules read from memory are not cached.
+   bool use_cache = ( vm->options->cache_dir != NULL && module->path != NULL );
+   if ( ! ( use_cache &&
+      vm_restore_cached_module( vm, module, module->path ) ) ) {
+      read_chunks( vm, &module->object );
+      if ( use_cache ) {
+         vm_cache_module( vm, module, module->path );
+      }
+   }
+   build_lookup_tables( module );
+}
+
+/**
+ * Reads every registered module that has not been read yet. The modules are
+ * parsed by worker threads; the scripts are then registered on this thread in
+ * the original order, so the result is the same as reading the modules one by
+ * one.
+ */
+static void read_modules_in_parallel( struct vm* vm ) {
+   struct load_queue queue;
+   queue.vm = vm;
+   queue.modules = mem_alloc( sizeof( queue.modules[ 0 ] ) *
+      list_size( &vm->modules ) );
+   queue.size = 0;
+   queue.next = 0;
+   struct list_iter i;
+   list_iterate( &vm->modules, &i );
+   while ( ! list_end( &i ) ) {
+      struct module* module = list_data( &i );
+      if ( ! module->loaded ) {
+         queue.modules[ queue.size ].module = module;
+         queue.modules[ queue.size ].parsed = false;
+         ++queue.size;
+      }
+      list_next( &i );
+   }
+   pthread_mutex_init( &queue.mutex, NULL );
+
+   isize num_workers = vm->options->jobs;
+   if ( num_workers > queue.size ) {
+      num_workers = queue.size;
+   }
+   struct load_worker* workers = mem_alloc( sizeof( workers[ 0 ] ) *
+      num_workers );
+   for ( isize k = 0; k < num_workers; ++k ) {
+      workers[ k ].queue = &queue;
+      workers[ k ].arena = NULL;
+      workers[ k ].failed = false;
+      workers[ k ].started = ( pthread_create( &workers[ k ].thread, NULL,
+         run_load_worker, &workers[ k ] ) == 0 );
+   }
+   bool failed = false;
+   for ( isize k = 0; k < num_workers; ++k ) {
+      if ( workers[ k ].started ) {
+         pthread_join( workers[ k ].thread, NULL );
+         mem_attach( workers[ k ].arena );
+         isize length;
+         const char* text = output_captured( &workers[ k ].output, &length );
+         if ( length > 0 ) {
+            output_write( &vm->output, text, length );
+         }
+         output_deinit( &workers[ k ].output );
+         if ( workers[ k ].failed ) {
+            failed = true;
+         }
+      }
+   }
+   pthread_mutex_destroy( &queue.mutex );
+   mem_free( workers );
+   // The error has already been reported by the worker.
+   if ( failed ) {
+      mem_free( queue.modules );
+      v_bail( vm );
+   }
+
+   for ( isize k = 0; k < queue.size; ++k ) {
+      struct module* module = queue.modules[ k ].module;
+      // If no worker could be started, read the module here instead.
+      if ( ! queue.modules[ k ].parsed ) {
+         parse_module( vm, module );
+      }
+      register_scripts( vm, module );
+      module->loaded = true;
+   }
+   mem_free( queue.modules );
+}
+
+static void* run_load_worker( void* data ) {
+   struct load_worker* worker = data;
+   mem_init();
+   // Parsing only uses the options of the virtual machine and the bail point,
+   // so the worker uses a copy of the virtual machine with its own bail point.
+   // Messages are captured and shown after the workers are done, so the
+   // workers do not write to the output of the virtual machine at the same
+   // time. The copy is allocated, so the changes made to it before an error
+   // are kept after returning from setjmp().
+   jmp_buf bail;
+   struct vm* vm = mem_alloc( sizeof( *vm ) );
+   *vm = *worker->queue->vm;
+   vm->bail = &bail;
+   output_init_memory( &vm->output );
+   if ( setjmp( bail ) == 0 ) {
+      struct queued_module* queued_module;
+      while ( ( queued_module = take_queued_module( worker->queue ) ) ) {
+         parse_module( vm, queued_module->module );
+         queued_module->parsed = true;
+      }
+   }
+   else {
+      worker->failed = true;
+   }
+   worker->output = vm->output;
+   mem_free( vm );
+   worker->arena = mem_detach();
+   return NULL;
+}
+
+static struct queued_module* take_queued_module( struct load_queue* queue ) {
+   struct queued_module* queued_module = NULL;
+   pthread_mutex_lock( &queue->mutex );
+   if ( queue->next < queue->size ) {
+      queued_module = &queue->modules[ queue->next ];
+      ++queue->next;
+   }
+   pthread_mutex_unlock( &queue->mutex );
+   return queued_module;
+}
+
+/**
+ * Returns the module, reading and linking it first if it has not been read
+ * yet. Only called once the modules are being linked, so every module the
+ * library might import is already registered.
+ */
+static struct module* get_loaded_module( struct vm* vm,
+   struct module* module ) {
+   if ( ! module->loaded ) {
+      v_diag( vm, DIAG_DBG, "reading library `%s` on first use",
+         module->name );
+      read_module( vm, module );
+      link_module( vm, module );
+   }
    return module;
 }
 
@@ -202,15 +693,25 @@ void vm_init_object( struct object* object, const u8* data, int size ) {
       int offset;
    };
    struct header header;
-   memcpy( &header, data, sizeof( header ) );
    object->data = data;
    object->size = size;
    object->format = FORMAT_UNKNOWN;
-   object->chunk_offset = header.offset;
+   object->chunk_offset = 0;
    object->chunk_end = size;
-   object->dummy_offset = header.offset;
+   object->dummy_offset = 0;
    object->indirect_format = false;
    object->small_code = false;
+   // Data that is too short, or that points outside itself, is not an object
+   // file.
+   if ( size < ( int ) sizeof( header ) ) {
+      return;
+   }
+   memcpy( &header, data, sizeof( header ) );
+   if ( header.offset < ( int ) sizeof( int ) * 2 || header.offset > size ) {
+      return;
+   }
+   object->chunk_offset = header.offset;
+   object->dummy_offset = header.offset;
    if ( memcmp( header.id, "ACSE", 4 ) == 0 ) {
       object->format = FORMAT_BIG_E;
    }
@@ -226,6 +727,12 @@ void vm_init_object( struct object* object, const u8* data, int size ) {
             sizeof( int ) );
          object->indirect_format = true;
          object->chunk_end = header.offset - ( sizeof( int ) * 2 );
+         // The chunks must lie between the header and the indirect header.
+         if ( object->chunk_offset < ( int ) sizeof( int ) * 2 ||
+            object->chunk_offset > object->chunk_end ) {
+            object->format = FORMAT_UNKNOWN;
+            return;
+         }
       }
       else {
          object->format = FORMAT_ZERO;
@@ -236,7 +743,38 @@ void vm_init_object( struct object* object, const u8* data, int size ) {
    }
 }
 
+/**
+ * Allocates the tables of map variables of a module, with every variable
+ * being an unnamed scalar set to zero.
+ */
+void vm_alloc_map_vars( struct module* module, i32 num_vars ) {
+   // Allocate at least one entry, so the tables are never NULL.
+   isize size = num_vars > 0 ? num_vars : 1;
+   module->vars = mem_alloc( sizeof( module->vars[ 0 ] ) * size );
+   module->var_values = mem_alloc( sizeof( module->var_values[ 0 ] ) * size );
+   module->map_vars = mem_alloc( sizeof( module->map_vars[ 0 ] ) * size );
+   module->map_var_sizes = mem_alloc(
+      sizeof( module->map_var_sizes[ 0 ] ) * size );
+   module->map_var_regions = mem_alloc(
+      sizeof( module->map_var_regions[ 0 ] ) * size );
+   module->num_vars = num_vars;
+   for ( isize i = 0; i < num_vars; ++i ) {
+      module->vars[ i ].name = "";
+      module->vars[ i ].elements = &module->var_values[ i ];
+      module->vars[ i ].region = NULL;
+      module->vars[ i ].link = &module->vars[ i ];
+      module->vars[ i ].size = 0;
+      module->vars[ i ].array = false;
+      module->vars[ i ].imported = false;
+      module->var_values[ i ] = 0;
+      module->map_vars[ i ] = &module->var_values[ i ];
+      module->map_var_sizes[ i ] = 0;
+      module->map_var_regions[ i ] = NULL;
+   }
+}
+
 static void read_chunks( struct vm* vm, struct object* object ) {
+   vm_alloc_map_vars( object->module, count_map_vars( vm, object ) );
    const u8* data = object->data + object->chunk_offset;
    // Load independent chunks.
    // Load scripts and function chunks first before reading the chunks that
@@ -310,6 +848,147 @@ static void read_chunks( struct vm* vm, struct object* object ) {
    }
 }
 
+/**
+ * Finds the number of map variables of a module: one past the largest index
+ * of a variable that a chunk defines, initializes, exports, or imports.
+ */
+static i32 count_map_vars( struct vm* vm, struct object* object ) {
+   i32 num_vars = 0;
+   bool library = false;
+   const u8* data = object->data + object->chunk_offset;
+   while ( data < object->data + object->size ) {
+      struct chunk chunk;
+      init_chunk( &chunk, data );
+      i32 count = 0;
+      switch ( chunk.type ) {
+      case CHUNK_ARAY:
+         // Each entry holds the index and the size of an array.
+         for ( i32 i = 0; i < chunk.size / ( i32 ) sizeof( i32 ) / 2; ++i ) {
+            count = max_var_count( count, read_chunk_i32( &chunk, i * 2 ),
+               1 );
+         }
+         break;
+      case CHUNK_MINI:
+         // The index of the first variable, followed by the initial values.
+         if ( chunk.size >= ( i32 ) sizeof( i32 ) ) {
+            count = max_var_count( count, read_chunk_i32( &chunk, 0 ),
+               chunk.size / ( i32 ) sizeof( i32 ) - 1 );
+         }
+         break;
+      case CHUNK_AINI:
+         // The index of the array, followed by the initial values.
+         if ( chunk.size >= ( i32 ) sizeof( i32 ) ) {
+            count = max_var_count( count, read_chunk_i32( &chunk, 0 ), 1 );
+         }
+         break;
+      case CHUNK_MEXP:
+         // The number of exported variables, followed by their names.
+         if ( chunk.size >= ( i32 ) sizeof( i32 ) ) {
+            count = max_var_count( count, 0, read_chunk_i32( &chunk, 0 ) );
+         }
+         break;
+      case CHUNK_MIMP:
+         count = count_imported_vars( &chunk );
+         break;
+      case CHUNK_AIMP:
+         count = count_imported_arrays( &chunk );
+         break;
+      case CHUNK_ALIB:
+         library = true;
+         break;
+      default:
+         break;
+      }
+      if ( count > MAX_MAP_VARS ) {
+         v_diag( vm, DIAG_FATALERR,
+            "%s chunk requires too many map variables (limit is %d)",
+            chunk.name, MAX_MAP_VARS );
+         v_bail( vm );
+      }
+      if ( count > num_vars ) {
+         num_vars = count;
+      }
+      data += sizeof( int ) * 2 + chunk.size;
+   }
+   if ( ! library && num_vars < DEFAULT_MAP_VARS ) {
+      num_vars = DEFAULT_MAP_VARS;
+   }
+   return num_vars;
+}
+
+static i32 count_imported_vars( struct chunk* chunk ) {
+   i32 count = 0;
+   i32 pos = 0;
+   while ( chunk->size - pos > ( i32 ) sizeof( i32 ) ) {
+      i32 index = 0;
+      memcpy( &index, chunk->data + pos, sizeof( index ) );
+      pos += sizeof( index );
+      const u8* data_nul = memchr( chunk->data + pos, '\0',
+         chunk->size - pos );
+      if ( data_nul == NULL ) {
+         break;
+      }
+      pos = ( i32 ) ( data_nul - chunk->data ) + 1;
+      count = max_var_count( count, index, 1 );
+   }
+   return count;
+}
+
+static i32 count_imported_arrays( struct chunk* chunk ) {
+   i32 count = 0;
+   i32 pos = sizeof( i32 ); // Skip the number of imported arrays.
+   while ( chunk->size - pos > ( i32 ) sizeof( i32 ) * 2 ) {
+      i32 index = 0;
+      memcpy( &index, chunk->data + pos, sizeof( index ) );
+      pos += sizeof( index ) * 2; // Skip the size of the array.
+      const u8* data_nul = memchr( chunk->data + pos, '\0',
+         chunk->size - pos );
+      if ( data_nul == NULL ) {
+         break;
+      }
+      pos = ( i32 ) ( data_nul - chunk->data ) + 1;
+      count = max_var_count( count, index, 1 );
+   }
+   return count;
+}
+
+/**
+ * Returns the larger of the count and the count that includes the variables
+ * from the first one. A count that does not fit is returned as one past the
+ * limit. Invalid indexes are left for the loaders to report.
+ */
+static i32 max_var_count( i32 count, i32 first_var, i32 num_vars ) {
+   if ( first_var < 0 || num_vars <= 0 ) {
+      return count;
+   }
+   i64 end = ( i64 ) first_var + num_vars;
+   if ( end > MAX_MAP_VARS ) {
+      end = MAX_MAP_VARS + 1;
+   }
+   return ( end > count ) ? ( i32 ) end : count;
+}
+
+static i32 read_chunk_i32( struct chunk* chunk, i32 index ) {
+   i32 value = 0;
+   memcpy( &value, chunk->data + index * sizeof( value ), sizeof( value ) );
+   return value;
+}
+
+/**
+ * Retrieves the map variable that a chunk refers to, making sure the index is
+ * one of a variable of the module.
+ */
+static struct var* get_var( struct vm* vm, struct object* object,
+   i32 index ) {
+   if ( index >= 0 && index < object->module->num_vars ) {
+      return &object->module->vars[ index ];
+   }
+   v_diag( vm, DIAG_FATALERR,
+      "invalid map variable requested (index of variable is %d)", index );
+   v_bail( vm );
+   return NULL;
+}
+
 static void init_chunk( struct chunk* chunk, const u8* data ) {
    memcpy( chunk->name, data, 4 );
    chunk->name[ 4 ] = 0;
@@ -391,17 +1070,20 @@ static void load_sptr( struct vm* vm, struct object* object,
          size += sizeof( entry );
 
          struct script* script = mem_alloc( sizeof( *script ) );
-         script->name = null;
          script->number = entry.number;
-         set_script_type( script, entry.type );
-         script->flags = 0;
          script->start = entry.offset;
-         script->arrays = NULL;
          script->num_vars = ORIGINAL_SCRIPT_VAR_LIMIT;
          script->num_arrays = 0;
+         script->arrays = NULL;
          script->total_array_size = 0;
-         list_append( &vm->scripts, script );
+         script->info = mem_alloc( sizeof( *script->info ) );
+         script->info->name = null;
+         set_script_type( script->info, entry.type );
+         script->info->flags = 0;
          list_append( &object->module->scripts, script );
+         // When two scripts have the same number, the first one is used.
+         hash_add_number( &object->module->script_table, script->number,
+            script );
 /*
          number = ( int ) entry.number;
          type = ( int ) entry.type;
@@ -418,7 +1100,7 @@ static void load_sptr( struct vm* vm, struct object* object,
    }
 }
 
-static void set_script_type( struct script* script, i32 type ) {
+static void set_script_type( struct script_info* info, i32 type ) {
    switch ( type ) {
    case SCRIPTTYPE_CLOSED:
    case SCRIPTTYPE_OPEN:
@@ -436,10 +1118,10 @@ static void set_script_type( struct script* script, i32 type ) {
    case SCRIPTTYPE_EVENT:
    case SCRIPTTYPE_KILL:
    case SCRIPTTYPE_REOPEN:
-      script->type = type;
+      info->type = type;
       break;
    default:
-      script->type = SCRIPTTYPE_UNKNOWN;
+      info->type = SCRIPTTYPE_UNKNOWN;
    }
 }
 
@@ -486,12 +1168,18 @@ static void load_aray( struct vm* vm, struct object* object,
    i32 count = chunk->size / sizeof( entry );
    for ( i32 i = 0; i < count; ++i ) {
       memcpy( &entry, chunk->data + i * sizeof( entry ), sizeof( entry ) );
-      object->module->vars[ entry.index ].size = entry.size;
-      object->module->vars[ entry.index ].array = true;
-      object->module->vars[ entry.index ].elements = mem_alloc(
-         sizeof( *object->module->vars[ entry.index ].elements ) * entry.size );
-      memset( object->module->vars[ entry.index ].elements, 0,
-         sizeof( *object->module->vars[ entry.index ].elements ) * entry.size );
+      struct var* var = get_var( vm, object, entry.index );
+      if ( entry.size < 0 ) {
+         v_diag( vm, DIAG_FATALERR,
+            "map array %d has a negative size (%d)", entry.index,
+            entry.size );
+         v_bail( vm );
+      }
+      var->size = entry.size;
+      var->array = true;
+      var->elements = mem_alloc( sizeof( var->elements[ 0 ] ) *
+         ( entry.size > 0 ? entry.size : 1 ) );
+      memset( var->elements, 0, sizeof( var->elements[ 0 ] ) * entry.size );
    }
 }
 
@@ -528,9 +1216,20 @@ static void load_aini( struct vm* vm, struct object* object,
    struct chunk* chunk ) {
    int index = 0;
    memcpy( &index, chunk->data, sizeof( index ) );
-   // TODO: Make sure the index refers to an array.
-   memcpy( object->module->vars[ index ].elements, chunk->data + sizeof( index ),
-      chunk->size - sizeof( int ) );
+   struct var* var = get_var( vm, object, index );
+   // Only the elements the array has are initialized.
+   isize count = ( chunk->size - ( i32 ) sizeof( index ) ) /
+      ( i32 ) sizeof( var->elements[ 0 ] );
+   if ( ! var->array ) {
+      count = 0;
+   }
+   else if ( count > var->size ) {
+      count = var->size;
+   }
+   if ( count > 0 ) {
+      memcpy( var->elements, chunk->data + sizeof( index ),
+         sizeof( var->elements[ 0 ] ) * count );
+   }
 }
 
 static void load_func( struct vm* vm, struct object* object,
@@ -538,6 +1237,7 @@ static void load_func( struct vm* vm, struct object* object,
    struct func_entry entry;
    isize total_funcs = chunk->size / sizeof( entry );
    struct func* entries = mem_alloc( sizeof( entries[ 0 ] ) * total_funcs );
+   const char** names = mem_alloc( sizeof( names[ 0 ] ) * total_funcs );
    int data_left = chunk->size % sizeof( entry );
    if ( data_left > 0 ) {
       v_diag( vm, DIAG_WARN,
@@ -550,7 +1250,7 @@ static void load_func( struct vm* vm, struct object* object,
       init_func( &entries[ i ] );
       memcpy( &entry, chunk->data + ( i * sizeof( entry ) ), sizeof( entry ) );
       entries[ i ].module = object->module;
-      entries[ i ].name = "";
+      names[ i ] = "";
       entries[ i ].params = entry.num_param;
       entries[ i ].local_size = entry.size;
       entries[ i ].start = entry.offset;
@@ -575,6 +1275,7 @@ static void load_func( struct vm* vm, struct object* object,
    }
 
    object->module->func_table.entries = entries;
+   object->module->func_table.names = names;
    object->module->func_table.size = total_funcs;
 }
 
@@ -610,28 +1311,25 @@ static void load_sary_fary( struct vm* vm, struct object* object,
       total_size += size;
    }
    if ( chunk->type == CHUNK_FARY ) {
-      struct func* func = vm_find_func( vm, object->module, index );
+      struct func* func = get_func_in_module( vm, object->module, index );
       func->arrays = arrays;
       func->num_arrays = total_arrays;
       func->total_array_size = total_size;
    }
    else {
-      struct script* script = get_script( vm, index );
+      struct script* script = get_script_in_module( vm, object->module,
+         index );
       script->arrays = arrays;
       script->num_arrays = total_arrays;
       script->total_array_size = total_size;
    }
 }
 
-static struct script* get_script( struct vm* vm, i32 number ) {
-   struct list_iter i;
-   list_iterate( &vm->scripts, &i );
-   while ( ! list_end( &i ) ) {
-      struct script* script = list_data( &i );
-      if ( script->number == number ) {
-         return script;
-      }
-      list_next( &i );
+static struct script* get_script_in_module( struct vm* vm,
+   struct module* module, i32 number ) {
+   struct script* script = hash_find_number( &module->script_table, number );
+   if ( script != NULL ) {
+      return script;
    }
    v_diag( vm, DIAG_FATALERR,
       "invalid script requested (number of script is %d) ", number );
@@ -639,19 +1337,17 @@ static struct script* get_script( struct vm* vm, i32 number ) {
    return NULL;
 }
 
-static struct script* get_script_in_module( struct vm* vm,
-   struct module* module, i32 number ) {
-   struct list_iter i;
-   list_iterate( &module->scripts, &i );
-   while ( ! list_end( &i ) ) {
-      struct script* script = list_data( &i );
-      if ( script->number == number ) {
-         return script;
-      }
-      list_next( &i );
+/**
+ * Returns a function of a module that is being read. The functions are not
+ * linked yet, so the function is taken from the entries of the module.
+ */
+static struct func* get_func_in_module( struct vm* vm, struct module* module,
+   i32 index ) {
+   if ( index >= 0 && index < module->func_table.size ) {
+      return &module->func_table.entries[ index ];
    }
    v_diag( vm, DIAG_FATALERR,
-      "invalid script requested (number of script is %d) ", number );
+      "invalid function requested (index of function is %d)", index );
    v_bail( vm );
    return NULL;
 }
@@ -667,13 +1363,14 @@ static void load_sflg( struct vm* vm, struct object* object,
       //expect_chunk_data( viewer, chunk, chunk->data + pos, sizeof( entry ) );
       memcpy( &entry, chunk->data + pos, sizeof( entry ) );
       pos += sizeof( entry );
-      struct script* script = get_script( vm, entry.number );
+      struct script* script = get_script_in_module( vm, object->module,
+         entry.number );
       //printf( "script=%hd ", entry.number );
       u16 flags = entry.flags;
       //printf( "flags=" );
       // Net flag.
       if ( flags & FLAG_NET ) {
-         script->flags |= FLAG_NET;
+         script->info->flags |= FLAG_NET;
          flags &= ~FLAG_NET;
          //printf( "net(0x%x)", FLAG_NET );
          if ( flags != 0 ) {
@@ -682,7 +1379,7 @@ static void load_sflg( struct vm* vm, struct object* object,
       }
       // Clientside flag.
       if ( flags & FLAG_CLIENTSIDE ) {
-         script->flags |= FLAG_CLIENTSIDE;
+         script->info->flags |= FLAG_CLIENTSIDE;
          flags &= ~FLAG_CLIENTSIDE;
          //printf( "clientside(0x%x)", FLAG_CLIENTSIDE );
          if ( flags != 0 ) {
@@ -691,7 +1388,7 @@ static void load_sflg( struct vm* vm, struct object* object,
       }
       // Unknown flags.
       if ( flags != 0 ) {
-         printf( "unknown(0x%x)", flags );
+         output_printf( &vm->output, "unknown(0x%x)", flags );
       }
       //printf( "\n" );
    }
@@ -708,7 +1405,8 @@ static void load_svct( struct vm* vm, struct object* object,
       //expect_chunk_data( viewer, chunk, chunk->data + pos, sizeof( entry ) ); 
       memcpy( &entry, chunk->data + pos, sizeof( entry ) );
       pos += sizeof( entry );
-      struct script* script = get_script( vm, entry.number );
+      struct script* script = get_script_in_module( vm, object->module,
+         entry.number );
       script->num_vars = entry.size;
       //printf( "script=%hd new-size=%hd\n", entry.number, entry.size );
    }
@@ -734,7 +1432,7 @@ static void load_snam( struct vm* vm, struct object* object,
       i32 number = INITIAL_NAMEDSCRIPT_NUMBER - i;
       struct script* script = get_script_in_module( vm, object->module,
          number );
-      script->name = read_chunk_string( vm, chunk, offset );
+      script->info->name = read_chunk_string( vm, chunk, offset );
    }
 }
 
@@ -800,7 +1498,7 @@ static void load_mexp( struct vm* vm, struct object* object,
       data += sizeof( offset );
       //expect_chunk_offset_in_chunk( viewer, chunk, offset );
       const char* name = read_chunk_string( vm, chunk, offset );
-      object->module->vars[ i ].name = name;
+      get_var( vm, object, i )->name = name;
 /*
       if ( viewer->attr_format ) {
          printf( "index=%d offset=%d name=%s\n", i, offset,
@@ -837,8 +1535,9 @@ static void load_mimp( struct vm* vm, struct object* object,
       }
       //printf( "index=%d name=%s\n", index, ( const char* ) data );
       const char* name = ( const char* ) data;
-      object->module->vars[ index ].name = name;
-      object->module->vars[ index ].imported = true;
+      struct var* var = get_var( vm, object, index );
+      var->name = name;
+      var->imported = true;
       i32 data_size = ( data_nul - data ) + 1; // Plus one for NUL character.
       data += data_size;
       data_left -= data_size;
@@ -865,9 +1564,10 @@ static void load_aimp( struct vm* vm, struct object* object,
       data += sizeof( size );
       const char* name = read_chunk_string( vm, chunk,
          ( i32 ) ( data - chunk->data ) );
-      object->module->vars[ index ].name = name;
-      object->module->vars[ index ].imported = true;
-      object->module->vars[ index ].array = true;
+      struct var* var = get_var( vm, object, ( i32 ) index );
+      var->name = name;
+      var->imported = true;
+      var->array = true;
 /*
       if ( viewer->attr_format ) {
          printf( "index=%u name=%s size=%u\n", index, string, size );
@@ -918,30 +1618,91 @@ static void load_fnam( struct vm* vm, struct object* object,
       }
       
       const char* name = ( const char* ) ( chunk->data + offset );
-      object->module->func_table.entries[ i ].name = name;
+      object->module->func_table.names[ i ] = name;
       //printf( "function=%d offset=%d name=%s\n", i, offset,
       //   ( const char* ) ( chunk->data + offset ) );
    }
 }
 
+/**
+ * Builds the tables used to look up the variables and functions exported by a
+ * module. Imported variables and functions, and unnamed ones, are not
+ * exported.
+ */
+static void build_lookup_tables( struct module* module ) {
+   for ( isize i = 0; i < module->num_vars; ++i ) {
+      struct var* var = &module->vars[ i ];
+      if ( ! var->imported && var->name[ 0 ] != '\0' ) {
+         hash_add_name( &module->var_table, var->name, var );
+      }
+   }
+   for ( isize i = 0; i < module->func_table.size; ++i ) {
+      struct func* func = &module->func_table.entries[ i ];
+      const char* name = module->func_table.names[ i ];
+      if ( ! func->imported && name[ 0 ] != '\0' ) {
+         hash_add_name( &module->func_name_table, name, func );
+      }
+   }
+}
+
+/**
+ * Makes the module visible to the rest of the virtual machine. When two
+ * modules have the same name, lookups find the one registered first.
+ */
+static void register_module( struct vm* vm, struct module* module ) {
+   list_append( &vm->modules, module );
+   hash_add_name( &vm->module_table, module->name, module );
+}
+
+/**
+ * Makes the scripts of a module visible to the rest of the virtual machine.
+ * When two scripts have the same number, lookups find the one registered
+ * first.
+ */
+static void register_scripts( struct vm* vm, struct module* module ) {
+   struct list_iter i;
+   list_iterate( &module->scripts, &i );
+   while ( ! list_end( &i ) ) {
+      struct script* script = list_data( &i );
+      list_append( &vm->scripts, script );
+      hash_add_number( &vm->script_table, script->number, script );
+      list_next( &i );
+   }
+}
+
 static void link_modules( struct vm* vm ) {
    struct list_iter i;
    list_iterate( &vm->modules, &i );
    while ( ! list_end( &i ) ) {
       struct module* module = list_data( &i );
-      do_imports( vm, module );
-      link_vars( vm, module );
-      link_funcs( vm, module );
+      if ( module->loaded ) {
+         link_module( vm, module );
+      }
       list_next( &i );
    }
 }
 
+static void link_module( struct vm* vm, struct module* module ) {
+   // A library read on first use while linking another module is linked
+   // right away, so skip it when the list of modules reaches it.
+   if ( module->linked ) {
+      return;
+   }
+   module->linked = true;
+   do_imports( vm, module );
+   link_vars( vm, module );
+   link_funcs( vm, module );
+}
+
 static void do_imports( struct vm* vm, struct module* module ) {
    struct list_iter i;
    list_iterate( &module->imports, &i );
    while ( ! list_end( &i ) ) {
       struct import* import = list_data( &i );
       struct module* imported_module = find_module( vm, import->module_name );
+      if ( ! imported_module ) {
+         imported_module = load_wad_library( vm, import->module_name );
+      }
       if ( ! imported_module ) {
          v_diag( vm, DIAG_FATALERR,
             "module `%s` importing an unknown module (`%s`)",
@@ -954,27 +1715,24 @@ static void do_imports( struct vm* vm, struct module* module ) {
 }
 
 static struct module* find_module( struct vm* vm, const char* name ) {
-   struct list_iter i;
-   list_iterate( &vm->modules, &i );
-   while ( ! list_end( &i ) ) {
-      struct module* module = list_data( &i );
-      if ( strcmp( name, module->name ) == 0 ) {
-         return module;
-      }
-      list_next( &i );
-   }
-   return null;
+   return hash_find_name( &vm->module_table, name );
 }
 
+/**
+ * Resolves the tables the interpreter uses to find the variables. An imported
+ * variable goes straight to the storage of the variable it is imported from.
+ */
 static void link_vars( struct vm* vm, struct module* module ) {
-   for ( isize i = 0; i < ARRAY_SIZE( module->vars ); ++i ) {
+   for ( isize i = 0; i < module->num_vars; ++i ) {
       if ( module->vars[ i ].imported ) {
          struct var* var = null;
          struct list_iter k;
          list_iterate( &module->imports, &k );
          while ( ! list_end( &k ) && var == null ) {
             struct import* import = list_data( &k );
-            var = find_var_in_module( import->module, module->vars[ i ].name );
+            var = find_var_in_module(
+               get_loaded_module( vm, import->module ),
+               module->vars[ i ].name );
             list_next( &k );
          }
          if ( var == null ) {
@@ -982,43 +1740,31 @@ static void link_vars( struct vm* vm, struct module* module ) {
                "failed to import `%s` variable", module->vars[ i ].name );
             v_bail( vm );
          }
-         module->map_vars[ i ] = var;
+         module->vars[ i ].link = var;
       }
+      struct var* var = module->vars[ i ].link;
+      module->map_vars[ i ] = var->elements;
+      module->map_var_sizes[ i ] = var->size;
    }
 }
 
 static struct var* find_var_in_module( struct module* module,
    const char* name ) {
-   for ( isize i = 0; i < ARRAY_SIZE( module->vars ); ++i ) {
-      if ( strcmp( module->vars[ i ].name, name ) == 0 ) {
-         return &module->vars[ i ];
-      }
-   }
-   return null;
+   return hash_find_name( &module->var_table, name );
 }
 
+/**
+ * Imported functions are left unresolved here. They are resolved by
+ * vm_link_func() the first time they are called, so a library that only
+ * provides functions is not read until one of them is needed.
+ */
 static void link_funcs( struct vm* vm, struct module* module ) {
    module->func_table.linked_entries = mem_alloc(
       sizeof( module->func_table.linked_entries[ 0 ] ) *
       module->func_table.size );
    for ( isize i = 0; i < module->func_table.size; ++i ) {
       if ( module->func_table.entries[ i ].imported ) {
-         struct func* func = null;
-         struct list_iter k;
-         list_iterate( &module->imports, &k );
-         while ( ! list_end( &k ) && func == null ) {
-            struct import* import = list_data( &k );
-            func = find_func_in_module( import->module,
-               module->func_table.entries[ i ].name );
-            list_next( &k );
-         }
-         if ( func == null ) {
-            v_diag( vm, DIAG_FATALERR,
-               "failed to import `%s` function",
-               module->func_table.entries[ i ].name );
-            v_bail( vm );
-         }
-         module->func_table.linked_entries[ i ] = func;
+         module->func_table.linked_entries[ i ] = NULL;
       }
       else {
          module->func_table.linked_entries[ i ] =
@@ -1027,12 +1773,99 @@ static void link_funcs( struct vm* vm, struct module* module ) {
    }
 }
 
-static struct func* find_func_in_module( struct module* module,
-   const char* name ) {
-   for ( isize i = 0; i < module->func_table.size; ++i ) {
-      if ( strcmp( module->func_table.entries[ i ].name, name ) == 0 ) {
-         return &module->func_table.entries[ i ];
+/**
+ * Resolves an imported function of a module, reading the library that
+ * provides it if needed.
+ */
+struct func* vm_link_func( struct vm* vm, struct module* module, i32 index ) {
+   struct func* func = null;
+   struct list_iter i;
+   list_iterate( &module->imports, &i );
+   while ( ! list_end( &i ) && func == null ) {
+      struct import* import = list_data( &i );
+      func = find_func_in_module( get_loaded_module( vm, import->module ),
+         module->func_table.names[ index ] );
+      list_next( &i );
+   }
+   if ( func == null ) {
+      v_diag( vm, DIAG_FATALERR,
+         "failed to import `%s` function",
+         module->func_table.names[ index ] );
+      v_bail( vm );
+   }
+   module->func_table.linked_entries[ index ] = func;
+   return func;
+}
+
+/**
+ * Reads every module that has not been read yet, and resolves every imported
+ * function that can be resolved. Afterwards, running scripts does not change
+ * the loaded modules, so they can be shared by the runs that follow, or saved
+ * and restored. A function that cannot be resolved is left for vm_link_func()
+ * to report, if it is ever called.
+ */
+void vm_link_all_modules( struct vm* vm ) {
+   struct list_iter i;
+   list_iterate( &vm->modules, &i );
+   while ( ! list_end( &i ) ) {
+      get_loaded_module( vm, list_data( &i ) );
+      list_next( &i );
+   }
+   list_iterate( &vm->modules, &i );
+   while ( ! list_end( &i ) ) {
+      struct module* module = list_data( &i );
+      for ( isize k = 0; k < module->func_table.size; ++k ) {
+         if ( module->func_table.linked_entries[ k ] == NULL ) {
+            struct list_iter m;
+            list_iterate( &module->imports, &m );
+            while ( ! list_end( &m ) &&
+               module->func_table.linked_entries[ k ] == NULL ) {
+               struct import* import = list_data( &m );
+               module->func_table.linked_entries[ k ] = find_func_in_module(
+                  import->module, module->func_table.names[ k ] );
+               list_next( &m );
+            }
+         }
       }
+      list_next( &i );
    }
-   return null;
+}
+
+/**
+ * Returns the module with the specified name, reading it first if needed, or
+ * NULL if there is no such module. The main module has an empty name.
+ */
+struct module* vm_get_module( struct vm* vm, const char* name ) {
+   struct module* module = find_module( vm, name );
+   if ( module != NULL ) {
+      module = get_loaded_module( vm, module );
+   }
+   return module;
+}
+
+/**
+ * Reads libraries that have not been read yet, in the order they were
+ * given, until one of them provides a script with the specified number.
+ */
+struct script* vm_load_script( struct vm* vm, i32 number ) {
+   struct list_iter i;
+   list_iterate( &vm->modules, &i );
+   while ( ! list_end( &i ) ) {
+      struct module* module = list_data( &i );
+      if ( ! module->loaded ) {
+         get_loaded_module( vm, module );
+         struct script* script = hash_find_number( &module->script_table,
+            number );
+         if ( script != NULL ) {
+            return script;
+         }
+      }
+      list_next( &i );
+   }
+   return NULL;
+}
+
+static struct func* find_func_in_module( struct module* module,
+   const char* name ) {
+   return hash_find_name( &module->func_name_table, name );
 }
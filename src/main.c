@@ -1,6 +1,7 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <setjmp.h>
 
 #include "common/misc.h"
@@ -10,7 +11,6 @@
 #include "vm.h"
 #include "debug.h"
 
-static void init_options( struct options* options );
 static bool read_options( struct options* options, char* argv[] );
 static char** read_named_module_arg( struct options* options, char** args );
 static void print_usage( char* path );
@@ -19,7 +19,7 @@ i32 main( i32 argc, char* argv[] ) {
    mem_init();
    i32 result = EXIT_FAILURE;
    struct options options;
-   init_options( &options );
+   vm_init_options( &options );
    if ( ! read_options( &options, argv ) ) {
       print_usage( argv[ 0 ] );
       goto deinit_memory;
@@ -39,6 +39,16 @@ i32 main( i32 argc, char* argv[] ) {
    fread( data, sizeof( char ), size, fh );
    fclose( fh );
 #endif
+   if ( options.batch_path != NULL ) {
+      if ( vm_run_batch( &options ) ) {
+         result = EXIT_SUCCESS;
+      }
+      goto deinit_memory;
+   }
+   if ( options.socket_path != NULL ) {
+      vm_serve( &options );
+      goto deinit_memory;
+   }
    vm_run( &options );
    result = EXIT_SUCCESS;
    deinit_memory:
@@ -47,13 +57,6 @@ i32 main( i32 argc, char* argv[] ) {
    return result;
 }
 
-static void init_options( struct options* options ) {
-   options->object_file = NULL;
-   list_init( &options->libraries );
-   list_init( &options->modules );
-   options->verbose = false;
-}
-
 static bool read_options( struct options* options, char* argv[] ) {
    char** args = argv + 1;
 
@@ -68,14 +71,120 @@ static bool read_options( struct options* options, char* argv[] ) {
          ++args;
          options->verbose = true;
          break;
+      case 'c':
+         ++args;
+         if ( *args == NULL ) {
+            printf( "fatal error: "
+               "missing directory argument for -c option\n" );
+            return false;
+         }
+         options->cache_dir = *args;
+         ++args;
+         break;
+      case 'm':
+         ++args;
+         if ( *args == NULL ) {
+            printf( "fatal error: "
+               "missing map name argument for -m option\n" );
+            return false;
+         }
+         options->map_name = *args;
+         ++args;
+         break;
+      case 's':
+         ++args;
+         if ( *args == NULL ) {
+            printf( "fatal error: "
+               "missing seed argument for -s option\n" );
+            return false;
+         }
+         if ( ! rng_read_seed( *args, &options->seed ) ) {
+            printf( "fatal error: "
+               "invalid seed argument for -s option\n" );
+            return false;
+         }
+         options->seeded = true;
+         ++args;
+         break;
+      case 'j':
+         ++args;
+         if ( *args == NULL || atoi( *args ) < 1 ) {
+            printf( "fatal error: "
+               "missing or invalid thread count for -j option\n" );
+            return false;
+         }
+         options->jobs = atoi( *args );
+         ++args;
+         break;
+      case 't':
+         ++args;
+         if ( *args == NULL || atoi( *args ) < 1 ) {
+            printf( "fatal error: "
+               "missing or invalid tic count for -t option\n" );
+            return false;
+         }
+         options->tic_limit = atoi( *args );
+         ++args;
+         break;
+      case '-':
+         if ( strcmp( *args, "--batch" ) == 0 ) {
+            ++args;
+            if ( *args == NULL ) {
+               printf( "fatal error: "
+                  "missing manifest or directory argument for --batch "
+                  "option\n" );
+               return false;
+            }
+            options->batch_path = *args;
+            ++args;
+            break;
+         }
+         if ( strcmp( *args, "--serve" ) == 0 ) {
+            ++args;
+            if ( *args == NULL ) {
+               printf( "fatal error: "
+                  "missing socket path argument for --serve option\n" );
+               return false;
+            }
+            options->socket_path = *args;
+            ++args;
+            break;
+         }
+         if ( strcmp( *args, "--fork" ) == 0 ) {
+            options->server_mode = SERVERMODE_FORK;
+            ++args;
+            break;
+         }
+         if ( strcmp( *args, "--reset" ) == 0 ) {
+            options->server_mode = SERVERMODE_RESET;
+            ++args;
+            break;
+         }
+         return false;
       default:
          return false;
       }
    }
 
+   // In batch mode, the object files come from the manifest. In server mode,
+   // they can come from the requests instead.
+   if ( options->batch_path != NULL ) {
+      if ( *args ) {
+         printf( "fatal error: "
+            "object file argument given together with --batch option\n" );
+         return false;
+      }
+      return true;
+   }
+   if ( options->socket_path != NULL && *args == NULL ) {
+      return true;
+   }
+
    // Read object file.
    if ( *args ) {
       struct module_arg* arg = mem_alloc( sizeof( *arg ) );
+      arg->data = NULL;
+      arg->size = 0;
       arg->name = "";
       arg->path = *args;
       list_append( &options->modules, arg );
@@ -90,6 +199,8 @@ static bool read_options( struct options* options, char* argv[] ) {
 
 static char** read_named_module_arg( struct options* options, char** args ) {
    struct module_arg* arg = mem_alloc( sizeof( *arg ) );
+   arg->data = NULL;
+   arg->size = 0;
    if ( *args == NULL ) {
       printf( "fatal error: "
          "missing module name argument for -n option" );
@@ -112,11 +223,36 @@ static char** read_named_module_arg( struct options* options, char** args ) {
 static void print_usage( char* path ) {
    printf(
       "Usage: %s [options] <object-file>\n"
+      "       %s [options] --batch <manifest-or-dir>\n"
+      "       %s [options] --serve <socket> [<object-file>]\n"
       "Parameters:\n"
-      "  <object-file>: path to file to run.\n"
+      "  <object-file>: path to file to run. Can be a WAD archive.\n"
       "Options:\n"
       "  -n <name> <path>     Load a module\n"
+      "  -c <dir>             Cache loaded modules in directory\n"
+      "  -m <map>             Run the BEHAVIOR lump of a map in a WAD archive\n"
+      "  -s <seed>            Seed the random number generator\n"
+      "  -j <threads>         Load all modules up front, using threads\n"
       "  -v                   Verbose output\n"
+      "  --batch <path>       Run every object file listed in a manifest, or\n"
+      "                       found in a directory, and show a summary in\n"
+      "                       JSON format. Each line of a manifest is an\n"
+      "                       object file, optionally followed by a file with\n"
+      "                       the expected output; otherwise, the output of\n"
+      "                       name.o is compared with name.expected, if it\n"
+      "                       exists. Jobs run on -j threads\n"
+      "  --serve <socket>     Listen on a Unix domain socket, and run each\n"
+      "                       request in a fresh virtual machine. Modules\n"
+      "                       given to the server stay in memory between\n"
+      "                       requests\n"
+      "  --fork               With --serve, load and link the modules once,\n"
+      "                       and run each request in a forked process\n"
+      "  --reset              With --serve, load and link the modules once,\n"
+      "                       and run the requests one after another in the\n"
+      "                       same virtual machine, resetting it after each\n"
+      "                       run\n"
+      "  -t <tics>            Stop a batch job or a request after this many\n"
+      "                       tics (default: 3500)\n"
       "",
-      path );
+      path, path, path );
 }
@@ -0,0 +1,132 @@
+/**
+ * This file implements resetting a virtual machine. After the modules are
+ * loaded, the values of the variables are saved. A reset puts the saved
+ * values back and empties the script queues, so the modules can be run again
+ * without being read and linked again.
+ *
+ * Only the pages of variables that were written since the last reset are put
+ * back, so the cost of a reset depends on how much of the variables a run
+ * wrote, not on how many variables there are.
+ *
+ * Scripts allocate while they run: script instances, function calls, world
+ * and global arrays, and message text. A reset does not free this memory,
+ * because it does not track it. Instead, a run should allocate from a memory
+ * arena of its own, which is destroyed after the reset.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include "common/misc.h"
+#include "common/mem.h"
+#include "common/str.h"
+#include "common/list.h"
+#include "vm.h"
+
+struct pristine_state {
+   struct rng rng;
+};
+
+static void save_region( struct dirty_region* region );
+static void restore_page( struct dirty_page* page );
+
+/**
+ * Saves the state of the virtual machine, for vm_reset() to go back to, and
+ * starts recording writes to the variables. Call after the modules are
+ * loaded, and before any script is started. Every module is read and linked
+ * first, so running scripts does not change the modules.
+ */
+void vm_save_pristine_state( struct vm* vm ) {
+   vm_track_writes( vm );
+   struct write_tracker* tracker = vm->tracker;
+   for ( isize i = 0; i < tracker->num_regions; ++i ) {
+      save_region( &tracker->regions[ i ] );
+   }
+   struct pristine_state* pristine = mem_alloc( sizeof( *pristine ) );
+   pristine->rng = vm->rng;
+   vm->pristine = pristine;
+   vm->dirty_flags |= PAGE_DIRTY_RESET;
+   // Memory the modules allocated while loading belongs to the arena they
+   // were loaded in. Start the runs with nothing allocated.
+   vm_clear_run_state( vm );
+   vm_clear_arrays( vm );
+}
+
+static void save_region( struct dirty_region* region ) {
+   i32* saved = mem_alloc( sizeof( saved[ 0 ] ) *
+      ( region->size > 0 ? region->size : 1 ) );
+   memcpy( saved, region->values, sizeof( saved[ 0 ] ) * region->size );
+   region->pristine = saved;
+}
+
+/**
+ * Puts the virtual machine back in the state saved by
+ * vm_save_pristine_state(). Scripts can then be started again. The random
+ * number generator is also put back, so a run can be repeated exactly.
+ */
+void vm_reset( struct vm* vm ) {
+   struct page_log* log = &vm->tracker->reset_log;
+   for ( isize i = 0; i < log->size; ++i ) {
+      restore_page( &log->pages[ i ] );
+      // Putting a page back is a write, as far as a checkpoint is concerned.
+      vm_record_writes( vm, log->pages[ i ].region,
+         log->pages[ i ].page << DIRTY_PAGE_SHIFT, 1 );
+   }
+   vm_clear_dirty_pages( vm, PAGE_DIRTY_RESET );
+   vm->rng = vm->pristine->rng;
+   vm_clear_run_state( vm );
+   vm_clear_arrays( vm );
+}
+
+static void restore_page( struct dirty_page* page ) {
+   struct dirty_region* region = page->region;
+   isize start = page->page << DIRTY_PAGE_SHIFT;
+   isize count = region->size - start;
+   if ( count > ( 1 << DIRTY_PAGE_SHIFT ) ) {
+      count = 1 << DIRTY_PAGE_SHIFT;
+   }
+   memcpy( region->values + start, region->pristine + start,
+      sizeof( region->values[ 0 ] ) * count );
+}
+
+/**
+ * Forgets the memory allocated by a run, without freeing it, and empties the
+ * script queues. The world and global arrays are kept.
+ */
+void vm_clear_run_state( struct vm* vm ) {
+   struct list_iter i;
+   list_iterate( &vm->modules, &i );
+   while ( ! list_end( &i ) ) {
+      struct module* module = list_data( &i );
+      vm_init_run_queue( &module->waiting_scripts );
+      list_next( &i );
+   }
+   list_init( &vm->waiting_scripts );
+   list_init( &vm->suspended_scripts );
+   vm->instance_block = NULL;
+   vm->instances_left = 0;
+   str_init( &vm->msg );
+   str_init( &vm->temp_str );
+   vm_reset_host_calls( vm );
+   vm->call_stack = NULL;
+   vm->tics = 0;
+   vm->num_active_scripts = 0;
+   vm->num_errs = 0;
+   vm->diag_suppressed = false;
+}
+
+/**
+ * Forgets the world and global arrays, without freeing them. The arrays are
+ * empty before any script runs, so this puts them back to their pristine
+ * state.
+ */
+void vm_clear_arrays( struct vm* vm ) {
+   for ( isize k = 0; k < ARRAY_SIZE( vm->world_arrays ); ++k ) {
+      sparse_init( &vm->world_arrays[ k ] );
+   }
+   for ( isize k = 0; k < ARRAY_SIZE( vm->global_arrays ); ++k ) {
+      sparse_init( &vm->global_arrays[ k ] );
+   }
+   vm->arrays_cleared = true;
+}
@@ -0,0 +1,559 @@
+/**
+ * This file implements server mode. The server listens on a Unix domain
+ * socket and runs each request it receives in a fresh virtual machine, so a
+ * tool that runs many scripts pays for starting the process and reading the
+ * libraries only once.
+ *
+ * A request is a header of `key value` lines, ended by an empty line:
+ *
+ *    object <path>   Object file to run, read by the server.
+ *    data <size>     Object file to run, whose <size> bytes follow the
+ *                    header.
+ *    tics <count>    Stop the run after this many tics. Defaults to -t.
+ *    seed <seed>     Seed of the random number generator.
+ *    virtual <0|1>   When 1, tics run back to back instead of in real time.
+ *                    Defaults to 1.
+ *
+ * The output of the run is sent back as it is produced, at the end of each
+ * tic, and the server closes the connection when the run is over.
+ *
+ * A request names an object file only if the server was not given one. A
+ * request without an object file runs the object file of the server.
+ *
+ * How a request is run depends on the mode of the server:
+ *
+ * - By default, the modules given to the server are read into memory when
+ *   the server starts, and each request is run by a thread of its own, in a
+ *   fresh virtual machine with a memory arena of its own.
+ * - With --fork, the modules are loaded and linked once, and each request is
+ *   run by a child process forked from the server. The child shares the
+ *   loaded modules with the server until it changes them.
+ * - With --reset, the modules are loaded and linked once, and the requests
+ *   are run one after another by the server process itself. After each run,
+ *   the virtual machine is reset to the state it had after loading. This mode
+ *   needs an object file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "common/misc.h"
+#include "common/mem.h"
+#include "common/str.h"
+#include "common/list.h"
+#include "common/fs.h"
+#include "vm.h"
+#include "wad.h"
+
+enum { MAX_HEADER_SIZE = 4096 };
+enum { MAX_REQUEST_DATA_SIZE = 64 * 1024 * 1024 };
+
+struct server {
+   struct options* options;
+   // Modules read into memory, in the default mode.
+   struct list modules;
+   // Virtual machine with every module loaded and linked, in the fork and
+   // reset modes.
+   struct vm* vm;
+   struct options vm_options;
+   bool has_main_module;
+};
+
+struct connection {
+   struct server* server;
+   int socket;
+   // Set when the client has gone away, to stop the run.
+   bool closed;
+};
+
+struct request {
+   const char* object_path;
+   u8* data;
+   isize size;
+   i32 tic_limit;
+   u64 seed;
+   bool virtual_time;
+};
+
+static bool preload_modules( struct server* server );
+static bool load_modules( struct server* server );
+static int open_socket( const char* path );
+static void start_thread( struct server* server, int client );
+static void start_process( struct server* server, int listener, int client );
+static void serve_in_place( struct server* server, int client );
+static void* run_connection( void* data );
+static bool read_request( struct connection* connection,
+   struct request* request );
+static bool read_header( struct connection* connection,
+   struct request* request, struct str* header );
+static bool read_header_line( struct request* request, const char* line );
+static bool receive( struct connection* connection, void* buffer,
+   isize size );
+static void run_request( struct connection* connection,
+   struct request* request );
+static void run_loaded_request( struct connection* connection,
+   struct request* request );
+static void load_request_module( struct vm* vm, struct request* request );
+static void run_tics( struct connection* connection, struct vm* vm,
+   struct request* request );
+static void fail_alloc( void* data );
+static void write_socket( const char* text, isize length, void* data );
+static void send_error( struct connection* connection, const char* message );
+
+/**
+ * Serves requests until the process is stopped. Returns false if the server
+ * could not be started.
+ */
+bool vm_serve( struct options* options ) {
+   struct server server;
+   server.options = options;
+   server.vm = NULL;
+   server.has_main_module = ( options->object_file != NULL );
+   if ( options->server_mode == SERVERMODE_THREAD ) {
+      if ( ! preload_modules( &server ) ) {
+         return false;
+      }
+   }
+   else {
+      if ( options->server_mode == SERVERMODE_RESET &&
+         ! server.has_main_module ) {
+         printf( "fatal error: --reset option needs an object file\n" );
+         return false;
+      }
+      if ( ! load_modules( &server ) ) {
+         return false;
+      }
+   }
+   int listener = open_socket( options->socket_path );
+   if ( listener < 0 ) {
+      return false;
+   }
+   // Finished children are cleaned up by the system.
+   if ( options->server_mode == SERVERMODE_FORK ) {
+      signal( SIGCHLD, SIG_IGN );
+   }
+   printf( "listening on %s\n", options->socket_path );
+   fflush( stdout );
+   while ( true ) {
+      int client = accept( listener, NULL, NULL );
+      if ( client < 0 ) {
+         continue;
+      }
+      switch ( options->server_mode ) {
+      case SERVERMODE_THREAD:
+         start_thread( &server, client );
+         break;
+      case SERVERMODE_FORK:
+         start_process( &server, listener, client );
+         break;
+      case SERVERMODE_RESET:
+         serve_in_place( &server, client );
+         break;
+      }
+   }
+   return true;
+}
+
+/**
+ * Reads the modules into memory. The runs only read from them, so they are
+ * shared by every connection.
+ */
+static bool preload_modules( struct server* server ) {
+   list_init( &server->modules );
+   struct list_iter i;
+   list_iterate( &server->options->modules, &i );
+   while ( ! list_end( &i ) ) {
+      struct module_arg* arg = list_data( &i );
+      struct file_request request;
+      vm_init_file_request( &request );
+      vm_load_file( &request, arg->path );
+      if ( request.err != FILEREQUESTERR_NONE ) {
+         printf( "fatal error: failed to load module file: %s\n",
+            arg->path );
+         return false;
+      }
+      struct module_arg* module = mem_alloc( sizeof( *module ) );
+      module->name = arg->name;
+      module->path = arg->path;
+      module->data = request.data;
+      module->size = request.size;
+      list_append( &server->modules, module );
+      list_next( &i );
+   }
+   return true;
+}
+
+/**
+ * Loads and links the modules in the virtual machine used by the runs. In
+ * reset mode, the state after loading is saved, to reset to after each run.
+ */
+static bool load_modules( struct server* server ) {
+   server->vm_options = *server->options;
+   struct vm* vm = mem_alloc( sizeof( *vm ) );
+   jmp_buf bail;
+   vm->bail = &bail;
+   if ( setjmp( bail ) == 0 ) {
+      vm_init( vm, &server->vm_options );
+      vm_load_modules( vm );
+      vm_link_all_modules( vm );
+      if ( server->options->server_mode == SERVERMODE_RESET ) {
+         vm_save_pristine_state( vm );
+      }
+      output_flush( &vm->output );
+      server->vm = vm;
+      return true;
+   }
+   output_flush( &vm->output );
+   return false;
+}
+
+static int open_socket( const char* path ) {
+   struct sockaddr_un address;
+   if ( strlen( path ) >= sizeof( address.sun_path ) ) {
+      printf( "fatal error: socket path too long: %s\n", path );
+      return -1;
+   }
+   memset( &address, 0, sizeof( address ) );
+   address.sun_family = AF_UNIX;
+   strcpy( address.sun_path, path );
+   int listener = socket( AF_UNIX, SOCK_STREAM, 0 );
+   if ( listener < 0 ) {
+      printf( "fatal error: failed to create socket\n" );
+      return -1;
+   }
+   // Remove the socket left behind by a previous server.
+   unlink( path );
+   if ( bind( listener, ( struct sockaddr* ) &address,
+      sizeof( address ) ) != 0 || listen( listener, SOMAXCONN ) != 0 ) {
+      printf( "fatal error: failed to listen on socket: %s\n", path );
+      close( listener );
+      return -1;
+   }
+   return listener;
+}
+
+static void start_thread( struct server* server, int client ) {
+   // The connection is freed by its own thread, so it cannot come from the
+   // arena of this thread.
+   struct connection* connection = malloc( sizeof( *connection ) );
+   pthread_t thread;
+   if ( connection == NULL ) {
+      close( client );
+      return;
+   }
+   connection->server = server;
+   connection->socket = client;
+   connection->closed = false;
+   if ( pthread_create( &thread, NULL, run_connection, connection ) != 0 ) {
+      close( client );
+      free( connection );
+      return;
+   }
+   pthread_detach( thread );
+}
+
+/**
+ * The child exits when the run is over, so it frees nothing.
+ */
+static void start_process( struct server* server, int listener, int client ) {
+   pid_t pid = fork();
+   if ( pid == 0 ) {
+      close( listener );
+      struct connection connection = { server, client, false };
+      struct request request;
+      if ( read_request( &connection, &request ) ) {
+         run_loaded_request( &connection, &request );
+      }
+      close( client );
+      _exit( EXIT_SUCCESS );
+   }
+   close( client );
+}
+
+/**
+ * Everything the run allocates comes from an arena that is destroyed after
+ * the virtual machine is reset.
+ */
+static void serve_in_place( struct server* server, int client ) {
+   struct connection connection = { server, client, false };
+   struct mem_arena* arena = mem_create_arena();
+   if ( arena != NULL ) {
+      struct mem_arena* server_arena = mem_use_arena( arena );
+      struct request request;
+      if ( read_request( &connection, &request ) ) {
+         run_loaded_request( &connection, &request );
+      }
+      vm_reset( server->vm );
+      mem_use_arena( server_arena );
+      mem_destroy_arena( arena );
+   }
+   close( client );
+}
+
+static void* run_connection( void* data ) {
+   struct connection* connection = data;
+   mem_init();
+   struct mem_arena* arena = mem_create_arena();
+   if ( arena != NULL ) {
+      struct mem_arena* thread_arena = mem_use_arena( arena );
+      struct request request;
+      if ( read_request( connection, &request ) ) {
+         run_request( connection, &request );
+      }
+      mem_use_arena( thread_arena );
+      mem_destroy_arena( arena );
+   }
+   close( connection->socket );
+   free( connection );
+   mem_free_all();
+   return NULL;
+}
+
+static bool read_request( struct connection* connection,
+   struct request* request ) {
+   request->object_path = NULL;
+   request->data = NULL;
+   request->size = 0;
+   struct options* options = connection->server->options;
+   request->tic_limit = options->tic_limit;
+   request->seed = options->seeded ? options->seed : ( u64 ) time( NULL );
+   request->virtual_time = true;
+   struct str header;
+   str_init( &header );
+   if ( ! read_header( connection, request, &header ) ) {
+      return false;
+   }
+   if ( request->size > 0 ) {
+      request->data = mem_alloc( request->size );
+      if ( ! receive( connection, request->data, request->size ) ) {
+         return false;
+      }
+   }
+   bool has_object = ( request->object_path != NULL ||
+      request->data != NULL );
+   if ( has_object && connection->server->has_main_module ) {
+      send_error( connection, "request has an object file, but the server "
+         "already runs one" );
+      return false;
+   }
+   if ( ! has_object && ! connection->server->has_main_module ) {
+      send_error( connection, "request has no object file" );
+      return false;
+   }
+   return true;
+}
+
+/**
+ * The header is read one byte at a time, so none of the data that follows
+ * it is consumed. The lines are parsed once the whole header is read, because
+ * the object path points into the header.
+ */
+static bool read_header( struct connection* connection,
+   struct request* request, struct str* header ) {
+   while ( ! ( header->length > 0 &&
+      header->value[ header->length - 1 ] == '\n' &&
+      ( header->length == 1 ||
+      header->value[ header->length - 2 ] == '\n' ) ) ) {
+      if ( header->length == MAX_HEADER_SIZE ) {
+         send_error( connection, "request header too long" );
+         return false;
+      }
+      char ch;
+      if ( ! receive( connection, &ch, 1 ) ) {
+         return false;
+      }
+      if ( ch == '\0' ) {
+         send_error( connection, "invalid request header" );
+         return false;
+      }
+      str_append_sub( header, &ch, 1 );
+   }
+   char* line = header->value;
+   char* line_end;
+   while ( ( line_end = strchr( line, '\n' ) ) != line ) {
+      *line_end = '\0';
+      if ( ! read_header_line( request, line ) ) {
+         send_error( connection, "invalid request header line" );
+         return false;
+      }
+      line = line_end + 1;
+   }
+   return true;
+}
+
+static bool read_header_line( struct request* request, const char* line ) {
+   const char* value = strchr( line, ' ' );
+   if ( value == NULL ) {
+      return false;
+   }
+   isize key_length = value - line;
+   ++value;
+   if ( key_length == 6 && strncmp( line, "object", 6 ) == 0 ) {
+      request->object_path = value;
+   }
+   else if ( key_length == 4 && strncmp( line, "data", 4 ) == 0 ) {
+      request->size = atoi( value );
+      return ( request->size > 0 &&
+         request->size <= MAX_REQUEST_DATA_SIZE );
+   }
+   else if ( key_length == 4 && strncmp( line, "tics", 4 ) == 0 ) {
+      request->tic_limit = atoi( value );
+      return ( request->tic_limit > 0 );
+   }
+   else if ( key_length == 4 && strncmp( line, "seed", 4 ) == 0 ) {
+      return rng_read_seed( value, &request->seed );
+   }
+   else if ( key_length == 7 && strncmp( line, "virtual", 7 ) == 0 ) {
+      request->virtual_time = ( atoi( value ) != 0 );
+   }
+   else {
+      return false;
+   }
+   return true;
+}
+
+static bool receive( struct connection* connection, void* buffer,
+   isize size ) {
+   u8* data = buffer;
+   while ( size > 0 ) {
+      ssize_t received = recv( connection->socket, data, size, 0 );
+      if ( received <= 0 ) {
+         return false;
+      }
+      data += received;
+      size -= received;
+   }
+   return true;
+}
+
+/**
+ * Runs the object file of the request, together with the libraries, in a
+ * fresh virtual machine.
+ */
+static void run_request( struct connection* connection,
+   struct request* request ) {
+   struct server* server = connection->server;
+   struct options options = *server->options;
+   options.jobs = 1;
+   options.cache_dir = NULL;
+   options.seed = request->seed;
+   options.seeded = true;
+   list_init( &options.modules );
+   struct list_iter i;
+   list_iterate( &server->modules, &i );
+   while ( ! list_end( &i ) ) {
+      list_append( &options.modules, list_data( &i ) );
+      list_next( &i );
+   }
+   struct module_arg main_arg = { "", request->object_path, request->data,
+      request->size };
+   if ( ! server->has_main_module ) {
+      options.object_file = ( request->object_path != NULL ) ?
+         request->object_path : "";
+      main_arg.path = options.object_file;
+      list_append( &options.modules, &main_arg );
+   }
+   struct vm* vm = mem_alloc( sizeof( *vm ) );
+   jmp_buf bail;
+   vm->bail = &bail;
+   vm->options = &options;
+   vm->wad = NULL;
+   mem_set_fail_handler( fail_alloc, vm );
+   if ( setjmp( bail ) == 0 ) {
+      vm_init( vm, &options );
+      output_init( &vm->output, write_socket, connection );
+      vm_start( vm );
+      run_tics( connection, vm, request );
+   }
+   output_flush( &vm->output );
+   if ( vm->wad != NULL ) {
+      wad_close( vm->wad );
+   }
+}
+
+/**
+ * Runs the request in the virtual machine whose modules are already loaded.
+ */
+static void run_loaded_request( struct connection* connection,
+   struct request* request ) {
+   struct vm* vm = connection->server->vm;
+   jmp_buf bail;
+   vm->bail = &bail;
+   output_init( &vm->output, write_socket, connection );
+   rng_seed( &vm->rng, request->seed );
+   mem_set_fail_handler( fail_alloc, vm );
+   if ( setjmp( bail ) == 0 ) {
+      if ( ! connection->server->has_main_module ) {
+         load_request_module( vm, request );
+      }
+      vm_start_open_scripts( vm );
+      run_tics( connection, vm, request );
+   }
+   mem_set_fail_handler( NULL, NULL );
+   output_flush( &vm->output );
+}
+
+/**
+ * Loads the object file of the request as the main module. The libraries are
+ * already linked, so only the main module is linked here.
+ */
+static void load_request_module( struct vm* vm, struct request* request ) {
+   struct module_arg* arg = mem_alloc( sizeof( *arg ) );
+   arg->name = "";
+   arg->path = ( request->object_path != NULL ) ? request->object_path : "";
+   arg->data = request->data;
+   arg->size = request->size;
+   vm->options->object_file = arg->path;
+   list_init( &vm->options->modules );
+   list_append( &vm->options->modules, arg );
+   vm_load_modules( vm );
+}
+
+/**
+ * The run stops when no scripts are left, when the tic limit is reached, or
+ * when the client goes away.
+ */
+static void run_tics( struct connection* connection, struct vm* vm,
+   struct request* request ) {
+   while ( vm_scripts_waiting( vm ) && vm->tics < request->tic_limit &&
+      ! connection->closed ) {
+      vm_run_tics( vm, 1 );
+      if ( ! request->virtual_time && vm->num_active_scripts > 0 ) {
+         usleep( TIC_DURATION );
+      }
+   }
+}
+
+static void fail_alloc( void* data ) {
+   v_bail( data );
+}
+
+static void write_socket( const char* text, isize length, void* data ) {
+   struct connection* connection = data;
+   while ( length > 0 && ! connection->closed ) {
+      // A client that goes away must not stop the server with SIGPIPE.
+      ssize_t sent = send( connection->socket, text, length, MSG_NOSIGNAL );
+      if ( sent <= 0 ) {
+         connection->closed = true;
+      }
+      else {
+         text += sent;
+         length -= sent;
+      }
+   }
+}
+
+static void send_error( struct connection* connection, const char* message ) {
+   struct output output;
+   output_init( &output, write_socket, connection );
+   output_printf( &output, "fatal error: %s\n", message );
+   output_deinit( &output );
+}
@@ -14,15 +14,20 @@
 #include "pcode.h"
 #include "debug.h"
 
-static void init_vm( struct vm* vm, struct options* options );
+// Instances are allocated this many at a time.
+enum { INSTANCES_PER_BLOCK = 64 };
+
+STATIC_ASSERT( sizeof( struct instance ) <= CACHE_LINE_SIZE,
+   instance_must_fit_in_a_cache_line );
+
 static void create_master_str_table( struct vm* vm );
 static isize count_initial_strings( struct vm* vm );
 static void run( struct vm* vm );
-static void start_open_scripts( struct vm* vm );
-static void start_script( struct vm* vm, struct module* module,
+static void run_tic( struct vm* vm );
+static struct instance* start_script( struct vm* vm, struct module* module,
+   struct script* script );
+static struct module* find_script_module( struct vm* vm,
    struct script* script );
-static struct instance* create_instance( struct script* script );
-static bool scripts_waiting( struct vm* vm );
 static void next_tic( struct vm* vm );
 static void run_module( struct vm* vm, struct module* module );
 static bool script_ready( struct vm* vm, struct module* module );
@@ -30,7 +35,9 @@ static void run_delayed_script( struct vm* machine, struct module* module,
    struct instance* script );
 static struct instance* deq_script( struct module* module );
 static void enq_script( struct module* module, struct instance* script );
-static bool run_sooner( struct instance* a, struct instance* b );
+static void grow_run_queue( struct run_queue* queue );
+static void move_queue_entries( struct run_queue* queue, isize start,
+   isize end, isize offset );
 static void add_suspended_script( struct vm* vm, struct instance* script );
 static void init_turn( struct turn* turn, struct module* module,
    struct instance* script );
@@ -39,38 +46,94 @@ static bool script_finished( struct turn* turn );
 
 void vm_run( struct options* options ) {
    struct vm vm;
-   init_vm( &vm, options );
+   vm_init( &vm, options );
+   vm_exec( &vm );
+
+   //free( request.data );
+}
+
+/**
+ * Loads the modules and runs the scripts. Host functions should be bound
+ * before calling this function. Returns false if execution stopped because of
+ * an error.
+ */
+bool vm_exec( struct vm* vm ) {
    jmp_buf bail;
    if ( setjmp( bail ) == 0 ) {
-      vm.bail = &bail;
-      vm_load_modules( &vm );
-      create_master_str_table( &vm );
-      run( &vm );
+      vm->bail = &bail;
+      vm_start( vm );
+      run( vm );
+      output_flush( &vm->output );
+      return true;
    }
+   output_flush( &vm->output );
+   return false;
+}
 
-   //free( request.data );
+void vm_init_options( struct options* options ) {
+   options->object_file = NULL;
+   list_init( &options->libraries );
+   list_init( &options->modules );
+   options->cache_dir = NULL;
+   options->jobs = 1;
+   options->map_name = NULL;
+   options->seed = 0;
+   options->seeded = false;
+   options->batch_path = NULL;
+   options->socket_path = NULL;
+   options->server_mode = SERVERMODE_THREAD;
+   options->tic_limit = 3500;
+   options->capture_output = false;
+   options->verbose = false;
 }
 
-void init_vm( struct vm* vm, struct options* options ) {
+void vm_init( struct vm* vm, struct options* options ) {
    vm->options = options;
+   if ( options->capture_output ) {
+      output_init_memory( &vm->output );
+   }
+   else {
+      output_init_stream( &vm->output, stdout );
+   }
+   vm->diag_suppressed = false;
+   vm->num_errs = 0;
 //   vm->object = NULL;
    list_init( &vm->modules );
+   hash_init( &vm->module_table );
+   list_init( &vm->images );
+   vm->wad = NULL;
    list_init( &vm->scripts );
+   hash_init( &vm->script_table );
    list_init( &vm->waiting_scripts );
    list_init( &vm->suspended_scripts );
+   vm->instance_block = NULL;
+   vm->instances_left = 0;
    str_init( &vm->msg );
-   srand( time( NULL ) );
+   // Show the seed, so a run can be repeated.
+   u64 seed = options->seeded ? options->seed : ( u64 ) time( NULL );
+   rng_seed( &vm->rng, seed );
+   v_diag( vm, DIAG_DBG, "random seed: %llu", seed );
+   memset( vm->world_vars, 0, sizeof( vm->world_vars ) );
+   memset( vm->global_vars, 0, sizeof( vm->global_vars ) );
    for ( isize i = 0; i < ARRAY_SIZE( vm->world_arrays ); ++i ) {
-      vector_init( &vm->world_arrays[ i ], sizeof( i32 ) );
+      sparse_init( &vm->world_arrays[ i ] );
    }
    for ( isize i = 0; i < ARRAY_SIZE( vm->global_arrays ); ++i ) {
-      vector_init( &vm->global_arrays[ i ], sizeof( i32 ) );
+      sparse_init( &vm->global_arrays[ i ] );
    }
    vm->tics = 0;
    vm->num_active_scripts = 0;
    vm->call_stack = NULL;
    str_init( &vm->temp_str );
    vector_init( &vm->strings, sizeof( struct indexed_string* ) );
+   vm_init_host_calls( vm );
+   vm->pristine = NULL;
+   vm->tracker = NULL;
+   vm->world_region = NULL;
+   vm->global_region = NULL;
+   vm->dirty_flags = 0;
+   vm->checkpoint_id = 0;
+   vm->arrays_cleared = false;
 }
 
 static void create_master_str_table( struct vm* vm ) {
@@ -103,23 +166,54 @@ struct indexed_string* vm_add_string( struct vm* vm, const char* value ) {
 } 
 
 void run( struct vm* vm  ) {
-   start_open_scripts( vm );
-   while ( scripts_waiting( vm ) ) {
-      struct list_iter i;
-      list_iterate( &vm->modules, &i );
-      while ( ! list_end( &i ) ) {
-         struct module* module = list_data( &i );
-         run_module( vm, module );
-         list_next( &i );
-      }
+   while ( vm_scripts_waiting( vm ) ) {
+      run_tic( vm );
       next_tic( vm );
    }
 }
 
+/**
+ * Loads the modules and queues the OPEN scripts. The scripts then run when
+ * the tics are run.
+ */
+void vm_start( struct vm* vm ) {
+   vm_load_modules( vm );
+   create_master_str_table( vm );
+   vm_start_open_scripts( vm );
+}
+
+/**
+ * Runs the specified number of tics right away. Time in the virtual machine
+ * only advances through this function, so a program that embeds the virtual
+ * machine decides how long a tic is.
+ */
+void vm_run_tics( struct vm* vm, isize tics ) {
+   for ( isize i = 0; i < tics; ++i ) {
+      run_tic( vm );
+      ++vm->tics;
+   }
+}
+
+/**
+ * Runs the scripts that are ready in the current tic.
+ */
+static void run_tic( struct vm* vm ) {
+   struct list_iter i;
+   list_iterate( &vm->modules, &i );
+   while ( ! list_end( &i ) ) {
+      struct module* module = list_data( &i );
+      run_module( vm, module );
+      list_next( &i );
+   }
+   vm_flush_host_calls( vm );
+   // Show the output of the tic before waiting for the next one.
+   output_flush( &vm->output );
+}
+
 /**
  * Queues for execution every OPEN script from every module.
  */
-static void start_open_scripts( struct vm* vm ) {
+void vm_start_open_scripts( struct vm* vm ) {
    struct list_iter i;
    list_iterate( &vm->modules, &i );
    while ( ! list_end( &i ) ) {
@@ -128,7 +222,7 @@ static void start_open_scripts( struct vm* vm ) {
       list_iterate( &module->scripts, &k );
       while ( ! list_end( &k ) ) {
          struct script* script = list_data( &k );
-         if ( script->type == SCRIPTTYPE_OPEN ) {
+         if ( script->info->type == SCRIPTTYPE_OPEN ) {
             start_script( vm, module, script );
          }
          list_next( &k );
@@ -140,32 +234,76 @@ static void start_open_scripts( struct vm* vm ) {
 /* Queues a script for execution and notifies the user that the script started
  * running.
  */
-static void start_script( struct vm* vm, struct module* module,
+static struct instance* start_script( struct vm* vm, struct module* module,
    struct script* script ) {
-   struct instance* instance = create_instance( script );
+   struct instance* instance = vm_alloc_instance( vm, script );
    enq_script( module, instance );
    v_diag( vm, DIAG_DBG, "starting script %s",
       vm_present_script( vm, script ) );
    ++vm->num_active_scripts;
+   return instance;
 }
 
-static struct instance* create_instance( struct script* script ) {
-   struct instance* instance = mem_alloc( sizeof( *instance ) );
+/**
+ * Starts a script on behalf of the host, like the game does when a player
+ * crosses a line. The arguments are given to the script in its first
+ * variables, and the script runs in the next tic. Returns false if no module
+ * has a script with the number.
+ */
+bool vm_start_script( struct vm* vm, i32 number, const i32* args,
+   i32 num_args ) {
+   struct script* script = vm_find_script_by_number( vm, number );
+   if ( script == NULL ) {
+      return false;
+   }
+   struct instance* instance = start_script( vm,
+      find_script_module( vm, script ), script );
+   for ( i32 i = 0; i < num_args && i < script->num_vars; ++i ) {
+      instance->vars[ i ] = args[ i ];
+   }
+   return true;
+}
+
+static struct module* find_script_module( struct vm* vm,
+   struct script* script ) {
+   struct list_iter i;
+   list_iterate( &vm->modules, &i );
+   while ( ! list_end( &i ) ) {
+      struct module* module = list_data( &i );
+      if ( hash_find_number( &module->script_table,
+         script->number ) == script ) {
+         return module;
+      }
+      list_next( &i );
+   }
+   return NULL;
+}
+
+/**
+ * Creates an instance of a script, with its variables set to zero. The
+ * instances are carved out of blocks, each on a cache line boundary, so
+ * looking at an instance reads a single cache line. Like the rest of the
+ * memory of a run, the blocks are dropped on a reset.
+ */
+struct instance* vm_alloc_instance( struct vm* vm, struct script* script ) {
+   if ( vm->instances_left == 0 ) {
+      char* block = mem_alloc( CACHE_LINE_SIZE * INSTANCES_PER_BLOCK +
+         CACHE_LINE_SIZE - 1 );
+      vm->instance_block = block + ( ( CACHE_LINE_SIZE -
+         ( usize ) block % CACHE_LINE_SIZE ) % CACHE_LINE_SIZE );
+      vm->instances_left = INSTANCES_PER_BLOCK;
+   }
+   struct instance* instance = ( struct instance* ) vm->instance_block;
+   vm->instance_block += CACHE_LINE_SIZE;
+   --vm->instances_left;
    instance->script = script;
-   instance->next = NULL;
-   instance->next_waiting = NULL;
-   instance->waiting = NULL;
-   instance->waiting_tail = NULL;
+   instance->vars = vm_alloc_local_array_space( script->num_vars );
+   instance->arrays = vm_alloc_local_array_space( script->total_array_size );
+   instance->ip = script->start;
+   instance->resume_time = 0;
    instance->delay_amount = 0;
    instance->state = SCRIPTSTATE_TERMINATED;
-   instance->vars = mem_alloc( sizeof( instance->vars[ 0 ] ) *
-      script->num_vars );
-   for ( isize i = 0; i < script->num_vars; ++i ) {
-      instance->vars[ i ] = 0;
-   }
-   instance->resume_time = 0;
-   instance->ip = script->start;
-   instance->arrays = vm_alloc_local_array_space( script->total_array_size );
+   instance->waiting = NULL;
    return instance;
 }
 
@@ -180,12 +318,12 @@ i32* vm_alloc_local_array_space( isize count ) {
 /**
  * Tells whether there are any scripts waiting to run.
  */
-static bool scripts_waiting( struct vm* vm ) {
+bool vm_scripts_waiting( struct vm* vm ) {
    struct list_iter i;
    list_iterate( &vm->modules, &i );
    while ( ! list_end( &i ) ) {
       struct module* module = list_data( &i );
-      if ( list_size( &module->waiting_scripts ) > 0 ) {
+      if ( module->waiting_scripts.head < module->waiting_scripts.tail ) {
          return true;
       }
       list_next( &i );
@@ -198,7 +336,7 @@ static bool scripts_waiting( struct vm* vm ) {
  */
 static void next_tic( struct vm* vm ) {
    if ( vm->num_active_scripts > 0 ) {
-      usleep( 1000000 );
+      usleep( TIC_DURATION );
       ++vm->tics;
    }
 /*
@@ -216,8 +354,9 @@ static void run_module( struct vm* vm, struct module* module ) {
 }
 
 static bool script_ready( struct vm* vm, struct module* module ) {
-   struct instance* instance = list_head( &module->waiting_scripts );
-   return ( instance && instance->resume_time <= vm->tics );
+   struct run_queue* queue = &module->waiting_scripts;
+   return ( queue->head < queue->tail &&
+      queue->resume_times[ queue->head ] <= vm->tics );
 }
 
 static void run_delayed_script( struct vm* machine, struct module* module,
@@ -249,7 +388,7 @@ static void run_delayed_script( struct vm* machine, struct module* module,
       add_suspended_script( machine, script );
       break;
    case SCRIPTSTATE_DELAYED:
-printf( "delayed until %ld\n", script->resume_time );
+      v_diag( machine, DIAG_DBG, "delayed until %ld", script->resume_time );
       enq_script( module, script );
       break;
    case SCRIPTSTATE_RUNNING:
@@ -265,28 +404,107 @@ printf( "delayed until %ld\n", script->resume_time );
  * Removes the top-most script from the script list.
  */
 struct instance* deq_script( struct module* module ) {
-   return list_shift( &module->waiting_scripts );
+   struct run_queue* queue = &module->waiting_scripts;
+   struct instance* instance = queue->instances[ queue->head ];
+   ++queue->head;
+   if ( queue->head == queue->tail ) {
+      queue->head = 0;
+      queue->tail = 0;
+   }
+   return instance;
+}
+
+static void enq_script( struct module* module, struct instance* script ) {
+   vm_enq_script( &module->waiting_scripts, script );
+}
+
+/**
+ * Empties a queue, without freeing its arrays. Used on a reset, when the
+ * memory of the run is freed all at once.
+ */
+void vm_init_run_queue( struct run_queue* queue ) {
+   queue->instances = NULL;
+   queue->resume_times = NULL;
+   queue->delay_amounts = NULL;
+   queue->head = 0;
+   queue->tail = 0;
+   queue->capacity = 0;
 }
 
 /**
  * Inserts a script into the script priority queue. The scripts in the queue
  * are sorted based on how soon they need to run: a script that needs to run
- * sooner will appear closer to the front of the queue.
+ * sooner will appear closer to the front of the queue. A script goes after
+ * the scripts with the same delay amount.
  */
-static void enq_script( struct module* module, struct instance* script ) {
-   struct list_iter i;
-   list_iterate( &module->waiting_scripts, &i );
-   while ( ! list_end( &i ) && run_sooner( list_data( &i ), script ) ) {
-      list_next( &i );
+void vm_enq_script( struct run_queue* queue, struct instance* instance ) {
+   // Find the first script with a larger delay amount.
+   isize low = queue->head;
+   isize high = queue->tail;
+   while ( low < high ) {
+      isize middle = low + ( high - low ) / 2;
+      if ( queue->delay_amounts[ middle ] <= instance->delay_amount ) {
+         low = middle + 1;
+      }
+      else {
+         high = middle;
+      }
+   }
+   // Make room by moving the shorter side of the queue. The front can only
+   // move if scripts were taken off the queue.
+   if ( queue->head > 0 && low - queue->head < queue->tail - low ) {
+      move_queue_entries( queue, queue->head, low, -1 );
+      --queue->head;
+      --low;
    }
-   list_insert_before( &module->waiting_scripts, &i, script );
+   else {
+      if ( queue->tail == queue->capacity ) {
+         grow_run_queue( queue );
+         low -= queue->head;
+         move_queue_entries( queue, queue->head, queue->tail,
+            -queue->head );
+         queue->tail -= queue->head;
+         queue->head = 0;
+      }
+      move_queue_entries( queue, low, queue->tail, 1 );
+      ++queue->tail;
+   }
+   queue->instances[ low ] = instance;
+   queue->resume_times[ low ] = instance->resume_time;
+   queue->delay_amounts[ low ] = instance->delay_amount;
 }
 
 /**
- * Tells whether script A should run sooner than script B.
+ * The arrays are only grown when the scripts taken off the front of the
+ * queue leave less than a quarter of the queue free. Otherwise, the scripts
+ * are moved to the front.
  */
-static bool run_sooner( struct instance* a, struct instance* b ) {
-   return ( a->delay_amount <= b->delay_amount );
+static void grow_run_queue( struct run_queue* queue ) {
+   if ( queue->capacity > 0 && queue->head >= queue->capacity / 4 ) {
+      return;
+   }
+   queue->capacity = ( queue->capacity == 0 ) ? 64 : queue->capacity * 2;
+   queue->instances = mem_realloc( queue->instances,
+      sizeof( queue->instances[ 0 ] ) * queue->capacity );
+   queue->resume_times = mem_realloc( queue->resume_times,
+      sizeof( queue->resume_times[ 0 ] ) * queue->capacity );
+   queue->delay_amounts = mem_realloc( queue->delay_amounts,
+      sizeof( queue->delay_amounts[ 0 ] ) * queue->capacity );
+}
+
+static void move_queue_entries( struct run_queue* queue, isize start,
+   isize end, isize offset ) {
+   isize count = end - start;
+   if ( count > 0 && offset != 0 ) {
+      memmove( &queue->instances[ start + offset ], &queue->instances[ start ],
+         sizeof( queue->instances[ 0 ] ) * count );
+      memmove( &queue->resume_times[ start + offset ],
+         &queue->resume_times[ start ],
+         sizeof( queue->resume_times[ 0 ] ) * count );
+      memmove( &queue->delay_amounts[ start + offset ],
+         &queue->delay_amounts[ start ],
+         sizeof( queue->delay_amounts[ 0 ] ) * count );
+   }
 }
 
 struct instance* vm_get_active_script( struct vm* vm, int number ) {
@@ -354,41 +572,47 @@ static bool script_finished( struct turn* turn ) {
    }
 }
 
-void v_diag( struct vm* machine, int flags, ... ) {
-   if ( ( flags & DIAG_DBG ) != 0 && ! machine->options->verbose ) {
-      return;
+/**
+ * Called through v_diag(), which has already checked that the message is
+ * shown.
+ */
+void v_show_diag( struct vm* machine, int flags, ... ) {
+   machine->diag_suppressed = false;
+   if ( flags & ( DIAG_ERR | DIAG_FATALERR ) ) {
+      ++machine->num_errs;
    }
 
+   struct output* output = &machine->output;
    va_list args;
    va_start( args, flags );
    if ( ( flags & DIAG_DBG ) != 0 ) {
-      printf( "[dbg] " );
+      output_write( output, "[dbg] ", 6 );
    }
    if ( flags & DIAG_INTERNAL ) {
-      printf( "internal " );
+      output_write( output, "internal ", 9 );
    }
    if ( flags & DIAG_ERR ) {
-      printf( "error: " );
+      output_write( output, "error: ", 7 );
    }
    else if ( flags & DIAG_FATALERR ) {
-      printf( "fatal error: " );
+      output_write( output, "fatal error: ", 13 );
    }
    else if ( flags & DIAG_WARN ) {
-      printf( "warning: " );
+      output_write( output, "warning: ", 9 );
    }
    const char* format = va_arg( args, const char* );
-   vprintf( format, args );
+   output_vprintf( output, format, args );
    if ( ( flags & DIAG_MULTI_PART ) == 0 ) {
-      printf( "\n" );
+      output_write( output, "\n", 1 );
    }
    va_end( args );
 }
 
-void v_diag_more( struct vm* machine, ... ) {
+void v_show_diag_more( struct vm* machine, ... ) {
    va_list args;
    va_start( args, machine );
    const char* format = va_arg( args, const char* );
-   vprintf( format, args );
+   output_vprintf( &machine->output, format, args );
    va_end( args );
 }
 
@@ -397,8 +621,8 @@ void v_bail( struct vm* machine ) {
 }
 
 i32* vm_get_map_var( struct vm* vm, struct module* module, i32 index ) {
-   if ( index >= 0 && index < ARRAY_SIZE( module->vars ) ) {
-      return &module->vars[ index ].value;
+   if ( index >= 0 && index < module->num_vars ) {
+      return &module->var_values[ index ];
    }
    else {
       v_diag( vm, DIAG_FATALERR,
@@ -409,23 +633,19 @@ i32* vm_get_map_var( struct vm* vm, struct module* module, i32 index ) {
 }
 
 struct script* vm_find_script_by_number( struct vm* vm, i32 number ) {
-   struct list_iter i;
-   list_iterate( &vm->scripts, &i );
-   while ( ! list_end( &i ) ) {
-      struct script* script = list_data( &i );
-      if ( script->number == number ) {
-         return script;
-      }
-      list_next( &i );
+   struct script* script = hash_find_number( &vm->script_table, number );
+   if ( script == NULL ) {
+      // The script might be in a library that has not been read yet.
+      script = vm_load_script( vm, number );
    }
-   return NULL;
+   return script;
 }
 
 const char* vm_present_script( struct vm* vm, struct script* script ) {
    str_clear( &vm->temp_str );
-   if ( script->name != null ) {
+   if ( script->info->name != null ) {
       str_append( &vm->temp_str, "\"" );
-      str_append( &vm->temp_str, script->name );
+      str_append( &vm->temp_str, script->info->name );
       str_append( &vm->temp_str, "\"" );
    }
    else {
@@ -4,23 +4,64 @@
 #include <stdbool.h>
 
 #include "common/vector.h"
+#include "common/sparse.h"
+#include "common/hash.h"
+#include "common/random.h"
+#include "common/output.h"
+#include "common/fs.h"
 
-enum { MAX_MAP_VARS = 128 };
+// Number of map variables a module that is not a library has, at least. A
+// compiler leaves out the chunks of variables that are initialized to zero,
+// so such a module can use variables no chunk mentions.
+enum { DEFAULT_MAP_VARS = 128 };
 enum { MAX_WORLD_VARS = 256 };
 enum { MAX_GLOBAL_VARS = 64 };
+// Length of a tic in real time, in microseconds.
+enum { TIC_DURATION = 1000000 };
+// Size of a cache line, in bytes.
+enum { CACHE_LINE_SIZE = 64 };
 
 struct module_arg {
    const char* name;
    const char* path;
+   // When not NULL, the module is read from this buffer instead of from the
+   // file. The buffer must outlive the virtual machine.
+   const u8* data;
+   isize size;
 };
 
 struct options {
    const char* object_file;
    struct list libraries; // Contains paths to library files.
    struct list modules;   // Contains module_args.
+   const char* cache_dir; // Directory of module image cache, or NULL.
+   i32 jobs; // Number of threads used to load modules.
+   const char* map_name; // Map whose BEHAVIOR lump to run, or NULL.
+   u64 seed; // Seed of the random number generator.
+   bool seeded; // When false, a seed is picked at startup.
+   // Manifest or directory of object files to run in batch mode, or NULL.
+   const char* batch_path;
+   // Unix domain socket to serve requests on in server mode, or NULL.
+   const char* socket_path;
+   // How the server runs each request.
+   enum {
+      SERVERMODE_THREAD,
+      SERVERMODE_FORK,
+      SERVERMODE_RESET,
+   } server_mode;
+   // Tics a batch job or server request can run before it is stopped.
+   i32 tic_limit;
+   bool capture_output; // Keep the output in memory.
    bool verbose;
 };
 
+// Execution state of a virtual machine, saved by vm_checkpoint().
+struct checkpoint {
+   u8* data;
+   usize size;
+   usize capacity;
+};
+
 struct file_request {
    enum {
       FILEREQUESTERR_NONE,
@@ -29,6 +70,9 @@ struct file_request {
    } err;
    u8* data;
    usize size;
+   // Set when the file is mapped instead of copied.
+   struct fs_mapping mapping;
+   bool mapped;
 };
 
 struct indexed_string {
@@ -51,10 +95,62 @@ struct slot {
    bool is_string;
 };
 
+/**
+ * Values whose writes are recorded, so a reset or a checkpoint can handle
+ * only the pages that were written.
+ */
+struct dirty_region {
+   i32* values;
+   // Values saved by vm_save_pristine_state(), or NULL.
+   const i32* pristine;
+   // Flags of each page of values. A flag is set on the first write to the
+   // page since the flag was last cleared.
+   u8* pages;
+   isize size;
+};
+
+enum { DIRTY_PAGE_SHIFT = 6 }; // 64 values per page.
+
+enum {
+   PAGE_DIRTY_RESET = 0x1, // Written since the last reset.
+   PAGE_DIRTY_CHECKPOINT = 0x2, // Written since the last checkpoint.
+};
+
+struct dirty_page {
+   struct dirty_region* region;
+   isize page;
+};
+
+// Pages that have a flag set, in the order they were first written. Each
+// page is added at most once, so the log has room for every page.
+struct page_log {
+   struct dirty_page* pages;
+   isize size;
+};
+
+struct write_tracker {
+   // The world variables, the global variables, and then the variables of
+   // each module, in the order of the modules.
+   struct dirty_region* regions;
+   isize num_regions;
+   struct page_log reset_log;
+   struct page_log checkpoint_log;
+};
+
+/**
+ * Names and flags of a map variable, which the interpreter does not need. The
+ * interpreter goes through the tables of the module instead, which are
+ * resolved when the module is linked.
+ */
 struct var {
    const char* name;
+   // The value of a scalar variable, or the elements of an array.
    i32* elements;
-   i32 value;
+   // The elements of the variable, or NULL when writes are not recorded.
+   struct dirty_region* region;
+   // The variable that holds the value: the exported variable for an
+   // imported one, and the variable itself otherwise.
+   struct var* link;
    i32 size;
    bool array;
    bool imported;
@@ -73,9 +169,13 @@ enum script_flag {
    FLAG_CLIENTSIDE = 0x2,
 };
 
-struct script {
+/**
+ * Information about a script that is only needed when the script is loaded,
+ * started by type, or shown in a message. It is kept apart from the script,
+ * so the fields the interpreter uses stay close together.
+ */
+struct script_info {
    const char* name;
-   i32 number;
    enum {
       SCRIPTTYPE_UNKNOWN = -1,
       SCRIPTTYPE_CLOSED,
@@ -96,22 +196,29 @@ struct script {
       SCRIPTTYPE_REOPEN,
    } type;
    u32 flags;
+};
+
+struct script {
+   i32 number;
    i32 start; // Beginning of a script's code.
-   struct script_array* arrays;
    i32 num_vars;
    i32 num_arrays;
+   struct script_array* arrays;
    isize total_array_size;
+   struct script_info* info;
 };
 
-// An instance of a running script.
+/**
+ * An instance of a running script. The fields used to run the instance fit
+ * in a cache line, and instances are allocated on cache line boundaries by
+ * vm_alloc_instance().
+ */
 struct instance {
    struct script* script;
-   struct instance* next;
-   struct instance* next_waiting;
-   struct instance* waiting;
-   struct instance* waiting_tail;
    i32* vars;
    i32* arrays; // Array data.
+   isize ip; // Position of the instruction pointer for the script.
+   isize resume_time;
    i32 delay_amount;
    enum {
       SCRIPTSTATE_TERMINATED,
@@ -120,24 +227,43 @@ struct instance {
       SCRIPTSTATE_DELAYED,
       SCRIPTSTATE_WAITING,
    } state;
-   isize resume_time;
-   isize ip; // Position of the instruction pointer for the script.
+   // Instances waiting for this one to finish, or NULL if there are none.
+   struct list* waiting;
+};
+
+/**
+ * A queue of the instances waiting to run, sorted by delay amount. The
+ * scheduler only looks at the delay amounts and the resume times, so these
+ * are kept in arrays of their own, parallel to the array of instances. The
+ * entries before the head have been taken off the queue.
+ */
+struct run_queue {
+   struct instance** instances;
+   isize* resume_times;
+   i32* delay_amounts;
+   isize head;
+   isize tail;
+   isize capacity;
 };
 
 struct func {
    struct module* module;
-   const char* name;
    i32 params; // Number of parameters.
    i32 local_size;
    i32 start; // Offset to start of function code.
-   struct script_array* arrays;
    i32 num_arrays;
+   struct script_array* arrays;
    isize total_array_size;
    bool imported;
 };
 
+/**
+ * The names of the functions are only needed to link the modules, so they
+ * are kept in a table of their own, parallel to the entries.
+ */
 struct func_table {
    struct func* entries;
+   const char** names;
    struct func** linked_entries;
    i32 size;
 };
@@ -186,11 +312,31 @@ struct module {
    struct list imports;
    struct list scripts;
    struct list strings;
-   struct list waiting_scripts; // Queue of scripts waiting to run.
-   // Map scalar variables and arrays share the same namespace.
-   struct var vars[ MAX_MAP_VARS ];
-   struct var* map_vars[ MAX_MAP_VARS ];
+   struct run_queue waiting_scripts; // Queue of scripts waiting to run.
+   // Map scalar variables and arrays share the same namespace. The tables of
+   // variables have num_vars entries, sized from the chunks of the module.
+   struct var* vars;
+   // Values of the scalar variables the module defines.
+   i32* var_values;
+   // The following tables are resolved when the module is linked. For each
+   // variable, defined or imported, they hold where its value is, which is
+   // the first element for an array; the number of elements of an array; and
+   // the region that records writes to it, or NULL.
+   i32** map_vars;
+   i32* map_var_sizes;
+   struct dirty_region** map_var_regions;
+   i32 num_vars;
    struct func_table func_table;
+   // Lookup tables. Scripts are looked up by number. Variables and functions
+   // are looked up by name and only contain the ones the module exports.
+   struct hash_table script_table;
+   struct hash_table var_table;
+   struct hash_table func_name_table;
+   const char* path;
+   // Libraries are registered as soon as they are found, but their chunks
+   // are read only when something in them is first needed.
+   bool loaded;
+   bool linked;
 };
 
 struct turn {
@@ -203,19 +349,63 @@ struct turn {
    i32* stack;
 };
 
+struct vm;
+
+// A function of the host program that scripts can call. The arguments are
+// passed as a slice of the stack. The returned value is pushed if the call
+// produces a value.
+struct host_func {
+   i32 ( *run )( struct vm* vm, const i32* args, i32 num_args, void* data );
+   void* data;
+};
+
+// Calls to host functions that do not return a value, collected during a tic
+// and handed to the host in one batch at the end of the tic. The calls are
+// stored as parallel arrays. The arguments of all calls are stored together;
+// the arguments of call `i` are `args[ first_arg[ i ] ]` through
+// `args[ first_arg[ i ] + num_args[ i ] - 1 ]`.
+struct host_call_batch {
+   enum {
+      HOSTCALL_LSPEC,
+      HOSTCALL_BUILTIN,
+   }* kinds;
+   i32* ids; // Line special ID or builtin opcode.
+   i32* first_arg;
+   i32* num_args;
+   i32* args;
+   isize size;
+   isize total_args;
+   isize capacity;
+   isize args_capacity;
+};
+
+struct batch_handler {
+   void ( *run )( struct vm* vm, const struct host_call_batch* batch,
+      void* data );
+   void* data;
+};
+
 struct vm {
    struct options* options;
    jmp_buf* bail;
    //struct object* object;
    struct list modules;
+   struct hash_table module_table;
+   struct list images; // Files of loaded modules.
+   struct wad* wad; // Archive of the main module, or NULL.
    struct list scripts;
+   struct hash_table script_table;
    struct list waiting_scripts;
    struct list suspended_scripts;
+   // Block that the next instances are allocated from, and how many
+   // instances are left in it.
+   char* instance_block;
+   isize instances_left;
    struct str msg;
    i32 world_vars[ MAX_WORLD_VARS ];
    i32 global_vars[ MAX_GLOBAL_VARS ];
-   struct vector world_arrays[ MAX_WORLD_VARS ];
-   struct vector global_arrays[ MAX_GLOBAL_VARS ];
+   struct sparse_array world_arrays[ MAX_WORLD_VARS ];
+   struct sparse_array global_arrays[ MAX_GLOBAL_VARS ];
    isize tics;
    isize num_active_scripts;
    struct call* call_stack;
@@ -224,6 +414,46 @@ struct vm {
    // this table. This table also contains dynamically generated strings.
    struct indexed_string* str_table;
    struct vector strings;
+   // Host functions bound to line specials and CALLFUNC functions, by ID.
+   struct hash_table lspec_table;
+   struct hash_table callfunc_table;
+   // Host functions bound to builtins, indexed by opcode. Unbound entries
+   // have no function.
+   struct host_func* builtin_funcs;
+   // Batching of host calls is enabled when the handler has a function.
+   struct batch_handler batch_handler;
+   struct host_call_batch batch;
+   struct rng rng;
+   // Messages and printed text. Standard output by default.
+   struct output output;
+   // Set when the first part of a multi-part message was not shown.
+   bool diag_suppressed;
+   isize num_errs; // Errors and fatal errors reported so far.
+   // State to go back to on a reset, or NULL.
+   struct pristine_state* pristine;
+   // Regions of the variables whose writes are recorded, or NULL.
+   struct write_tracker* tracker;
+   struct dirty_region* world_region;
+   struct dirty_region* global_region;
+   // Page flags set by a write.
+   u8 dirty_flags;
+   // Identifies the last checkpoint saved or restored, or 0.
+   u64 checkpoint_id;
+   // The world and global arrays were emptied since the last checkpoint.
+   bool arrays_cleared;
+};
+
+enum { BUILTIN_MAX_ARGS = 9 };
+
+struct builtin {
+   const char* name;
+   // Returns the result of the builtin. The result is discarded if the
+   // builtin does not return a value.
+   i32 ( *run )( struct vm* vm, struct turn* turn,
+      const struct builtin* builtin, const i32* args );
+   i8 num_args;
+   bool direct; // Arguments follow the opcode instead of being on the stack.
+   bool returns_value;
 };
 
 #define DIAG_NONE 0x0
@@ -234,23 +464,99 @@ struct vm {
 #define DIAG_MULTI_PART 0x10
 #define DIAG_INTERNAL 0x20
 
+// When NO_DEBUG_DIAG is defined, debug messages are left out of the build.
+#ifdef NO_DEBUG_DIAG
+#   define DIAG_DEBUG_BUILD 0
+#else
+#   define DIAG_DEBUG_BUILD 1
+#endif
+
+/**
+ * Shows a message. The flags are checked before anything else, so the
+ * arguments of a message that is not shown are not even evaluated, and a
+ * debug message costs nothing when verbose mode is off. In a build without
+ * debug messages, the check is a constant, and the compiler removes the call.
+ */
+#define v_diag( vm, flags, ... ) \
+   ( v_diag_shown( vm, flags ) ? \
+      v_show_diag( vm, flags, __VA_ARGS__ ) : \
+      ( void ) ( ( vm )->diag_suppressed = \
+         ( ( ( flags ) & DIAG_MULTI_PART ) != 0 ) ) )
+// Adds to a multi-part message. Dropped if the first part was not shown.
+#define v_diag_more( vm, ... ) \
+   ( ( vm )->diag_suppressed ? ( void ) 0 : \
+      v_show_diag_more( vm, __VA_ARGS__ ) )
+#define v_diag_shown( vm, flags ) \
+   ( ( ( flags ) & DIAG_DBG ) == 0 || \
+      ( DIAG_DEBUG_BUILD && ( vm )->options->verbose ) )
+
 #define UNIMPLEMENTED \
    v_diag( vm, DIAG_FATALERR, \
       "instruction opcode %d not implemented", turn->opcode ); \
    v_bail( vm );
 
 void vm_run( struct options* options );
+void vm_init_options( struct options* options );
+void vm_init( struct vm* vm, struct options* options );
+bool vm_exec( struct vm* vm );
+void vm_start( struct vm* vm );
+void vm_start_open_scripts( struct vm* vm );
+void vm_run_tics( struct vm* vm, isize tics );
+bool vm_scripts_waiting( struct vm* vm );
+bool vm_run_batch( struct options* options );
+bool vm_serve( struct options* options );
+bool vm_start_script( struct vm* vm, i32 number, const i32* args,
+   i32 num_args );
+void vm_bind_lspec( struct vm* vm, i32 id, struct host_func func );
+bool vm_bind_builtin( struct vm* vm, i32 opcode, struct host_func func );
+void vm_bind_callfunc( struct vm* vm, i32 id, struct host_func func );
+struct host_func* vm_find_lspec_binding( struct vm* vm, i32 id );
+struct host_func* vm_find_callfunc_binding( struct vm* vm, i32 id );
+void vm_set_batch_handler( struct vm* vm, struct batch_handler handler );
+bool vm_batch_host_call( struct vm* vm, i32 kind, i32 id, const i32* args,
+   i32 num_args );
+void vm_flush_host_calls( struct vm* vm );
+void vm_init_host_calls( struct vm* vm );
+void vm_reset_host_calls( struct vm* vm );
 void vm_load_modules( struct vm* vm );
+struct func* vm_link_func( struct vm* vm, struct module* module, i32 index );
+struct script* vm_load_script( struct vm* vm, i32 number );
+struct module* vm_get_module( struct vm* vm, const char* name );
+void vm_link_all_modules( struct vm* vm );
+void vm_save_pristine_state( struct vm* vm );
+void vm_track_writes( struct vm* vm );
+void vm_record_page( struct vm* vm, struct dirty_region* region, isize page );
+void vm_record_writes( struct vm* vm, struct dirty_region* region,
+   isize start, isize count );
+void vm_clear_dirty_pages( struct vm* vm, u8 flag );
+void vm_reset( struct vm* vm );
+void vm_clear_run_state( struct vm* vm );
+void vm_clear_arrays( struct vm* vm );
+void vm_init_checkpoint( struct checkpoint* checkpoint );
+void vm_deinit_checkpoint( struct checkpoint* checkpoint );
+bool vm_checkpoint( struct vm* vm, struct checkpoint* checkpoint );
+bool vm_checkpoint_increment( struct vm* vm, struct checkpoint* checkpoint );
+bool vm_restore( struct vm* vm, const void* data, usize size );
 void vm_init_file_request( struct file_request* request );
 void vm_load_file( struct file_request* request, const char* path );
+void vm_map_file( struct file_request* request, const char* path );
+void vm_free_file( struct file_request* request );
+bool vm_restore_cached_module( struct vm* vm, struct module* module,
+   const char* path );
+void vm_cache_module( struct vm* vm, struct module* module,
+   const char* path );
 void vm_init_object( struct object* object, const u8* data, int size );
+void vm_alloc_map_vars( struct module* module, i32 num_vars );
 void vm_run_instruction( struct vm* vm, struct turn* turn );
 struct instance* vm_get_active_script( struct vm* vm, int number );
+struct instance* vm_alloc_instance( struct vm* vm, struct script* script );
+void vm_init_run_queue( struct run_queue* queue );
+void vm_enq_script( struct run_queue* queue, struct instance* instance );
 struct script* vm_remove_suspended_script( struct vm* vm, i32 script_number );
 struct func* vm_find_func( struct vm* vm, struct module* module, i32 index );
 i32* vm_alloc_local_array_space( isize count );
-void v_diag( struct vm* machine, int flags, ... );
-void v_diag_more( struct vm* machine, ... );
+void v_show_diag( struct vm* machine, int flags, ... );
+void v_show_diag_more( struct vm* machine, ... );
 void v_bail( struct vm* machine );
 isize vm_get_stack_size( struct turn* turn );
 i32* vm_get_map_var( struct vm* vm, struct module* module, i32 index );
@@ -259,6 +565,9 @@ const char* vm_present_script( struct vm* vm, struct script* script );
 void vm_run_lspec( struct vm* vm, struct turn* turn );
 void vm_push( struct turn* turn, i32 value );
 i32 vm_pop( struct vm* vm, struct turn* turn );
+i32* vm_pop_args( struct vm* vm, struct turn* turn, i32 count );
 void vm_run_callfunc( struct vm* vm, struct turn* turn );
+const struct builtin* vm_find_builtin( i32 opcode );
+void vm_run_builtin( struct vm* vm, struct turn* turn );
 
 #endif
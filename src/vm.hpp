@@ -0,0 +1,227 @@
+#ifndef SRC_VM_HPP
+#define SRC_VM_HPP
+
+/**
+ * C++ interface for programs that embed the virtual machine
+ *
+ * Host functions are bound by giving their address as a template argument.
+ * For each function, a thunk with the signature of a host function is
+ * generated at compile time. The thunk reads the arguments straight from the
+ * stack slice, converts them to the parameter types of the function, calls
+ * the function, and returns its result, so a bound function costs the same as
+ * a handler written in C.
+ *
+ * Errors in the virtual machine are handled with longjmp(), which skips C++
+ * destructors. A bound function should not call back into the virtual
+ * machine while it owns objects with destructors.
+ *
+ *    i32 door_raise( i32 tag, i32 speed ) { ... }
+ *    acsvm::memory memory;
+ *    acsvm::machine machine;
+ *    machine.add_module( "", "main.o" );
+ *    machine.bind_lspec< ACSVM_HOST_FUNC( door_raise ) >( 12 );
+ *    machine.exec();
+ */
+
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <deque>
+
+extern "C" {
+#include "common/misc.h"
+#include "common/mem.h"
+#include "common/str.h"
+#include "common/list.h"
+#include "vm.h"
+}
+
+// Expands to the template arguments that identify a function to bind.
+#define ACSVM_HOST_FUNC( func ) decltype( &func ), &func
+
+namespace acsvm {
+namespace detail {
+
+template <int... I>
+struct indexes {};
+
+template <int N, int... I>
+struct make_indexes : make_indexes<N - 1, N - 1, I...> {};
+
+template <int... I>
+struct make_indexes<0, I...> {
+   typedef indexes<I...> type;
+};
+
+// Converts a value from the stack to a parameter type, and a return value
+// back to a stack value.
+template <typename T>
+struct value {
+   static T from_stack( i32 v ) { return static_cast<T>( v ); }
+   static i32 to_stack( T v ) { return static_cast<i32>( v ); }
+};
+
+template <>
+struct value<bool> {
+   static bool from_stack( i32 v ) { return v != 0; }
+   static i32 to_stack( bool v ) { return v ? 1 : 0; }
+};
+
+template <typename Sig>
+struct thunk;
+
+template <typename R, typename... Args>
+struct thunk<R ( * )( Args... )> {
+   enum { arity = sizeof...( Args ) };
+
+   // A call can give fewer arguments than the function takes; the missing
+   // arguments are 0. More arguments than the function takes is an error.
+   static bool check_args( struct vm* vm, i32 num_args ) {
+      if ( num_args > arity ) {
+         v_diag( vm, DIAG_FATALERR,
+            "host function takes %d arguments, but %d were given",
+            static_cast<int>( arity ), num_args );
+         v_bail( vm );
+      }
+      return num_args == arity;
+   }
+
+   static i32 arg( const i32* args, i32 num_args, int index ) {
+      return ( index < num_args ) ? args[ index ] : 0;
+   }
+
+   template <R ( *F )( Args... ), int... I>
+   static R call( const i32* args, i32 num_args, indexes<I...> ) {
+      if ( num_args == arity ) {
+         return F( value<Args>::from_stack( args[ I ] )... );
+      }
+      return F( value<Args>::from_stack( arg( args, num_args, I ) )... );
+   }
+
+   template <R ( *F )( Args... )>
+   static i32 run( struct vm* vm, const i32* args, i32 num_args, void* ) {
+      check_args( vm, num_args );
+      return value<R>::to_stack( call<F>( args, num_args,
+         typename make_indexes<arity>::type() ) );
+   }
+};
+
+template <typename... Args>
+struct thunk<void ( * )( Args... )> {
+   enum { arity = sizeof...( Args ) };
+
+   template <void ( *F )( Args... )>
+   static i32 run( struct vm* vm, const i32* args, i32 num_args, void* ) {
+      thunk<int ( * )( Args... )>::check_args( vm, num_args );
+      call<F>( args, num_args, typename make_indexes<arity>::type() );
+      return 0;
+   }
+
+   template <void ( *F )( Args... ), int... I>
+   static void call( const i32* args, i32 num_args, indexes<I...> ) {
+      if ( num_args == arity ) {
+         F( value<Args>::from_stack( args[ I ] )... );
+      }
+      else {
+         F( value<Args>::from_stack(
+            thunk<int ( * )( Args... )>::arg( args, num_args, I ) )... );
+      }
+   }
+};
+
+}
+
+/**
+ * Makes a host function out of a C++ function. The function can take any
+ * number of parameters, and each parameter and the return type must be
+ * convertible from and to an integer.
+ */
+template <typename Sig, Sig F>
+inline struct host_func make_host_func() {
+   struct host_func func;
+   func.run = &detail::thunk<Sig>::template run<F>;
+   func.data = NULL;
+   return func;
+}
+
+/**
+ * Initializes the memory allocator, and frees every allocation when
+ * destroyed. Create one before any machine and destroy it after the last
+ * machine.
+ */
+class memory {
+public:
+   memory() { mem_init(); }
+   ~memory() { mem_free_all(); }
+
+private:
+   memory( const memory& );
+   memory& operator=( const memory& );
+};
+
+/**
+ * A virtual machine, together with its options.
+ */
+class machine {
+public:
+   machine() {
+      vm_init_options( &options_ );
+      vm_init( &vm_, &options_ );
+   }
+
+   struct vm* get() { return &vm_; }
+   struct options* options() { return &options_; }
+
+   // The main module has an empty name.
+   void add_module( const char* name, const char* path ) {
+      struct module_arg arg;
+      arg.name = name;
+      arg.path = path;
+      arg.data = NULL;
+      arg.size = 0;
+      module_args_.push_back( arg );
+      list_append( &options_.modules, &module_args_.back() );
+      if ( name[ 0 ] == '\0' ) {
+         options_.object_file = path;
+      }
+   }
+
+   template <typename Sig, Sig F>
+   void bind_lspec( i32 id ) {
+      vm_bind_lspec( &vm_, id, make_host_func<Sig, F>() );
+   }
+
+   template <typename Sig, Sig F>
+   void bind_callfunc( i32 id ) {
+      vm_bind_callfunc( &vm_, id, make_host_func<Sig, F>() );
+   }
+
+   // Returns false if the opcode does not run a builtin, or if the function
+   // does not take as many arguments as the builtin.
+   template <typename Sig, Sig F>
+   bool bind_builtin( i32 opcode ) {
+      const struct builtin* builtin = vm_find_builtin( opcode );
+      if ( builtin == NULL ||
+         builtin->num_args != detail::thunk<Sig>::arity ) {
+         return false;
+      }
+      return vm_bind_builtin( &vm_, opcode, make_host_func<Sig, F>() );
+   }
+
+   // Returns false if execution stopped because of an error.
+   bool exec() { return vm_exec( &vm_ ); }
+
+private:
+   machine( const machine& );
+   machine& operator=( const machine& );
+
+   struct options options_;
+   struct vm vm_;
+   // A deque does not move its elements, so the list of modules in the
+   // options can point to them.
+   std::deque<struct module_arg> module_args_;
+};
+
+}
+
+#endif
@@ -0,0 +1,175 @@
+/**
+ * This file reads WAD archives. The archive is mapped into memory and its
+ * directory is indexed by lump name, so object files can be loaded straight
+ * from the lumps without copying them out of the archive.
+ */
+
+#include <string.h>
+#include <ctype.h>
+
+#include "common/misc.h"
+#include "common/mem.h"
+#include "common/fs.h"
+#include "common/hash.h"
+#include "wad.h"
+
+struct header {
+   char id[ 4 ];
+   i32 num_lumps;
+   i32 dir_offset;
+};
+
+struct dir_entry {
+   i32 offset;
+   i32 size;
+   char name[ WAD_LUMP_NAME_MAX_LENGTH ];
+};
+
+static bool read_dir( struct wad* wad );
+static void index_lumps( struct wad* wad );
+static void normalize_name( const char* name, char* buffer );
+
+/**
+ * Maps the archive into memory and indexes its lumps. Returns false if the
+ * file cannot be mapped or is not a WAD archive.
+ */
+bool wad_open( struct wad* wad, const char* path ) {
+   if ( ! fs_map_file( path, &wad->mapping ) ) {
+      return false;
+   }
+   wad->path = path;
+   wad->lumps = NULL;
+   wad->num_lumps = 0;
+   hash_init( &wad->lump_table );
+   hash_init( &wad->library_table );
+   if ( ! read_dir( wad ) ) {
+      wad_close( wad );
+      return false;
+   }
+   index_lumps( wad );
+   return true;
+}
+
+static bool read_dir( struct wad* wad ) {
+   const u8* data = wad->mapping.data;
+   usize size = wad->mapping.size;
+   struct header header;
+   if ( size < sizeof( header ) ) {
+      return false;
+   }
+   memcpy( &header, data, sizeof( header ) );
+   if ( ! ( memcmp( header.id, "IWAD", 4 ) == 0 ||
+      memcmp( header.id, "PWAD", 4 ) == 0 ) ) {
+      return false;
+   }
+   if ( header.num_lumps < 0 || header.dir_offset < 0 ||
+      ( usize ) header.dir_offset > size ||
+      ( size - header.dir_offset ) / sizeof( struct dir_entry ) <
+      ( usize ) header.num_lumps ) {
+      return false;
+   }
+   wad->lumps = mem_alloc( sizeof( wad->lumps[ 0 ] ) * header.num_lumps );
+   wad->num_lumps = header.num_lumps;
+   for ( i32 i = 0; i < header.num_lumps; ++i ) {
+      struct dir_entry entry;
+      memcpy( &entry, data + header.dir_offset + sizeof( entry ) * i,
+         sizeof( entry ) );
+      if ( entry.offset < 0 || entry.size < 0 ||
+         ( usize ) entry.offset > size ||
+         ( usize ) entry.size > size - entry.offset ) {
+         return false;
+      }
+      struct wad_lump* lump = &wad->lumps[ i ];
+      memcpy( lump->name, entry.name, WAD_LUMP_NAME_MAX_LENGTH );
+      lump->name[ WAD_LUMP_NAME_MAX_LENGTH ] = '\0';
+      normalize_name( lump->name, lump->name );
+      lump->data = data + entry.offset;
+      lump->size = entry.size;
+   }
+   return true;
+}
+
+static void index_lumps( struct wad* wad ) {
+   // The table keeps the first entry added for a name, so add the lumps in
+   // reverse to have later lumps override earlier ones.
+   bool in_libraries = false;
+   for ( i32 i = wad->num_lumps - 1; i >= 0; --i ) {
+      struct wad_lump* lump = &wad->lumps[ i ];
+      hash_add_name( &wad->lump_table, lump->name, lump );
+      if ( strcmp( lump->name, "A_END" ) == 0 ) {
+         in_libraries = true;
+      }
+      else if ( strcmp( lump->name, "A_START" ) == 0 ) {
+         in_libraries = false;
+      }
+      else if ( in_libraries ) {
+         hash_add_name( &wad->library_table, lump->name, lump );
+      }
+   }
+}
+
+/**
+ * Lump names are upper case, and at most eight characters long.
+ */
+static void normalize_name( const char* name, char* buffer ) {
+   isize i = 0;
+   while ( i < WAD_LUMP_NAME_MAX_LENGTH && name[ i ] != '\0' ) {
+      buffer[ i ] = toupper( ( unsigned char ) name[ i ] );
+      ++i;
+   }
+   buffer[ i ] = '\0';
+}
+
+struct wad_lump* wad_find_lump( struct wad* wad, const char* name ) {
+   char buffer[ WAD_LUMP_NAME_MAX_LENGTH + 1 ];
+   normalize_name( name, buffer );
+   return hash_find_name( &wad->lump_table, buffer );
+}
+
+struct wad_lump* wad_find_library( struct wad* wad, const char* name ) {
+   char buffer[ WAD_LUMP_NAME_MAX_LENGTH + 1 ];
+   normalize_name( name, buffer );
+   return hash_find_name( &wad->library_table, buffer );
+}
+
+/**
+ * Finds the BEHAVIOR lump of a map. If no map is specified, the first
+ * BEHAVIOR lump in the archive is returned.
+ */
+struct wad_lump* wad_find_behavior( struct wad* wad, const char* map ) {
+   if ( map == NULL ) {
+      for ( i32 i = 0; i < wad->num_lumps; ++i ) {
+         if ( strcmp( wad->lumps[ i ].name, "BEHAVIOR" ) == 0 ) {
+            return &wad->lumps[ i ];
+         }
+      }
+      return NULL;
+   }
+   struct wad_lump* marker = wad_find_lump( wad, map );
+   if ( marker == NULL ) {
+      return NULL;
+   }
+   // The lumps of a map follow its marker. The first one is THINGS, or
+   // TEXTMAP in the UDMF format, so seeing one of them again means the next
+   // map has been reached.
+   for ( i32 i = ( marker - wad->lumps ) + 2; i < wad->num_lumps; ++i ) {
+      const char* name = wad->lumps[ i ].name;
+      if ( strcmp( name, "BEHAVIOR" ) == 0 ) {
+         return &wad->lumps[ i ];
+      }
+      if ( strcmp( name, "THINGS" ) == 0 || strcmp( name, "TEXTMAP" ) == 0 ||
+         strcmp( name, "ENDMAP" ) == 0 ) {
+         break;
+      }
+   }
+   return NULL;
+}
+
+void wad_close( struct wad* wad ) {
+   hash_deinit( &wad->library_table );
+   hash_deinit( &wad->lump_table );
+   if ( wad->lumps != NULL ) {
+      mem_free( wad->lumps );
+   }
+   fs_unmap_file( &wad->mapping );
+}
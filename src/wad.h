@@ -0,0 +1,36 @@
+#ifndef SRC_WAD_H
+#define SRC_WAD_H
+
+/**
+ * WAD archives
+ *
+ * The archive is mapped into memory, and lumps are accessed in place.
+ */
+
+enum { WAD_LUMP_NAME_MAX_LENGTH = 8 };
+
+struct wad_lump {
+   char name[ WAD_LUMP_NAME_MAX_LENGTH + 1 ]; // Plus one for NUL character.
+   const u8* data;
+   i32 size;
+};
+
+struct wad {
+   const char* path;
+   struct fs_mapping mapping;
+   struct wad_lump* lumps;
+   i32 num_lumps;
+   // Lumps by name. When names repeat, the last lump is found, like in the
+   // game.
+   struct hash_table lump_table;
+   // Lumps between the A_START and A_END markers, where libraries are kept.
+   struct hash_table library_table;
+};
+
+bool wad_open( struct wad* wad, const char* path );
+struct wad_lump* wad_find_lump( struct wad* wad, const char* name );
+struct wad_lump* wad_find_library( struct wad* wad, const char* name );
+struct wad_lump* wad_find_behavior( struct wad* wad, const char* map );
+void wad_close( struct wad* wad );
+
+#endif